@@ -0,0 +1,108 @@
+#include <string>
+
+#include "squash_api.h"
+
+#include "common/buffer/buffer_impl.h"
+#include "common/http/headers.h"
+#include "common/http/message_impl.h"
+#include "common/json/json_loader.h"
+
+namespace Solo {
+namespace Squash {
+
+Envoy::Http::MessagePtr
+SquashApi::createAttachmentRequest(const std::string &attachment_json) {
+  Envoy::Http::MessagePtr request(new Envoy::Http::RequestMessageImpl());
+  request->headers().insertContentType().value().setReference(
+      Envoy::Http::Headers::get().ContentTypeValues.Json);
+  request->headers().insertPath().value().setReference(postAttachmentPath());
+  request->headers().insertHost().value().setReference(severAuthority());
+  request->headers().insertMethod().value().setReference(
+      Envoy::Http::Headers::get().MethodValues.Post);
+  request->body().reset(new Envoy::Buffer::OwnedImpl(attachment_json));
+  return request;
+}
+
+Envoy::Http::MessagePtr
+SquashApi::getAttachmentRequest(const std::string &attachment_path) {
+  Envoy::Http::MessagePtr request(new Envoy::Http::RequestMessageImpl());
+  request->headers().insertMethod().value().setReference(
+      Envoy::Http::Headers::get().MethodValues.Get);
+  request->headers().insertPath().value().setCopy(attachment_path.c_str(),
+                                                  attachment_path.size());
+  request->headers().insertHost().value().setReference(severAuthority());
+  return request;
+}
+
+Envoy::Http::MessagePtr
+SquashApi::deleteAttachmentRequest(const std::string &attachment_path) {
+  Envoy::Http::MessagePtr request = getAttachmentRequest(attachment_path);
+  request->headers().Method()->value().setReference(
+      Envoy::Http::Headers::get().MethodValues.Delete);
+  return request;
+}
+
+std::string SquashApi::attachmentPath(const std::string &attachment_name) {
+  return postAttachmentPath() + "/" + attachment_name;
+}
+
+std::string SquashApi::attachmentName(Envoy::Http::Message &response) {
+  if (response.headers().Status()->value() != "201") {
+    return "";
+  }
+
+  try {
+    Envoy::Json::ObjectSharedPtr json_config =
+        Envoy::Json::Factory::loadFromString(bodyAsString(response));
+    return json_config->getObject("metadata", true)->getString("name", "");
+  } catch (Envoy::Json::Exception &) {
+    return "";
+  }
+}
+
+SquashApi::AttachmentStatus
+SquashApi::attachmentStatus(Envoy::Http::Message &response) {
+  AttachmentStatus status;
+  try {
+    Envoy::Json::ObjectSharedPtr json_config =
+        Envoy::Json::Factory::loadFromString(bodyAsString(response));
+    Envoy::Json::ObjectSharedPtr json_status =
+        json_config->getObject("status", true);
+    status.state = json_status->getString("state", "");
+    status.endpoint = json_status->getString("endpoint", "");
+  } catch (Envoy::Json::Exception &) {
+    // no state yet.. leave it empty for the retry logic.
+  }
+  return status;
+}
+
+std::string SquashApi::bodyAsString(const Envoy::Buffer::Instance &data) {
+  uint64_t num_slices = data.getRawSlices(nullptr, 0);
+  Envoy::Buffer::RawSlice slices[num_slices];
+  data.getRawSlices(slices, num_slices);
+  std::string body;
+  for (Envoy::Buffer::RawSlice &slice : slices) {
+    body.append(static_cast<const char *>(slice.mem_), slice.len_);
+  }
+  return body;
+}
+
+std::string SquashApi::bodyAsString(Envoy::Http::Message &message) {
+  if (!message.body()) {
+    return "";
+  }
+  return bodyAsString(*message.body());
+}
+
+const std::string &SquashApi::postAttachmentPath() {
+  static std::string *val = new std::string("/api/v2/debugattachment");
+  return *val;
+}
+
+const std::string &SquashApi::severAuthority() {
+  static std::string *val = new std::string("squash-server");
+  return *val;
+}
+
+} // namespace Squash
+} // namespace Solo
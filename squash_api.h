@@ -0,0 +1,63 @@
+#pragma once
+
+#include <string>
+
+#include "envoy/buffer/buffer.h"
+#include "envoy/http/message.h"
+
+namespace Solo {
+namespace Squash {
+
+/**
+ * Builds and parses the messages of the squash server REST api.
+ */
+class SquashApi {
+public:
+  /**
+   * @return a POST creating a debugattachment object from attachment_json.
+   */
+  static Envoy::Http::MessagePtr
+  createAttachmentRequest(const std::string &attachment_json);
+
+  /**
+   * @return a GET for the debugattachment at attachment_path.
+   */
+  static Envoy::Http::MessagePtr
+  getAttachmentRequest(const std::string &attachment_path);
+
+  /**
+   * @return a DELETE for the debugattachment at attachment_path.
+   */
+  static Envoy::Http::MessagePtr
+  deleteAttachmentRequest(const std::string &attachment_path);
+
+  static std::string attachmentPath(const std::string &attachment_name);
+
+  /**
+   * @return the name of the debugattachment in a create response or an empty
+   *         string if the response is not a created debugattachment.
+   */
+  static std::string attachmentName(Envoy::Http::Message &response);
+
+  struct AttachmentStatus {
+    // status.state, or empty if there is none yet.
+    std::string state;
+    // status.endpoint, or empty.
+    std::string endpoint;
+  };
+
+  /**
+   * @return the status of the debugattachment in a get response. Parses the
+   *         body once for all of its fields.
+   */
+  static AttachmentStatus attachmentStatus(Envoy::Http::Message &response);
+
+  static std::string bodyAsString(const Envoy::Buffer::Instance &data);
+  static std::string bodyAsString(Envoy::Http::Message &message);
+
+  static const std::string &postAttachmentPath();
+  static const std::string &severAuthority();
+};
+
+} // namespace Squash
+} // namespace Solo
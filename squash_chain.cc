@@ -0,0 +1,171 @@
+#include <string>
+#include <vector>
+
+#include "squash_chain.h"
+#include "squash_worker.h"
+
+namespace Solo {
+namespace Squash {
+
+ChainAttach::ChainAttach(SquashFilterConfigSharedPtr config,
+                         Envoy::Upstream::ClusterManager &cm,
+                         const std::vector<std::string> &services)
+    : worker_(config->worker()),
+      attachment_timeout_(config->attachment_timeout()), creations_() {
+  for (const std::string &service : services) {
+    creations_.emplace_back(new ChainCreation(
+        worker_, config->createChainClient(cm, service), service,
+        config->chainAttachment(service)));
+  }
+}
+
+ChainAttach::~ChainAttach() { release(); }
+
+void ChainAttach::start() {
+  ENVOY_LOG(debug, "Squash: creating attachments for {} services down the chain",
+            creations_.size());
+  RequestScheduler::Deadline deadline =
+      worker_.timeSource().currentTime() + attachment_timeout_;
+  for (ChainCreationPtr &creation : creations_) {
+    creation->start(deadline);
+  }
+}
+
+std::string ChainAttach::finish() {
+  std::string token;
+  for (ChainCreationPtr &creation : creations_) {
+    if (creation->attachment_name().empty()) {
+      // its sidecar creates one of its own.
+      continue;
+    }
+    if (!token.empty()) {
+      token += ",";
+    }
+    token += creation->service() + "=" + creation->attachment_name();
+  }
+  release();
+  return token;
+}
+
+void ChainAttach::abandon() {
+  for (ChainCreationPtr &creation : creations_) {
+    if (!creation->attachment_name().empty()) {
+      worker_.abandonAttachment(creation->attachment_name(),
+                                creation->shard_key());
+    }
+  }
+  release();
+}
+
+void ChainAttach::release() {
+  for (ChainCreationPtr &creation : creations_) {
+    if (creation->inFlight()) {
+      worker_.adoptChainCreation(std::move(creation));
+    } else {
+      creation->cancel();
+    }
+  }
+  creations_.clear();
+}
+
+std::vector<std::string> ChainAttach::parseServices(const std::string &header) {
+  std::vector<std::string> services;
+  size_t start = 0;
+  while (start <= header.size() && services.size() < MAX_SERVICES) {
+    size_t end = header.find(',', start);
+    if (end == std::string::npos) {
+      end = header.size();
+    }
+    size_t first = header.find_first_not_of(" \t", start);
+    if (first < end) {
+      size_t last = header.find_last_not_of(" \t", end - 1);
+      services.push_back(header.substr(first, last + 1 - first));
+    }
+    start = end + 1;
+  }
+  return services;
+}
+
+std::string ChainAttach::attachmentFor(const std::string &token,
+                                       const std::string &service) {
+  const std::string prefix = service + "=";
+  size_t start = 0;
+  while (start < token.size()) {
+    size_t end = token.find(',', start);
+    if (end == std::string::npos) {
+      end = token.size();
+    }
+    if (start + prefix.size() <= end &&
+        token.compare(start, prefix.size(), prefix) == 0) {
+      std::string attachment_name =
+          token.substr(start + prefix.size(), end - start - prefix.size());
+      return validAttachmentName(attachment_name) ? attachment_name : "";
+    }
+    start = end + 1;
+  }
+  return "";
+}
+
+bool ChainAttach::validAttachmentName(const std::string &name) {
+  return !name.empty() && name.size() <= MAX_ATTACHMENT_NAME &&
+         name.find_first_not_of("abcdefghijklmnopqrstuvwxyz0123456789-") ==
+             std::string::npos;
+}
+
+ChainCreation::ChainCreation(SquashWorker &worker, SquashClientPtr &&client,
+                             const std::string &service,
+                             const std::string &shard_key)
+    : worker_(worker), client_(std::move(client)), service_(service),
+      shard_key_(shard_key), attachment_name_(), queue_position_(),
+      queued_(false), holds_slot_(false), orphaned_(false) {}
+
+ChainCreation::~ChainCreation() { cancel(); }
+
+void ChainCreation::start(RequestScheduler::Deadline deadline) {
+  if (worker_.scheduler().acquire(*this, deadline, queue_position_)) {
+    onScheduled();
+    return;
+  }
+  queued_ = true;
+}
+
+void ChainCreation::cancel() {
+  if (queued_) {
+    queued_ = false;
+    worker_.scheduler().dequeue(queue_position_);
+  }
+  client_->cancel();
+  releaseSlot();
+}
+
+void ChainCreation::onScheduled() {
+  queued_ = false;
+  holds_slot_ = true;
+  client_->createAttachment(*this);
+}
+
+void ChainCreation::onAttachmentCreated(const std::string &attachment_name) {
+  if (attachment_name.empty()) {
+    ENVOY_LOG(info, "Squash: can't create attachment for {}", service_);
+  }
+  attachment_name_ = attachment_name;
+  if (orphaned_) {
+    if (!attachment_name.empty()) {
+      // created after the stream was done with it.
+      worker_.abandonAttachment(attachment_name, shard_key_);
+    }
+    worker_.onChainCreationDone(*this);
+  }
+  releaseSlot();
+}
+
+void ChainCreation::releaseSlot() {
+  if (holds_slot_) {
+    holds_slot_ = false;
+    // may start the next queued request inline.
+    worker_.scheduler().release();
+  }
+}
+
+} // namespace Squash
+} // namespace Solo
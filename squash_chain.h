@@ -0,0 +1,164 @@
+#pragma once
+
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "envoy/event/deferred_deletable.h"
+#include "envoy/upstream/cluster_manager.h"
+
+#include "common/common/linked_object.h"
+#include "common/common/logger.h"
+
+#include "squash_client.h"
+#include "squash_filter_config.h"
+#include "squash_scheduler.h"
+
+namespace Solo {
+namespace Squash {
+
+class SquashWorker;
+
+/**
+ * Creates the chain attachment of one service. The create waits for a slot
+ * of the worker's RequestScheduler. A create still in flight when the
+ * ChainAttach is done with it is handed to the worker rather than cancelled,
+ * as the squash server may have created the attachment already; the
+ * attachment it returns is then abandoned.
+ */
+class ChainCreation : public SquashClientCallbacks,
+                      public ScheduledRequest,
+                      public Envoy::LinkedObject<ChainCreation>,
+                      public Envoy::Event::DeferredDeletable,
+                      protected Envoy::Logger::Loggable<Envoy::Logger::Id::filter> {
+public:
+  /**
+   * @param shard_key the rendered chain attachment, which ranks the squash
+   *        clusters.
+   */
+  ChainCreation(SquashWorker &worker, SquashClientPtr &&client,
+                const std::string &service, const std::string &shard_key);
+  ~ChainCreation();
+
+  void start(RequestScheduler::Deadline deadline);
+
+  /**
+   * Cancels the create, whether queued or in flight.
+   */
+  void cancel();
+
+  /**
+   * Has the attachment created from now on abandoned.
+   */
+  void orphan() { orphaned_ = true; }
+
+  /**
+   * @return whether the create was sent and not answered yet.
+   */
+  bool inFlight() const { return holds_slot_; }
+
+  const std::string &service() const { return service_; }
+  const std::string &shard_key() const { return shard_key_; }
+  const std::string &attachment_name() const { return attachment_name_; }
+
+  // ScheduledRequest
+  void onScheduled() override;
+
+  // SquashClientCallbacks
+  void onAttachmentCreated(const std::string &attachment_name) override;
+  void onAttachmentState(const std::string &, const std::string &,
+                         bool) override {}
+  void onAttachmentWatched() override {}
+  void onAttachmentsDeleted(bool) override {}
+
+private:
+  void releaseSlot();
+
+  SquashWorker &worker_;
+  SquashClientPtr client_;
+  const std::string service_;
+  const std::string shard_key_;
+  std::string attachment_name_;
+  RequestScheduler::Queue::iterator queue_position_;
+  bool queued_;
+  bool holds_slot_;
+  bool orphaned_;
+};
+
+typedef std::unique_ptr<ChainCreation> ChainCreationPtr;
+
+/**
+ * Creates the attachments for the services further down a debug request's
+ * call chain, all in parallel, so that their sidecars only need to confirm
+ * them. The created attachments are handed downstream as a session token of
+ * service=attachment pairs.
+ */
+class ChainAttach
+    : protected Envoy::Logger::Loggable<Envoy::Logger::Id::filter> {
+public:
+  ChainAttach(SquashFilterConfigSharedPtr config,
+              Envoy::Upstream::ClusterManager &cm,
+              const std::vector<std::string> &services);
+  ~ChainAttach();
+
+  /**
+   * Schedules a create request per service, due with the session of the
+   * stream.
+   */
+  void start();
+
+  /**
+   * Drops the creates still queued; the ones in flight go to the worker,
+   * which abandons what they create.
+   * @return the session token for the attachments created so far, empty if
+   *         there are none.
+   */
+  std::string finish();
+
+  /**
+   * Like finish(), but abandons the created attachments too, as no request
+   * will reach the services.
+   */
+  void abandon();
+
+  /**
+   * @return the services listed in a x-squash-debug-chain header, at most
+   *         MAX_SERVICES.
+   */
+  static std::vector<std::string> parseServices(const std::string &header);
+
+  /**
+   * @return the attachment a session token names for service, or an empty
+   *         string. The token comes from the client; a name the squash
+   *         server could not have made is ignored.
+   */
+  static std::string attachmentFor(const std::string &token,
+                                   const std::string &service);
+
+private:
+  // bounds the fan-out a single request can cause.
+  static const size_t MAX_SERVICES = 16;
+  // the longest name of a kubernetes object.
+  static const size_t MAX_ATTACHMENT_NAME = 253;
+
+  /**
+   * @return whether name only has the characters of a squash server
+   *         attachment name, so it can't reach another path of its api.
+   */
+  static bool validAttachmentName(const std::string &name);
+
+  /**
+   * Hands the creates in flight to the worker and cancels the rest.
+   */
+  void release();
+
+  SquashWorker &worker_;
+  const std::chrono::milliseconds attachment_timeout_;
+  std::vector<ChainCreationPtr> creations_;
+};
+
+typedef std::unique_ptr<ChainAttach> ChainAttachPtr;
+
+} // namespace Squash
+} // namespace Solo
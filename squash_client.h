@@ -0,0 +1,79 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "envoy/common/pure.h"
+
+namespace Solo {
+namespace Squash {
+
+/**
+ * Results of the requests made through a SquashClient.
+ */
+class SquashClientCallbacks {
+public:
+  virtual ~SquashClientCallbacks() {}
+
+  /**
+   * Called when a create request completes. May be called inline.
+   * @param attachment_name the name of the created debugattachment, or an
+   *        empty string if it could not be created.
+   */
+  virtual void onAttachmentCreated(const std::string &attachment_name) PURE;
+
+  /**
+   * Called with the state of a debugattachment. May be called inline.
+   * @param state the status.state of the attachment, or an empty string if
+   *        the request failed or the attachment has no state yet.
+   * @param endpoint the status.endpoint of the attachment, may be empty.
+   * @param more true if the client will report the state again without
+   *        another getAttachment() call.
+   */
+  virtual void onAttachmentState(const std::string &state,
+                                 const std::string &endpoint, bool more) PURE;
+
+  /**
+   * Called once the server accepted a getAttachment() that reports the state
+   * more than once, i.e. the watch is established and further states are
+   * pushed. Not called for single polls. May be called inline.
+   */
+  virtual void onAttachmentWatched() PURE;
+
+  /**
+   * Called when a delete request completes. May be called inline.
+   * @param success whether the server deleted the attachments.
+   */
+  virtual void onAttachmentsDeleted(bool success) PURE;
+};
+
+/**
+ * Transport to the squash server. A client has at most one outstanding
+ * request.
+ */
+class SquashClient {
+public:
+  virtual ~SquashClient() {}
+
+  virtual void createAttachment(SquashClientCallbacks &callbacks) PURE;
+  virtual void getAttachment(const std::string &attachment_name,
+                             SquashClientCallbacks &callbacks) PURE;
+
+  /**
+   * Deletes up to maxDeleteBatch() debugattachments in one request.
+   */
+  virtual void deleteAttachments(const std::vector<std::string> &names,
+                                 SquashClientCallbacks &callbacks) PURE;
+  virtual size_t maxDeleteBatch() PURE;
+
+  /**
+   * Cancels the outstanding request, if any, without invoking callbacks.
+   */
+  virtual void cancel() PURE;
+};
+
+typedef std::unique_ptr<SquashClient> SquashClientPtr;
+
+} // namespace Squash
+} // namespace Solo
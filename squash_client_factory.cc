@@ -0,0 +1,118 @@
+#include <algorithm>
+#include <string>
+#include <utility>
+
+#include "squash_client_factory.h"
+#include "squash_grpc_client.h"
+#include "squash_rest_client.h"
+
+namespace Solo {
+namespace Squash {
+
+SquashClientFactory::SquashClientFactory(
+    solo::squash::pb::SquashConfig::Transport transport,
+    const std::vector<std::string> &squash_cluster_names,
+    const std::string &shard_key,
+    const std::string &attachment_json,
+    DebugAttachmentConstSharedPtr attachment_proto,
+    const std::chrono::milliseconds &squash_request_timeout,
+    const std::chrono::milliseconds &watch_timeout)
+    : transport_(transport), cluster_names_(squash_cluster_names),
+      ranked_cluster_names_(rank(squash_cluster_names, shard_key)),
+      attachment_json_(attachment_json), attachment_proto_(attachment_proto),
+      squash_request_timeout_(squash_request_timeout),
+      watch_timeout_(watch_timeout) {}
+
+SquashClientPtr
+SquashClientFactory::create(Envoy::Upstream::ClusterManager &cm) const {
+  return create(cm, ranked_cluster_names_, attachment_json_, attachment_proto_);
+}
+
+SquashClientPtr SquashClientFactory::create(
+    Envoy::Upstream::ClusterManager &cm, const std::string &attachment_json,
+    DebugAttachmentConstSharedPtr attachment_proto) const {
+  if (cluster_names_.size() == 1) {
+    return create(cm, ranked_cluster_names_, attachment_json, attachment_proto);
+  }
+  return create(cm, rank(cluster_names_, attachment_json), attachment_json,
+                attachment_proto);
+}
+
+SquashClientPtr
+SquashClientFactory::createForShard(Envoy::Upstream::ClusterManager &cm,
+                                    const std::string &shard_key) const {
+  if (cluster_names_.size() == 1) {
+    return create(cm);
+  }
+  return create(cm, rank(cluster_names_, shard_key), attachment_json_,
+                attachment_proto_);
+}
+
+SquashClientPtr
+SquashClientFactory::create(Envoy::Upstream::ClusterManager &cm,
+                            const std::vector<std::string> &ranked_cluster_names,
+                            const std::string &attachment_json,
+                            DebugAttachmentConstSharedPtr attachment_proto) const {
+  // without any cluster the client fails its requests.
+  const std::string *cluster_name = cluster(cm, ranked_cluster_names);
+  if (cluster_name == nullptr) {
+    cluster_name = &ranked_cluster_names.front();
+  }
+
+  if (transport_ == solo::squash::pb::SquashConfig::GRPC) {
+    return SquashClientPtr{new GrpcSquashClient(cm, *cluster_name,
+                                                attachment_proto,
+                                                squash_request_timeout_,
+                                                watch_timeout_)};
+  }
+  return SquashClientPtr{new RestSquashClient(
+      cm, *cluster_name, attachment_json, squash_request_timeout_)};
+}
+
+const std::string *
+SquashClientFactory::cluster(Envoy::Upstream::ClusterManager &cm) const {
+  return cluster(cm, ranked_cluster_names_);
+}
+
+const std::string *SquashClientFactory::cluster(
+    Envoy::Upstream::ClusterManager &cm,
+    const std::vector<std::string> &ranked_cluster_names) {
+  for (const std::string &name : ranked_cluster_names) {
+    if (cm.get(name)) {
+      return &name;
+    }
+  }
+  return nullptr;
+}
+
+std::vector<std::string>
+SquashClientFactory::rank(const std::vector<std::string> &squash_cluster_names,
+                          const std::string &shard_key) {
+  std::vector<std::pair<uint64_t, std::string>> scored;
+  for (const std::string &name : squash_cluster_names) {
+    scored.emplace_back(hash(shard_key + "/" + name), name);
+  }
+  std::sort(scored.begin(), scored.end(),
+            [](const std::pair<uint64_t, std::string> &a,
+               const std::pair<uint64_t, std::string> &b) -> bool {
+              return a.first > b.first;
+            });
+  std::vector<std::string> ranked;
+  for (const std::pair<uint64_t, std::string> &entry : scored) {
+    ranked.push_back(entry.second);
+  }
+  return ranked;
+}
+
+uint64_t SquashClientFactory::hash(const std::string &key) {
+  // FNV-1a; stable across builds, unlike std::hash.
+  uint64_t hash = 14695981039346656037ULL;
+  for (char c : key) {
+    hash ^= static_cast<uint8_t>(c);
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+} // namespace Squash
+} // namespace Solo
@@ -0,0 +1,102 @@
+#pragma once
+
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "envoy/upstream/cluster_manager.h"
+
+#include "squash.pb.h"
+#include "squash_client.h"
+#include "squash_grpc_client.h"
+
+namespace Solo {
+namespace Squash {
+
+/**
+ * Creates clients for the configured transport to the squash server. Shared
+ * by the config and the workers.
+ *
+ * With more than one squash cluster, each Envoy sticks to one of them: the
+ * clusters are ranked by rendezvous hashing a shard key, and clients use the
+ * first ranked cluster that exists. A squash server thus keeps seeing the
+ * same attachments, and adding a cluster only moves the pods that now rank it
+ * first. The key is the rendered debug attachment of the pod (its name and
+ * namespace) for every factory of a config, so the debug and profile
+ * attachments of a pod, and their deletions, all reach the same cluster.
+ * Attachments created for another pod, e.g. down a call chain, are keyed by
+ * their own rendering instead, which that pod's sidecar renders alike.
+ */
+class SquashClientFactory {
+public:
+  SquashClientFactory(solo::squash::pb::SquashConfig::Transport transport,
+                      const std::vector<std::string> &squash_cluster_names,
+                      const std::string &shard_key,
+                      const std::string &attachment_json,
+                      DebugAttachmentConstSharedPtr attachment_proto,
+                      const std::chrono::milliseconds &squash_request_timeout,
+                      const std::chrono::milliseconds &watch_timeout);
+
+  SquashClientPtr create(Envoy::Upstream::ClusterManager &cm) const;
+
+  /**
+   * @return a client that creates attachment_json instead of the configured
+   *         attachment. Its requests go to the cluster ranked first for
+   *         attachment_json as the shard key.
+   * @param attachment_proto attachment_json parsed, for the grpc transport;
+   *        nullptr otherwise.
+   */
+  SquashClientPtr create(Envoy::Upstream::ClusterManager &cm,
+                         const std::string &attachment_json,
+                         DebugAttachmentConstSharedPtr attachment_proto) const;
+
+  /**
+   * @return a client for requests about attachments that were created with
+   *         shard_key as their attachment, e.g. to delete them. Nothing is
+   *         parsed; it creates the configured attachment.
+   */
+  SquashClientPtr createForShard(Envoy::Upstream::ClusterManager &cm,
+                                 const std::string &shard_key) const;
+
+  /**
+   * @return the cluster requests go to, or nullptr if none of the squash
+   *         clusters exists yet.
+   */
+  const std::string *cluster(Envoy::Upstream::ClusterManager &cm) const;
+
+  /**
+   * @return the squash clusters in the order they are tried.
+   */
+  const std::vector<std::string> &rankedClusters() const {
+    return ranked_cluster_names_;
+  }
+
+private:
+  static uint64_t hash(const std::string &key);
+  static std::vector<std::string>
+  rank(const std::vector<std::string> &squash_cluster_names,
+       const std::string &shard_key);
+  static const std::string *
+  cluster(Envoy::Upstream::ClusterManager &cm,
+          const std::vector<std::string> &ranked_cluster_names);
+
+  SquashClientPtr create(Envoy::Upstream::ClusterManager &cm,
+                         const std::vector<std::string> &ranked_cluster_names,
+                         const std::string &attachment_json,
+                         DebugAttachmentConstSharedPtr attachment_proto) const;
+
+  const solo::squash::pb::SquashConfig::Transport transport_;
+  const std::vector<std::string> cluster_names_;
+  const std::vector<std::string> ranked_cluster_names_;
+  const std::string attachment_json_;
+  const DebugAttachmentConstSharedPtr attachment_proto_;
+  const std::chrono::milliseconds squash_request_timeout_;
+  const std::chrono::milliseconds watch_timeout_;
+};
+
+typedef std::shared_ptr<const SquashClientFactory>
+    SquashClientFactoryConstSharedPtr;
+
+} // namespace Squash
+} // namespace Solo
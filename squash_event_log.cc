@@ -0,0 +1,176 @@
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <string>
+
+#include "squash_event_log.h"
+
+#include "common/common/logger.h"
+#include "common/http/utility.h"
+
+namespace Solo {
+namespace Squash {
+
+std::vector<SquashEvent> SquashEventRing::snapshot() const {
+  uint64_t head = head_.load(std::memory_order_acquire);
+  uint64_t first = head > SIZE ? head - SIZE : 0;
+
+  std::vector<SquashEvent> events;
+  events.reserve(head - first);
+  for (uint64_t i = first; i < head; i++) {
+    const Slot &slot = slots_[i % SIZE];
+    if (slot.seq.load(std::memory_order_acquire) != i + 1) {
+      // overwritten since we read head, or being overwritten right now.
+      continue;
+    }
+    SquashEvent event;
+    event.time_ns = slot.time_ns.load(std::memory_order_relaxed);
+    event.session = slot.session.load(std::memory_order_relaxed);
+    event.ring = id_;
+    uint32_t type_value = slot.type_value.load(std::memory_order_relaxed);
+    event.type = static_cast<SquashEventType>(type_value >> 16);
+    event.value = static_cast<uint16_t>(type_value);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (slot.seq.load(std::memory_order_relaxed) == i + 1) {
+      events.push_back(event);
+    }
+  }
+  return events;
+}
+
+SquashEventRingSharedPtr SquashEventLog::createRing() {
+  static std::atomic<uint32_t> next_id(0);
+  SquashEventRingSharedPtr ring =
+      std::make_shared<SquashEventRing>(next_id++);
+
+  std::unique_lock<std::mutex> guard(lock());
+  rings().push_back(ring);
+  return ring;
+}
+
+void SquashEventLog::removeRing(const SquashEventRingSharedPtr &ring) {
+  std::unique_lock<std::mutex> guard(lock());
+  std::vector<SquashEventRingSharedPtr> &all = rings();
+  all.erase(std::remove(all.begin(), all.end(), ring), all.end());
+}
+
+void SquashEventLog::registerAdminHandler(Envoy::Server::Admin &admin,
+                                         const std::string &dump_path) {
+  static bool registered = false;
+  if (registered) {
+    return;
+  }
+  registered = true;
+
+  // the admin api doesn't tell the method; never take a path from the url.
+  admin.addHandler(
+      "/squash/events",
+      fmt::format("print the squash event log, or write it to {} with ?dump",
+                  dump_path),
+      [dump_path](const std::string &url,
+                  Envoy::Buffer::Instance &response) -> Envoy::Http::Code {
+        Envoy::Http::Utility::QueryParams params =
+            Envoy::Http::Utility::parseQueryString(url);
+        if (params.find("dump") != params.end()) {
+          if (!dump(dump_path)) {
+            response.add(fmt::format("can't write {}\n", dump_path));
+            return Envoy::Http::Code::InternalServerError;
+          }
+          response.add(fmt::format("wrote {}\n", dump_path));
+          return Envoy::Http::Code::OK;
+        }
+
+        for (const SquashEvent &event : snapshot()) {
+          response.add(fmt::format("{} ring={} session={} {} {}\n",
+                                   event.time_ns, event.ring, event.session,
+                                   eventName(event.type), event.value));
+        }
+        return Envoy::Http::Code::OK;
+      },
+      false);
+}
+
+std::vector<SquashEvent> SquashEventLog::snapshot() {
+  std::vector<SquashEventRingSharedPtr> all;
+  {
+    std::unique_lock<std::mutex> guard(lock());
+    all = rings();
+  }
+
+  std::vector<SquashEvent> events;
+  for (const SquashEventRingSharedPtr &ring : all) {
+    std::vector<SquashEvent> ring_events = ring->snapshot();
+    events.insert(events.end(), ring_events.begin(), ring_events.end());
+  }
+  std::sort(events.begin(), events.end(),
+            [](const SquashEvent &a, const SquashEvent &b) -> bool {
+              return a.time_ns < b.time_ns;
+            });
+  return events;
+}
+
+bool SquashEventLog::dump(const std::string &path) {
+  std::vector<SquashEvent> events = snapshot();
+  int fd = ::open(path.c_str(),
+                  O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0600);
+  if (fd == -1) {
+    return false;
+  }
+  const char *data = reinterpret_cast<const char *>(events.data());
+  size_t left = events.size() * sizeof(SquashEvent);
+  while (left > 0) {
+    ssize_t written = ::write(fd, data, left);
+    if (written == -1 && errno == EINTR) {
+      continue;
+    }
+    if (written <= 0) {
+      ::close(fd);
+      return false;
+    }
+    data += written;
+    left -= written;
+  }
+  return ::close(fd) == 0;
+}
+
+std::string SquashEventLog::eventName(SquashEventType type) {
+  switch (type) {
+  case SquashEventType::SessionStarted:
+    return "session_started";
+  case SquashEventType::CreateSent:
+    return "create_sent";
+  case SquashEventType::CreateReceived:
+    return "create_received";
+  case SquashEventType::PollSent:
+    return "poll_sent";
+  case SquashEventType::PollReceived:
+    return "poll_received";
+  case SquashEventType::PollHedged:
+    return "poll_hedged";
+  case SquashEventType::Timeout:
+    return "timeout";
+  case SquashEventType::Resumed:
+    return "resumed";
+  case SquashEventType::Cancelled:
+    return "cancelled";
+  case SquashEventType::Released:
+    return "released";
+  }
+  return "unknown";
+}
+
+std::mutex &SquashEventLog::lock() {
+  static std::mutex *lock = new std::mutex();
+  return *lock;
+}
+
+std::vector<SquashEventRingSharedPtr> &SquashEventLog::rings() {
+  static std::vector<SquashEventRingSharedPtr> *rings =
+      new std::vector<SquashEventRingSharedPtr>();
+  return *rings;
+}
+
+} // namespace Squash
+} // namespace Solo
@@ -0,0 +1,139 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "envoy/buffer/buffer.h"
+#include "envoy/server/admin.h"
+
+namespace Solo {
+namespace Squash {
+
+enum class SquashEventType : uint16_t {
+  SessionStarted,
+  CreateSent,
+  CreateReceived,
+  PollSent,
+  PollReceived,
+  PollHedged,
+  Timeout,
+  Resumed,
+  Cancelled,
+  Released,
+};
+
+/**
+ * A fixed size binary record of something that happened to a debug session.
+ * The event log dump file is a plain sequence of these.
+ */
+struct SquashEvent {
+  // steady clock time.
+  uint64_t time_ns;
+  // session id, unique per ring.
+  uint64_t session;
+  uint32_t ring;
+  SquashEventType type;
+  // event specific, e.g. whether a create or poll succeeded.
+  uint16_t value;
+};
+
+static_assert(sizeof(SquashEvent) == 24, "SquashEvent is a fixed size record");
+
+/**
+ * Ring buffer of the latest events of one worker. record() is only called by
+ * the owning worker and never blocks or allocates; snapshot() may be called
+ * from any thread and skips the records being overwritten while it copies.
+ *
+ * Every slot is a seqlock: its seq is 0 while the worker writes it and the
+ * index of the event plus one once written. A reader keeps a copy only if
+ * seq was the same before and after reading the fields.
+ */
+class SquashEventRing {
+public:
+  static const uint64_t SIZE = 1024;
+
+  SquashEventRing(uint32_t id) : id_(id), slots_(), head_(0), sessions_(0) {}
+
+  void record(uint64_t session, SquashEventType type, uint16_t value = 0) {
+    uint64_t head = head_.load(std::memory_order_relaxed);
+    Slot &slot = slots_[head % SIZE];
+    slot.seq.store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    slot.time_ns.store(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch())
+            .count(),
+        std::memory_order_relaxed);
+    slot.session.store(session, std::memory_order_relaxed);
+    slot.type_value.store(
+        static_cast<uint32_t>(type) << 16 | value, std::memory_order_relaxed);
+    slot.seq.store(head + 1, std::memory_order_release);
+    head_.store(head + 1, std::memory_order_release);
+  }
+
+  uint64_t nextSessionId() { return ++sessions_; }
+
+  /**
+   * @return the recorded events, oldest first.
+   */
+  std::vector<SquashEvent> snapshot() const;
+
+private:
+  struct Slot {
+    std::atomic<uint64_t> seq{0};
+    std::atomic<uint64_t> time_ns{0};
+    std::atomic<uint64_t> session{0};
+    // SquashEvent::type in the upper, SquashEvent::value in the lower half.
+    std::atomic<uint32_t> type_value{0};
+  };
+
+  const uint32_t id_;
+  std::array<Slot, SIZE> slots_;
+  std::atomic<uint64_t> head_;
+  uint64_t sessions_;
+};
+
+typedef std::shared_ptr<SquashEventRing> SquashEventRingSharedPtr;
+
+/**
+ * Process wide registry of the event rings, served by the admin interface at
+ * /squash/events. With ?dump the binary records are written to the dump path
+ * given at registration instead.
+ */
+class SquashEventLog {
+public:
+  /**
+   * @return a new ring, registered until removeRing() is called.
+   */
+  static SquashEventRingSharedPtr createRing();
+  static void removeRing(const SquashEventRingSharedPtr &ring);
+
+  /**
+   * Adds the admin handler, once per process. Must be called on the main
+   * thread.
+   * @param dump_path the only file ?dump writes to.
+   */
+  static void registerAdminHandler(Envoy::Server::Admin &admin,
+                                   const std::string &dump_path);
+
+  static std::vector<SquashEvent> snapshot();
+  /**
+   * Writes the binary records to path, readable by the owner only. Doesn't
+   * follow a symlink at path.
+   */
+  static bool dump(const std::string &path);
+  static std::string eventName(SquashEventType type);
+
+private:
+  static std::mutex &lock();
+  static std::vector<SquashEventRingSharedPtr> &rings();
+};
+
+} // namespace Squash
+} // namespace Solo
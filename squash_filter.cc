@@ -3,10 +3,15 @@
 #include <string>
 #include <vector>
 
+#include "squash_api.h"
 #include "squash_filter.h"
+#include "squash_replay.h"
+#include "squash_worker.h"
 
 #include "server/config/network/http_connection_manager.h"
 
+#include "common/buffer/buffer_impl.h"
+#include "common/http/header_map_impl.h"
 #include "common/http/message_impl.h"
 #include "envoy/http/header_map.h"
 
@@ -19,212 +24,314 @@ namespace Squash {
 
 SquashFilter::SquashFilter(SquashFilterConfigSharedPtr config,
                            Envoy::Upstream::ClusterManager &cm)
-    : config_(config), cm_(cm), decoder_callbacks_(nullptr),
-      state_(SquashFilter::INITIAL), debugConfigPath_(), delay_timer_(nullptr), 
-      attachment_timeout_timer_(nullptr), in_flight_request_(nullptr) {}
+    : config_(config), cm_(cm), decoder_callbacks_(nullptr), session_(),
+      captured_request_(), debug_() {}
 
 SquashFilter::~SquashFilter() {}
 
 void SquashFilter::onDestroy() {
-  if (in_flight_request_ != nullptr) {
-    in_flight_request_->cancel();
-    in_flight_request_ = nullptr;
+  if (session_) {
+    session_->cancel();
   }
-
-  if (attachment_timeout_timer_) {
-    attachment_timeout_timer_->disableTimer();
-    attachment_timeout_timer_.reset();
+  if (!debug_) {
+    return;
   }
-
-  if (delay_timer_.get() != nullptr) {
-    delay_timer_.reset();
+  if (debug_->chain) {
+    debug_->chain->abandon();
+    debug_->chain.reset();
+  }
+  if (debug_->shadow_in_flight != nullptr) {
+    debug_->shadow_in_flight->cancel();
+    debug_->shadow_in_flight = nullptr;
   }
 }
 
 Envoy::Http::FilterHeadersStatus
-SquashFilter::decodeHeaders(Envoy::Http::HeaderMap &headers, bool) {
+SquashFilter::decodeHeaders(Envoy::Http::HeaderMap &headers, bool end_stream) {
+  // only a session of this filter may pin a request to an instance.
+  headers.remove(debugEndpointKey());
 
-  // check for squash header
+  // check for squash header; a debug request wins over a profile request.
+  bool profile = false;
   if (!headers.get(squashHeaderKey())) {
-    ENVOY_LOG(warn, "Squash: no squash header. ignoring.");
+    profile = config_->profiling() && headers.get(profileHeaderKey());
+    if (!profile) {
+      ENVOY_LOG(trace, "Squash: no squash header. ignoring.");
+      return Envoy::Http::FilterHeadersStatus::Continue;
+    }
+  }
+
+  if (!config_->clusterAvailable(cm_)) {
+    ENVOY_LOG(debug, "Squash: no cluster {}. not squashing",
+              config_->squash_cluster_name());
+    config_->stats().cluster_unavailable_.inc();
     return Envoy::Http::FilterHeadersStatus::Continue;
   }
 
-  ENVOY_LOG(info, "Squash:we need to squash something");
+  std::string attachment_name;
+  if (profile) {
+    ENVOY_LOG(debug, "Squash: we need to profile something");
+    config_->stats().profiles_triggered_.inc();
+    if (!config_->pause_until_profiling()) {
+      config_->worker().triggerProfile();
+      return Envoy::Http::FilterHeadersStatus::Continue;
+    }
+  } else {
+    ENVOY_LOG(info, "Squash:we need to squash something");
 
-  Envoy::Http::MessagePtr request(new Envoy::Http::RequestMessageImpl());
-  request->headers().insertContentType().value().setReference(
-      Envoy::Http::Headers::get().ContentTypeValues.Json);
-  request->headers().insertPath().value().setReference(postAttachmentPath());
-  request->headers().insertHost().value().setReference(severAuthority());
-  request->headers().insertMethod().value().setReference(
-      Envoy::Http::Headers::get().MethodValues.Post);
-  request->body().reset(
-      new Envoy::Buffer::OwnedImpl(config_->attachment_json()));
+    if (config_->capture_and_replay() && startCapture(headers)) {
+      if (end_stream) {
+        finishCapture(nullptr);
+      }
+      return Envoy::Http::FilterHeadersStatus::StopIteration;
+    }
 
-  state_ = CREATE_CONFIG;
-  in_flight_request_ =
-      cm_.httpAsyncClientForCluster(config_->squash_cluster_name())
-          .send(std::move(request), *this, config_->squash_request_timeout());
+    if (!config_->shadow_cluster().empty()) {
+      // sent like the route would, only to the replica.
+      Envoy::Router::RouteConstSharedPtr route = decoder_callbacks_->route();
+      DebugState &debug = debugState();
+      debug.shadow_request.reset(new solo::squash::pb::CapturedRequest());
+      Spool::capture(headers, route ? route->routeEntry() : nullptr, false,
+                     *debug.shadow_request);
+      debug.shadow_request->set_cluster(config_->shadow_cluster());
+    } else if (headers.get(debugChainKey())) {
+      // the services down the chain attach while this one does. Only the
+      // token minted here goes downstream.
+      headers.remove(sessionTokenKey());
+      DebugState &debug = debugState();
+      debug.chain.reset(new ChainAttach(
+          config_, cm_,
+          ChainAttach::parseServices(
+              headers.get(debugChainKey())->value().c_str())));
+      headers.remove(debugChainKey());
+      debug.chain->start();
+    }
 
-  if (in_flight_request_ == nullptr) {
-    state_ = INITIAL;
-    return Envoy::Http::FilterHeadersStatus::Continue;
+    // the ingress may have created our attachment already.
+    const Envoy::Http::HeaderEntry *token = headers.get(sessionTokenKey());
+    if (token != nullptr && !config_->service_name().empty()) {
+      attachment_name = ChainAttach::attachmentFor(token->value().c_str(),
+                                                   config_->service_name());
+    }
   }
-
-  attachment_timeout_timer_ = decoder_callbacks_->dispatcher().createTimer(
-      [this]() -> void { doneSquashing(); });
-  attachment_timeout_timer_->enableTimer(config_->attachment_timeout());
-  // check if the timer expired inline.
-  if (state_ == INITIAL) {
-    return Envoy::Http::FilterHeadersStatus::Continue;
+  DebugState &debug = debugState();
+  debug.end_stream = end_stream;
+  debug.request_headers = &headers;
+
+  session_.reset(new SquashSession(config_, config_->worker(), cm_, *this,
+                                   profile));
+  if (!session_->start(attachment_name)) {
+    // e.g. an attachment left by the previous process was attached already.
+    return finishSession(session_->attached())
+               ? Envoy::Http::FilterHeadersStatus::Continue
+               : Envoy::Http::FilterHeadersStatus::StopIteration;
   }
 
   return Envoy::Http::FilterHeadersStatus::StopIteration;
 }
 
-void SquashFilter::onSuccess(Envoy::Http::MessagePtr &&m) {
-  in_flight_request_ = nullptr;
-  Envoy::Buffer::InstancePtr &data = m->body();
-  uint64_t num_slices = data->getRawSlices(nullptr, 0);
-  Envoy::Buffer::RawSlice slices[num_slices];
-  data->getRawSlices(slices, num_slices);
-  std::string jsonbody;
-  for (Envoy::Buffer::RawSlice &slice : slices) {
-    jsonbody += std::string(static_cast<const char *>(slice.mem_), slice.len_);
-  }
-  
-  switch (state_) {
-
-  case INITIAL: {
-    // Should never happen..
-    break;
-  }
-  case CREATE_CONFIG: {
-    // get the config object that was created
-    if (m->headers().Status()->value() != "201") {
-      ENVOY_LOG(
-          info,
-          "Squash: can't create attachment object. status {} - not squashing",
-          m->headers().Status()->value().c_str());
-      doneSquashing();
-    } else {
-      state_ = CHECK_ATTACHMENT;
-
-      std::string debugConfigId;
-      try {
-        Envoy::Json::ObjectSharedPtr json_config =
-            Envoy::Json::Factory::loadFromString(jsonbody);
-        debugConfigId =
-            json_config->getObject("metadata", true)->getString("name", "");
-      } catch (Envoy::Json::Exception &) {
-        debugConfigId = "";
-      }
+Envoy::Http::FilterDataStatus
+SquashFilter::decodeData(Envoy::Buffer::Instance &data, bool end_stream) {
+  if (captured_request_) {
+    if (!end_stream) {
+      return Envoy::Http::FilterDataStatus::StopIterationAndBuffer;
+    }
+    finishCapture(&data);
+    return Envoy::Http::FilterDataStatus::StopIterationNoBuffer;
+  }
 
-      if (debugConfigId.empty()) {
-        doneSquashing();
-      } else {
-        debugConfigPath_ = "/api/v2/debugattachment/" + debugConfigId;
-        pollForAttachment();
-      }
+  if (!debug_) {
+    return Envoy::Http::FilterDataStatus::Continue;
+  }
+  debug_->end_stream = end_stream;
+  if (debug_->shadow_ready) {
+    if (!end_stream) {
+      return Envoy::Http::FilterDataStatus::StopIterationAndBuffer;
     }
+    sendShadow(&data);
+    return Envoy::Http::FilterDataStatus::StopIterationNoBuffer;
+  }
 
-    break;
+  if (!squashing()) {
+    return Envoy::Http::FilterDataStatus::Continue;
+  } else {
+    return Envoy::Http::FilterDataStatus::StopIterationAndBuffer;
   }
-  case CHECK_ATTACHMENT: {
+}
 
-    std::string attachmentstate;
-    try {
-      Envoy::Json::ObjectSharedPtr json_config =
-          Envoy::Json::Factory::loadFromString(jsonbody);
-      attachmentstate =
-          json_config->getObject("status", true)->getString("state", "");
-    } catch (Envoy::Json::Exception &) {
-      // no state yet.. leave it empty for the retry logic.
-    }
+Envoy::Http::FilterTrailersStatus
+SquashFilter::decodeTrailers(Envoy::Http::HeaderMap &trailers) {
+  if (captured_request_) {
+    Spool::addHeaders(trailers, *captured_request_->mutable_trailers());
+    finishCapture(nullptr);
+    return Envoy::Http::FilterTrailersStatus::StopIteration;
+  }
 
-    bool attached = attachmentstate == "attached";
-    bool error = attachmentstate == "error";
-    bool finalstate = attached || error;
+  if (!debug_) {
+    return Envoy::Http::FilterTrailersStatus::Continue;
+  }
+  debug_->end_stream = true;
+  if (debug_->shadow_request) {
+    Spool::addHeaders(trailers, *debug_->shadow_request->mutable_trailers());
+  }
+  if (debug_->shadow_ready) {
+    sendShadow(nullptr);
+    return Envoy::Http::FilterTrailersStatus::StopIteration;
+  }
 
-    if (finalstate) {
-      doneSquashing();
-    } else {
-      retry();
-    }
-    break;
+  if (!squashing()) {
+    return Envoy::Http::FilterTrailersStatus::Continue;
+  } else {
+    return Envoy::Http::FilterTrailersStatus::StopIteration;
   }
+}
+
+void SquashFilter::setDecoderFilterCallbacks(
+    Envoy::Http::StreamDecoderFilterCallbacks &callbacks) {
+  decoder_callbacks_ = &callbacks;
+}
+
+SquashFilter::DebugState &SquashFilter::debugState() {
+  if (!debug_) {
+    debug_.reset(new DebugState());
   }
+  return *debug_;
 }
 
-void SquashFilter::onFailure(Envoy::Http::AsyncClient::FailureReason) {
-  bool cleanupneeded = in_flight_request_ != nullptr;
-  in_flight_request_ = nullptr;
-  switch (state_) {
-    case INITIAL: {
-      break;
-    }
-    case CREATE_CONFIG: {
-      // no retries here, as we couldnt create the attachment object.
-      if (cleanupneeded) {
-        // cleanup not needed if onFailure called inline in async client send.
-        // this means that decodeHeaders is down the stack and will return Continue.
-        doneSquashing();
-      }
-      break;
-    }
-    case CHECK_ATTACHMENT: {
-      retry();
-      break;
+Envoy::Event::Dispatcher &SquashFilter::dispatcher() {
+  return decoder_callbacks_->dispatcher();
+}
+
+void SquashFilter::onSessionDone(bool attached) {
+  if (finishSession(attached)) {
+    decoder_callbacks_->continueDecoding();
+  }
+}
+
+bool SquashFilter::finishSession(bool attached) {
+  if (attached && debug_->shadow_request) {
+    // the debugger sits on the replica; production never sees the request.
+    debug_->shadow_ready = true;
+    if (debug_->end_stream) {
+      sendShadow(nullptr);
     }
+    return false;
   }
+
+  debug_->shadow_request.reset();
+  finishChain();
+  if (attached && !session_->endpoint().empty()) {
+    // a route hash policy on this header keeps the request on the debugged
+    // (or profiled) instance.
+    debug_->request_headers->remove(debugEndpointKey());
+    debug_->request_headers->addCopy(debugEndpointKey(), session_->endpoint());
+  }
+  return true;
 }
 
-void SquashFilter::retry() {
+void SquashFilter::sendShadow(Envoy::Buffer::Instance *last_data) {
+  std::string body;
+  const Envoy::Buffer::Instance *buffered = decoder_callbacks_->decodingBuffer();
+  if (buffered != nullptr) {
+    body += SquashApi::bodyAsString(*buffered);
+  }
+  if (last_data != nullptr) {
+    body += SquashApi::bodyAsString(*last_data);
+  }
+  debug_->shadow_request->set_body(body);
+  Envoy::Http::MessagePtr request = Spool::toMessage(*debug_->shadow_request);
+  Envoy::Optional<std::chrono::milliseconds> timeout =
+      Spool::timeout(*debug_->shadow_request);
+  debug_->shadow_request.reset();
+  debug_->shadow_ready = false;
+
+  if (!cm_.get(config_->shadow_cluster())) {
+    ENVOY_LOG(info, "Squash: no shadow cluster {}",
+              config_->shadow_cluster());
+    onFailure(Envoy::Http::AsyncClient::FailureReason::Reset);
+    return;
+  }
 
-  if (delay_timer_.get() == nullptr) {
-    delay_timer_ = decoder_callbacks_->dispatcher().createTimer(
-        [this]() -> void { pollForAttachment(); });
+  ENVOY_LOG(debug, "Squash: sending request to shadow cluster {}",
+            config_->shadow_cluster());
+  config_->stats().shadowed_requests_.inc();
+  Envoy::Http::AsyncClient::Request *in_flight =
+      cm_.httpAsyncClientForCluster(config_->shadow_cluster())
+          .send(std::move(request), *this, timeout);
+  // null if answered inline.
+  if (in_flight != nullptr) {
+    debug_->shadow_in_flight = in_flight;
   }
-  delay_timer_->enableTimer(config_->attachment_poll_every());
+}
 
+void SquashFilter::onSuccess(Envoy::Http::MessagePtr &&response) {
+  debug_->shadow_in_flight = nullptr;
+  bool has_body = response->body() && response->body()->length() > 0;
+  bool has_trailers = response->trailers() != nullptr;
+
+  decoder_callbacks_->encodeHeaders(
+      Envoy::Http::HeaderMapPtr{
+          new Envoy::Http::HeaderMapImpl(response->headers())},
+      !has_body && !has_trailers);
+  if (has_body) {
+    decoder_callbacks_->encodeData(*response->body(), !has_trailers);
+  }
+  if (has_trailers) {
+    decoder_callbacks_->encodeTrailers(Envoy::Http::HeaderMapPtr{
+        new Envoy::Http::HeaderMapImpl(*response->trailers())});
+  }
 }
 
-void SquashFilter::pollForAttachment() {
-  Envoy::Http::MessagePtr request(new Envoy::Http::RequestMessageImpl());
-  request->headers().insertMethod().value().setReference(
-      Envoy::Http::Headers::get().MethodValues.Get);
-  request->headers().insertPath().value().setReference(debugConfigPath_);
-  request->headers().insertHost().value().setReference(severAuthority());
-
-  in_flight_request_ =
-      cm_.httpAsyncClientForCluster(config_->squash_cluster_name())
-          .send(std::move(request), *this, config_->squash_request_timeout());
-  // no need to check in_flight_request_ is null as onFailure will take care of
-  // that.
+void SquashFilter::onFailure(Envoy::Http::AsyncClient::FailureReason) {
+  debug_->shadow_in_flight = nullptr;
+  Envoy::Http::HeaderMapPtr response_headers{new Envoy::Http::HeaderMapImpl{
+      {Envoy::Http::Headers::get().Status, "503"}}};
+  decoder_callbacks_->encodeHeaders(std::move(response_headers), true);
 }
 
-Envoy::Http::FilterDataStatus
-SquashFilter::decodeData(Envoy::Buffer::Instance &, bool) {
-  if (state_ == INITIAL) {
-    return Envoy::Http::FilterDataStatus::Continue;
-  } else {
-    return Envoy::Http::FilterDataStatus::StopIterationAndBuffer;
+void SquashFilter::finishChain() {
+  if (!debug_->chain) {
+    return;
+  }
+  std::string token = debug_->chain->finish();
+  debug_->chain.reset();
+  if (!token.empty()) {
+    debug_->request_headers->remove(sessionTokenKey());
+    debug_->request_headers->addCopy(sessionTokenKey(), token);
   }
 }
 
-Envoy::Http::FilterTrailersStatus
-SquashFilter::decodeTrailers(Envoy::Http::HeaderMap &) {
-  if (state_ == INITIAL) {
-    return Envoy::Http::FilterTrailersStatus::Continue;
-  } else {
-    return Envoy::Http::FilterTrailersStatus::StopIteration;
+bool SquashFilter::startCapture(const Envoy::Http::HeaderMap &headers) {
+  Envoy::Router::RouteConstSharedPtr route = decoder_callbacks_->route();
+  if (!route || !route->routeEntry()) {
+    ENVOY_LOG(info, "Squash: no route to replay to. not capturing");
+    return false;
   }
+
+  captured_request_.reset(new solo::squash::pb::CapturedRequest());
+  captured_request_->set_cluster(route->routeEntry()->clusterName());
+  Spool::capture(headers, route->routeEntry(), true, *captured_request_);
+  return true;
 }
 
-void SquashFilter::setDecoderFilterCallbacks(
-    Envoy::Http::StreamDecoderFilterCallbacks &callbacks) {
-  decoder_callbacks_ = &callbacks;
+void SquashFilter::finishCapture(Envoy::Buffer::Instance *last_data) {
+  std::string body;
+  const Envoy::Buffer::Instance *buffered = decoder_callbacks_->decodingBuffer();
+  if (buffered != nullptr) {
+    body += SquashApi::bodyAsString(*buffered);
+  }
+  if (last_data != nullptr) {
+    body += SquashApi::bodyAsString(*last_data);
+  }
+  captured_request_->set_body(body);
+
+  std::string token = config_->random().uuid();
+  std::string spool_path = config_->spool_directory() + "/" + token;
+  config_->worker().capture(config_, spool_path, std::move(captured_request_));
+
+  Envoy::Http::HeaderMapPtr response_headers{new Envoy::Http::HeaderMapImpl{
+      {Envoy::Http::Headers::get().Status, "202"}, {replayTokenKey(), token}}};
+  decoder_callbacks_->encodeHeaders(std::move(response_headers), true);
 }
 
 const Envoy::Http::LowerCaseString &SquashFilter::squashHeaderKey() {
@@ -233,34 +340,34 @@ const Envoy::Http::LowerCaseString &SquashFilter::squashHeaderKey() {
   return *key;
 }
 
-const std::string &SquashFilter::postAttachmentPath() {
-  static std::string *val = new std::string("/api/v2/debugattachment");
-  return *val;
+const Envoy::Http::LowerCaseString &SquashFilter::profileHeaderKey() {
+  static Envoy::Http::LowerCaseString *key =
+      new Envoy::Http::LowerCaseString("x-squash-profile");
+  return *key;
 }
 
-const std::string &SquashFilter::severAuthority() {
-  static std::string *val = new std::string("squash-server");
-  return *val;
+const Envoy::Http::LowerCaseString &SquashFilter::debugChainKey() {
+  static Envoy::Http::LowerCaseString *key =
+      new Envoy::Http::LowerCaseString("x-squash-debug-chain");
+  return *key;
 }
 
-void SquashFilter::doneSquashing() {
-  state_ = INITIAL;
-  if (delay_timer_) {
-    delay_timer_->disableTimer();
-    delay_timer_.reset();
-  }
-
-  if (attachment_timeout_timer_) {
-    attachment_timeout_timer_->disableTimer();
-    attachment_timeout_timer_.reset();
-  }
+const Envoy::Http::LowerCaseString &SquashFilter::sessionTokenKey() {
+  static Envoy::Http::LowerCaseString *key =
+      new Envoy::Http::LowerCaseString("x-squash-session");
+  return *key;
+}
 
-  if (in_flight_request_ != nullptr) {
-    in_flight_request_->cancel();
-    in_flight_request_ = nullptr;
-  }
+const Envoy::Http::LowerCaseString &SquashFilter::debugEndpointKey() {
+  static Envoy::Http::LowerCaseString *key =
+      new Envoy::Http::LowerCaseString("x-squash-debug-endpoint");
+  return *key;
+}
 
-  decoder_callbacks_->continueDecoding();
+const Envoy::Http::LowerCaseString &SquashFilter::replayTokenKey() {
+  static Envoy::Http::LowerCaseString *key =
+      new Envoy::Http::LowerCaseString("x-squash-replay-token");
+  return *key;
 }
 
 } // namespace Squash
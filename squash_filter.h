@@ -11,15 +11,20 @@
 #include "envoy/upstream/cluster_manager.h"
 
 #include "common/common/logger.h"
+#include "squash.pb.h"
+#include "squash_chain.h"
 #include "squash_filter_config.h"
+#include "squash_replay.h"
+#include "squash_session.h"
 
 namespace Solo {
 namespace Squash {
 
 class SquashFilter
     : public Envoy::Http::StreamDecoderFilter,
-      protected Envoy::Logger::Loggable<Envoy::Logger::Id::filter>,
-      public Envoy::Http::AsyncClient::Callbacks {
+      public SquashSessionCallbacks,
+      public Envoy::Http::AsyncClient::Callbacks,
+      protected Envoy::Logger::Loggable<Envoy::Logger::Id::filter> {
 public:
   SquashFilter(SquashFilterConfigSharedPtr config,
                Envoy::Upstream::ClusterManager &cm);
@@ -38,33 +43,59 @@ public:
   void setDecoderFilterCallbacks(
       Envoy::Http::StreamDecoderFilterCallbacks &callbacks) override;
 
+  // SquashSessionCallbacks
+  Envoy::Event::Dispatcher &dispatcher() override;
+  void onSessionDone(bool attached) override;
+
   // Http::AsyncClient::Callbacks
-  void onSuccess(Envoy::Http::MessagePtr &&) override;
+  void onSuccess(Envoy::Http::MessagePtr &&response) override;
   void onFailure(Envoy::Http::AsyncClient::FailureReason) override;
 
 private:
-  enum State {
-    INITIAL,
-    CREATE_CONFIG,
-    CHECK_ATTACHMENT,
-  };
   SquashFilterConfigSharedPtr config_;
   Envoy::Upstream::ClusterManager &cm_;
-  Envoy::Http::StreamDecoderFilterCallbacks *decoder_callbacks_;
+  /**
+   * The state of a debugged or profiled stream. Most streams are neither, so
+   * it is only allocated once the stream is.
+   */
+  struct DebugState {
+    // the headers of the triggered request, to pin it once attached.
+    Envoy::Http::HeaderMap *request_headers{nullptr};
+    // the attachments created for the services down the call chain.
+    ChainAttachPtr chain;
+    // shadow mode: the request as sent to shadow_cluster once attached.
+    std::unique_ptr<solo::squash::pb::CapturedRequest> shadow_request;
+    Envoy::Http::AsyncClient::Request *shadow_in_flight{nullptr};
+    // attached; the request goes to shadow_cluster once it is complete.
+    bool shadow_ready{false};
+    bool end_stream{false};
+  };
 
-  State state_;
-  std::string debugConfigPath_;
-  Envoy::Event::TimerPtr delay_timer_;
-  Envoy::Event::TimerPtr attachment_timeout_timer_;
-  Envoy::Http::AsyncClient::Request *in_flight_request_;
+  Envoy::Http::StreamDecoderFilterCallbacks *decoder_callbacks_;
+  SquashSessionPtr session_;
+  CapturedRequestPtr captured_request_;
+  std::unique_ptr<DebugState> debug_;
 
-  void pollForAttachment();
-  void doneSquashing();
+  DebugState &debugState();
+  bool squashing() const { return session_ && session_->active(); }
+  bool startCapture(const Envoy::Http::HeaderMap &headers);
+  void finishCapture(Envoy::Buffer::Instance *last_data);
+  void sendShadow(Envoy::Buffer::Instance *last_data);
+  void finishChain();
+  /**
+   * Applies the outcome of the session to the request, whether it completed
+   * inline or later: the shadow reroute, the chain token and the endpoint pin.
+   * @return true if the request goes on along its route, false if it waits
+   *         to go to the shadow cluster.
+   */
+  bool finishSession(bool attached);
   const Envoy::Http::LowerCaseString &squashHeaderKey();
-  const std::string &postAttachmentPath();
-  const std::string &severAuthority();
-  void retry();
+  const Envoy::Http::LowerCaseString &profileHeaderKey();
+  const Envoy::Http::LowerCaseString &debugChainKey();
+  const Envoy::Http::LowerCaseString &sessionTokenKey();
+  const Envoy::Http::LowerCaseString &replayTokenKey();
+  const Envoy::Http::LowerCaseString &debugEndpointKey();
 };
 
 } // namespace Squash
-} // namespace Solo
\ No newline at end of file
+} // namespace Solo
@@ -1,11 +1,14 @@
 #include <regex>
 #include <string>
+#include <vector>
 
 #include "common/common/logger.h"
 #include "common/common/utility.h"
 
 #include "squash_filter.h"
+#include "squash_event_log.h"
 #include "squash_filter_config.h"
+#include "squash_worker.h"
 
 #include "squash.pb.h"
 
@@ -29,6 +32,20 @@ const std::string SquashFilterConfig::DEFAULT_ATTACHMENT_TEMPLATE(R"EOF(
   }
   )EOF");
 
+const std::string SquashFilterConfig::DEFAULT_CHAIN_ATTACHMENT_TEMPLATE(R"EOF(
+  {
+    "spec" : {
+      "attachment" : {
+        "service": "{{ SQUASH_SERVICE }}",
+        "namespace": "{{ POD_NAMESPACE }}"
+      },
+      "match_request":true
+    }
+  }
+  )EOF");
+
+const std::string SquashFilterConfig::SERVICE_VARIABLE("SQUASH_SERVICE");
+
 SquashFilterConfig::SquashFilterConfig(
     const solo::squash::pb::SquashConfig &proto_config,
     Envoy::Server::Configuration::FactoryContext &context)
@@ -39,25 +56,259 @@ SquashFilterConfig::SquashFilterConfig(
       attachment_poll_every_(PROTOBUF_GET_MS_OR_DEFAULT(
           proto_config, attachment_poll_every, 1000)),
       squash_request_timeout_(PROTOBUF_GET_MS_OR_DEFAULT(
-          proto_config, squash_request_timeout, 1000)) {
+          proto_config, squash_request_timeout, 1000)),
+      hedging_(proto_config.has_hedge_delay() &&
+               proto_config.transport() == solo::squash::pb::SquashConfig::REST &&
+               PROTOBUF_GET_WRAPPED_OR_DEFAULT(proto_config,
+                                               hedge_budget_percent, 10) > 0),
+      hedge_delay_(PROTOBUF_GET_MS_OR_DEFAULT(proto_config, hedge_delay, 0)),
+      hedge_percentile_(proto_config.hedge_percentile() > 0
+                            ? proto_config.hedge_percentile()
+                            : 95),
+      hedge_budget_percent_(PROTOBUF_GET_WRAPPED_OR_DEFAULT(
+          proto_config, hedge_budget_percent, 10)),
+      capture_and_replay_(proto_config.capture_and_replay()),
+      spool_directory_(proto_config.spool_directory()),
+      shadow_cluster_(proto_config.shadow_cluster()),
+      profile_json_(getAttachment(proto_config.profile_template())),
+      pause_until_profiling_(proto_config.pause_until_profiling()),
+      chain_json_(getAttachment(proto_config.chain_attachment_template(),
+                                SERVICE_VARIABLE)),
+      chain_proto_(), service_name_(proto_config.service_name()),
+      client_factory_(), profile_client_factory_(),
+      random_(context.random()),
+      stats_{ALL_SQUASH_FILTER_STATS(
+          POOL_COUNTER_PREFIX(context.scope(), "squash."))},
+      tls_(nullptr), provisioner_() {
   if (attachment_json_.empty()) {
     attachment_json_ = getAttachment(DEFAULT_ATTACHMENT_TEMPLATE);
   }
-  if (!context.clusterManager().get(squash_cluster_name_)) {
-    throw Envoy::EnvoyException(fmt::format(
-        "squash filter: unknown cluster '{}' in squash config", squash_cluster_name_));
+  if (chain_json_.empty()) {
+    chain_json_ =
+        getAttachment(DEFAULT_CHAIN_ATTACHMENT_TEMPLATE, SERVICE_VARIABLE);
+  }
+  if (spool_directory_.empty()) {
+    spool_directory_ = "/tmp";
+  }
+
+  if (proto_config.transport() == solo::squash::pb::SquashConfig::GRPC) {
+    // parsed once with the placeholder in; a bad template fails the config
+    // instead of every chained request.
+    std::shared_ptr<solo::squash::pb::DebugAttachment> chain_proto =
+        std::make_shared<solo::squash::pb::DebugAttachment>();
+    Envoy::MessageUtil::loadFromJson(chain_json_, *chain_proto);
+    chain_proto_ = chain_proto;
+  }
+
+  client_factory_ = createClientFactory(proto_config, attachment_json_);
+  if (!profile_json_.empty()) {
+    profile_client_factory_ = createClientFactory(proto_config, profile_json_);
+  }
+  if (!client_factory_->cluster(context.clusterManager())) {
+    // resolved per request; the cluster may still arrive through CDS.
+    ENVOY_LOG(info, "Squash: cluster '{}' is not known yet",
+              client_factory_->rankedClusters().front());
+  }
+
+  SquashEventLog::registerAdminHandler(context.admin(),
+                                      spool_directory_ + "/squash-events.bin");
+
+  if (proto_config.hot_restart_handoff()) {
+    handoff_ = SessionHandoff::get(spool_directory_, squash_cluster_name_,
+                                   attachment_timeout_);
+  }
+}
+
+SquashFilterConfigOwner::SquashFilterConfigOwner(
+    const solo::squash::pb::SquashConfig &proto_config,
+    Envoy::Server::Configuration::FactoryContext &context,
+    Envoy::MonotonicTimeSource &time_source)
+    : config_(std::make_shared<SquashFilterConfig>(proto_config, context)),
+      tls_(context.threadLocal().allocateSlot()), provisioner_() {
+  Envoy::Upstream::ClusterManager &cm = context.clusterManager();
+  bool cleanup = proto_config.cleanup_abandoned_attachments();
+  uint32_t max_concurrent_cleanups = proto_config.max_concurrent_cleanups() > 0
+                                         ? proto_config.max_concurrent_cleanups()
+                                         : 2;
+  // the workers must not keep the config alive; copy what they need.
+  SquashClientFactoryConstSharedPtr client_factory = config_->client_factory_;
+  SquashClientFactoryConstSharedPtr profile_client_factory =
+      config_->profile_client_factory_;
+  std::chrono::milliseconds cleanup_every = config_->attachment_poll_every_;
+  Envoy::Network::DrainDecision &drain_decision = context.drainDecision();
+  SquashFilterStats stats = config_->stats_;
+  uint32_t max_concurrent_requests = proto_config.max_concurrent_requests();
+  SessionHandoffSharedPtr handoff = config_->handoff_;
+  // the workers all profile this pod.
+  ProfileWindowSharedPtr profile_window = std::make_shared<ProfileWindow>(
+      std::chrono::milliseconds(PROTOBUF_GET_MS_OR_DEFAULT(
+          proto_config, profile_interval, 60000)));
+  tls_->set([&cm, &drain_decision, &time_source, stats, cleanup, max_concurrent_cleanups,
+             client_factory, profile_client_factory, cleanup_every,
+             max_concurrent_requests, handoff,
+             profile_window](Envoy::Event::Dispatcher &dispatcher)
+                -> Envoy::ThreadLocal::ThreadLocalObjectSharedPtr {
+    AttachmentReaperPtr reaper;
+    if (cleanup) {
+      reaper.reset(new AttachmentReaper(client_factory, dispatcher, cm, stats,
+                                        max_concurrent_cleanups, cleanup_every));
+    }
+    ProfileTriggerPtr profiler;
+    if (profile_client_factory) {
+      profiler.reset(new ProfileTrigger(profile_client_factory, dispatcher, cm,
+                                        time_source, profile_window));
+    }
+    return std::make_shared<SquashWorker>(
+        dispatcher, cm, drain_decision, time_source, stats, std::move(reaper),
+        std::move(profiler), handoff, max_concurrent_requests);
+  });
+  config_->tls_ = tls_.get();
+
+  if (proto_config.preprovision_attachment()) {
+    AttachmentProvisioner::ExpiredCb on_expired;
+    if (cleanup) {
+      // runs on the main thread, which has a worker of its own.
+      Envoy::ThreadLocal::Slot *slot = tls_.get();
+      on_expired = [slot](const std::string &attachment_name) -> void {
+        slot->getTyped<SquashWorker>().abandonAttachment(attachment_name);
+      };
+    }
+    provisioner_ = std::make_shared<AttachmentProvisioner>(
+        config_->createClient(cm), context.dispatcher(),
+        config_->attachment_poll_every_,
+        std::chrono::milliseconds(PROTOBUF_GET_MS_OR_DEFAULT(
+            proto_config, preprovisioned_attachment_ttl, 600000)),
+        on_expired);
+    config_->provisioner_ = provisioner_;
+    provisioner_->start();
+  }
+}
+
+SquashFilterConfigOwner::~SquashFilterConfigOwner() {
+  // replay sessions may still take the provisioned attachment; the rest of
+  // the provisioner and the slot go here, on the main thread.
+  if (provisioner_) {
+    provisioner_->stop();
   }
 }
 
+SquashClientPtr
+SquashFilterConfig::createClient(Envoy::Upstream::ClusterManager &cm) {
+  return client_factory_->create(cm);
+}
+
+SquashClientPtr
+SquashFilterConfig::createProfileClient(Envoy::Upstream::ClusterManager &cm) {
+  return profile_client_factory_->create(cm);
+}
+
+SquashClientPtr
+SquashFilterConfig::createChainClient(Envoy::Upstream::ClusterManager &cm,
+                                      const std::string &service) {
+  DebugAttachmentConstSharedPtr attachment_proto;
+  if (chain_proto_) {
+    std::shared_ptr<solo::squash::pb::DebugAttachment> rendered =
+        std::make_shared<solo::squash::pb::DebugAttachment>(*chain_proto_);
+    renderChainProto(*rendered, service);
+    attachment_proto = rendered;
+  }
+  return client_factory_->create(cm, chainAttachment(service),
+                                 attachment_proto);
+}
+
+std::string SquashFilterConfig::chainAttachment(const std::string &service) {
+  std::string attachment_json = chain_json_;
+  replaceAll(attachment_json, servicePlaceholder(),
+             Envoy::StringUtil::escape(service));
+  return attachment_json;
+}
+
+const std::string &SquashFilterConfig::servicePlaceholder() {
+  static const std::string placeholder = "{{ " + SERVICE_VARIABLE + " }}";
+  return placeholder;
+}
+
+void SquashFilterConfig::replaceAll(std::string &s, const std::string &from,
+                                    const std::string &to) {
+  for (size_t pos = s.find(from); pos != std::string::npos;
+       pos = s.find(from, pos + to.size())) {
+    s.replace(pos, from.size(), to);
+  }
+}
+
+void SquashFilterConfig::renderChainProto(
+    solo::squash::pb::DebugAttachment &attachment, const std::string &service) {
+  // the same strings chainAttachment() renders, unescaped as the json parser
+  // would leave them.
+  replaceAll(*attachment.mutable_metadata()->mutable_name(),
+             servicePlaceholder(), service);
+  replaceAll(*attachment.mutable_spec()->mutable_image(), servicePlaceholder(),
+             service);
+  replaceAll(*attachment.mutable_spec()->mutable_node(), servicePlaceholder(),
+             service);
+  std::vector<Protobuf::Value *> values;
+  for (auto &field :
+       *attachment.mutable_spec()->mutable_attachment()->mutable_fields()) {
+    values.push_back(&field.second);
+  }
+  while (!values.empty()) {
+    Protobuf::Value *value = values.back();
+    values.pop_back();
+    switch (value->kind_case()) {
+    case Protobuf::Value::kStringValue:
+      replaceAll(*value->mutable_string_value(), servicePlaceholder(), service);
+      break;
+    case Protobuf::Value::kStructValue:
+      for (auto &field : *value->mutable_struct_value()->mutable_fields()) {
+        values.push_back(&field.second);
+      }
+      break;
+    case Protobuf::Value::kListValue:
+      for (Protobuf::Value &element :
+           *value->mutable_list_value()->mutable_values()) {
+        values.push_back(&element);
+      }
+      break;
+    default:
+      break;
+    }
+  }
+}
+
+SquashClientFactoryConstSharedPtr SquashFilterConfig::createClientFactory(
+    const solo::squash::pb::SquashConfig &proto_config,
+    const std::string &attachment_json) {
+  std::shared_ptr<solo::squash::pb::DebugAttachment> attachment_proto;
+  if (proto_config.transport() == solo::squash::pb::SquashConfig::GRPC) {
+    // render the attachment once; the grpc transport sends it as is.
+    attachment_proto = std::make_shared<solo::squash::pb::DebugAttachment>();
+    Envoy::MessageUtil::loadFromJson(attachment_json, *attachment_proto);
+  }
+  std::vector<std::string> squash_cluster_names{squash_cluster_name_};
+  for (const std::string &shard : proto_config.squash_cluster_shards()) {
+    squash_cluster_names.push_back(shard);
+  }
+  // profile attachments shard with the debug attachments of the pod.
+  return std::make_shared<SquashClientFactory>(
+      proto_config.transport(), squash_cluster_names, attachment_json_,
+      attachment_json, attachment_proto, squash_request_timeout_,
+      attachment_timeout_);
+}
+
+SquashWorker &SquashFilterConfig::worker() {
+  return tls_->getTyped<SquashWorker>();
+}
+
 std::string
-SquashFilterConfig::getAttachment(const std::string &attachment_template) {
+SquashFilterConfig::getAttachment(const std::string &attachment_template,
+                                  const std::string &keep_variable) {
   std::string s;
 
   const std::regex env_regex("\\{\\{ ([a-zA-Z_]+) \\}\\}");
   auto end_last_match = attachment_template.begin();
 
   auto callback =
-      [&s, &attachment_template, &end_last_match](
+      [&s, &attachment_template, &end_last_match, &keep_variable](
           const std::match_results<std::string::const_iterator> &match) {
         auto start_match = attachment_template.begin() + match.position(0);
 
@@ -65,7 +316,9 @@ SquashFilterConfig::getAttachment(const std::string &attachment_template) {
 
         std::string envar_name = match[1].str();
         const char *envar_value = std::getenv(envar_name.c_str());
-        if (envar_value == nullptr) {
+        if (envar_name == keep_variable) {
+          s.append(match.str(0));
+        } else if (envar_value == nullptr) {
           ENVOY_LOG(info, "Squash: no environment variable named {}.", envar_name);
         } else {
           s.append(Envoy::StringUtil::escape(envar_value));
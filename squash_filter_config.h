@@ -3,22 +3,62 @@
 #include <string>
 
 #include "common/common/logger.h"
+#include "common/common/utility.h"
 
 #include "squash.pb.h"
+#include "squash_client.h"
+#include "squash_client_factory.h"
+#include "squash_handoff.h"
+#include "squash_provisioner.h"
 
 #include "common/protobuf/protobuf.h"
 
+#include "envoy/common/time.h"
+#include "envoy/network/drain_decision.h"
+#include "envoy/runtime/runtime.h"
 #include "envoy/server/filter_config.h"
+#include "envoy/stats/stats_macros.h"
+#include "envoy/thread_local/thread_local.h"
+#include "envoy/upstream/cluster_manager.h"
 
 namespace Solo {
 namespace Squash {
 
+class SquashWorker;
+
+/**
+ * All squash filter stats. @see stats_macros.h
+ */
+// clang-format off
+#define ALL_SQUASH_FILTER_STATS(COUNTER)                                        \
+  COUNTER(released_streams)                                                     \
+  COUNTER(cluster_unavailable)                                                  \
+  COUNTER(shadowed_requests)                                                    \
+  COUNTER(profiles_triggered)                                                   \
+  COUNTER(abandoned_attachments_dropped)                                        \
+  COUNTER(failed_replays)
+// clang-format on
+
+/**
+ * Struct definition for all squash filter stats. @see stats_macros.h
+ */
+struct SquashFilterStats {
+  ALL_SQUASH_FILTER_STATS(GENERATE_COUNTER_STRUCT)
+};
+
 class SquashFilterConfig
     : protected Envoy::Logger::Loggable<Envoy::Logger::Id::config> {
 public:
   SquashFilterConfig(const solo::squash::pb::SquashConfig &proto_config,
                      Envoy::Server::Configuration::FactoryContext &context);
   const std::string &squash_cluster_name() { return squash_cluster_name_; }
+
+  /**
+   * @return whether a squash cluster to send requests to exists.
+   */
+  bool clusterAvailable(Envoy::Upstream::ClusterManager &cm) {
+    return client_factory_->cluster(cm) != nullptr;
+  }
   const std::string &attachment_json() { return attachment_json_; }
   const std::chrono::milliseconds &attachment_timeout() {
     return attachment_timeout_;
@@ -29,20 +69,152 @@ public:
   const std::chrono::milliseconds &squash_request_timeout() {
     return squash_request_timeout_;
   }
+  bool hedging() { return hedging_; }
+  const std::chrono::milliseconds &hedge_delay() { return hedge_delay_; }
+  uint32_t hedge_percentile() { return hedge_percentile_; }
+  uint32_t hedge_budget_percent() { return hedge_budget_percent_; }
+  bool capture_and_replay() { return capture_and_replay_; }
+  const std::string &spool_directory() { return spool_directory_; }
+  const std::string &shadow_cluster() { return shadow_cluster_; }
+  bool profiling() { return profile_client_factory_ != nullptr; }
+  bool pause_until_profiling() { return pause_until_profiling_; }
+  const std::string &service_name() { return service_name_; }
+  Envoy::Runtime::RandomGenerator &random() { return random_; }
+  SquashFilterStats &stats() { return stats_; }
+
+  /**
+   * @return the attachment provisioner, or nullptr if attachments are not
+   *         pre-provisioned.
+   */
+  const AttachmentProvisionerSharedPtr &provisioner() { return provisioner_; }
+
+  /**
+   * @return the hot restart handoff, or nullptr if sessions are not handed
+   *         over.
+   */
+  const SessionHandoffSharedPtr &handoff() { return handoff_; }
+
+  /**
+   * @return a new client for the configured transport to the squash server.
+   */
+  SquashClientPtr createClient(Envoy::Upstream::ClusterManager &cm);
+
+  /**
+   * @return a new client that creates profile attachments. Only valid if
+   *         profiling().
+   */
+  SquashClientPtr createProfileClient(Envoy::Upstream::ClusterManager &cm);
+
+  /**
+   * @return a new client that creates the chain attachment for service. Its
+   *         requests go to the squash cluster ranked first for
+   *         chainAttachment(service), so the ingress and the service's
+   *         sidecar reach the same one.
+   */
+  SquashClientPtr createChainClient(Envoy::Upstream::ClusterManager &cm,
+                                    const std::string &service);
+
+  /**
+   * @return the chain attachment for service, rendered alike by every Envoy
+   *         of the mesh; the shard key of its requests.
+   */
+  std::string chainAttachment(const std::string &service);
+
+  /**
+   * @return the squash state of the calling worker thread. Only valid while
+   *         the SquashFilterConfigOwner lives, i.e. from a stream.
+   */
+  SquashWorker &worker();
 
 private:
+  friend class SquashFilterConfigOwner;
+
   const static std::string DEFAULT_ATTACHMENT_TEMPLATE;
+  const static std::string DEFAULT_CHAIN_ATTACHMENT_TEMPLATE;
+  // left in the chain template and replaced per service.
+  const static std::string SERVICE_VARIABLE;
 
-  std::string getAttachment(const std::string &attachment_template);
+  /**
+   * Replaces {{ VARIABLE }} with the environment variable of that name.
+   * @param keep_variable a variable to leave as is.
+   */
+  std::string getAttachment(const std::string &attachment_template,
+                            const std::string &keep_variable = "");
+  static const std::string &servicePlaceholder();
+  static void replaceAll(std::string &s, const std::string &from,
+                         const std::string &to);
+  /**
+   * Replaces the service placeholder in the strings of a chain attachment
+   * parsed from the template.
+   */
+  static void renderChainProto(solo::squash::pb::DebugAttachment &attachment,
+                               const std::string &service);
+  SquashClientFactoryConstSharedPtr
+  createClientFactory(const solo::squash::pb::SquashConfig &proto_config,
+                      const std::string &attachment_json);
 
   std::string squash_cluster_name_;
   std::string attachment_json_;
   std::chrono::milliseconds attachment_timeout_;
   std::chrono::milliseconds attachment_poll_every_;
   std::chrono::milliseconds squash_request_timeout_;
+  bool hedging_;
+  std::chrono::milliseconds hedge_delay_;
+  uint32_t hedge_percentile_;
+  uint32_t hedge_budget_percent_;
+  bool capture_and_replay_;
+  std::string spool_directory_;
+  std::string shadow_cluster_;
+  std::string profile_json_;
+  bool pause_until_profiling_;
+  std::string chain_json_;
+  // chain_json_ parsed, for the grpc transport.
+  DebugAttachmentConstSharedPtr chain_proto_;
+  std::string service_name_;
+  SquashClientFactoryConstSharedPtr client_factory_;
+  SquashClientFactoryConstSharedPtr profile_client_factory_;
+  Envoy::Runtime::RandomGenerator &random_;
+  SquashFilterStats stats_;
+  // both set and owned by the SquashFilterConfigOwner.
+  Envoy::ThreadLocal::Slot *tls_;
+  AttachmentProvisionerSharedPtr provisioner_;
+  SessionHandoffSharedPtr handoff_;
 };
 
 typedef std::shared_ptr<SquashFilterConfig> SquashFilterConfigSharedPtr;
 
+/**
+ * Owns the parts of a squash filter config that belong to the main thread:
+ * the slot of the per worker state and the attachment provisioner. Held by
+ * the filter factory, which Envoy destroys on the main thread once the
+ * streams of its listener are gone. The filters, and the replay sessions that
+ * outlive them on the workers, share only the SquashFilterConfig. It owns
+ * neither, so it may be released on any thread and the per worker state
+ * never keeps it alive.
+ */
+class SquashFilterConfigOwner {
+public:
+  /**
+   * @param time_source the clock of the workers; tests substitute a
+   *        simulated one.
+   */
+  SquashFilterConfigOwner(
+      const solo::squash::pb::SquashConfig &proto_config,
+      Envoy::Server::Configuration::FactoryContext &context,
+      Envoy::MonotonicTimeSource &time_source =
+          Envoy::ProdMonotonicTimeSource::instance_);
+  ~SquashFilterConfigOwner();
+
+  const SquashFilterConfigSharedPtr &config() { return config_; }
+
+private:
+  SquashFilterConfigSharedPtr config_;
+  Envoy::ThreadLocal::SlotPtr tls_;
+  AttachmentProvisionerSharedPtr provisioner_;
+};
+
+typedef std::shared_ptr<SquashFilterConfigOwner>
+    SquashFilterConfigOwnerSharedPtr;
+
 } // namespace Squash
 } // namespace Solo
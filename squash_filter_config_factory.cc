@@ -1,3 +1,4 @@
+#include <memory>
 #include <string>
 
 #include "common/common/logger.h"
@@ -5,6 +6,8 @@
 #include "squash_filter.h"
 #include "squash_filter_config.h"
 #include "squash_filter_config_factory.h"
+#include "squash_filter_pool.h"
+#include "squash_worker.h"
 
 #include "common/config/json_utility.h"
 #include "common/protobuf/protobuf.h"
@@ -37,6 +40,73 @@ const std::string SquashFilterConfigFactory::SQUASH_FILTER_SCHEMA(R"EOF(
       },
       "squash_request_timeout_ms": {
         "type" : "number"
+      },
+      "capture_and_replay": {
+        "type" : "boolean"
+      },
+      "spool_directory": {
+        "type" : "string"
+      },
+      "preprovision_attachment": {
+        "type" : "boolean"
+      },
+      "preprovisioned_attachment_ttl_ms": {
+        "type" : "number"
+      },
+      "transport": {
+        "type" : "string",
+        "enum" : ["rest", "grpc"]
+      },
+      "hedge_delay_ms": {
+        "type" : "number"
+      },
+      "hedge_percentile": {
+        "type" : "integer",
+        "minimum" : 1,
+        "maximum" : 100
+      },
+      "hedge_budget_percent": {
+        "type" : "integer",
+        "minimum" : 0,
+        "maximum" : 100
+      },
+      "cleanup_abandoned_attachments": {
+        "type" : "boolean"
+      },
+      "max_concurrent_cleanups": {
+        "type" : "integer",
+        "minimum" : 1
+      },
+      "hot_restart_handoff": {
+        "type" : "boolean"
+      },
+      "squash_cluster_shards": {
+        "type" : "array",
+        "items" : {
+          "type" : "string"
+        }
+      },
+      "max_concurrent_requests": {
+        "type" : "integer",
+        "minimum" : 0
+      },
+      "shadow_cluster": {
+        "type" : "string"
+      },
+      "profile_template": {
+        "type" : "string"
+      },
+      "pause_until_profiling": {
+        "type" : "boolean"
+      },
+      "profile_interval_ms": {
+        "type" : "number"
+      },
+      "chain_attachment_template": {
+        "type" : "string"
+      },
+      "service_name": {
+        "type" : "string"
       }
     },
     "required": ["squash_cluster"],
@@ -73,14 +143,18 @@ SquashFilterConfigFactory::createFilter(
     const solo::squash::pb::SquashConfig &proto_config,
     Envoy::Server::Configuration::FactoryContext &context) {
 
-  SquashFilterConfigSharedPtr config = std::make_shared<SquashFilterConfig>(
-      SquashFilterConfig(proto_config, context));
+  // the factory is destroyed on the main thread, and the owner with it.
+  SquashFilterConfigOwnerSharedPtr owner =
+      std::make_shared<SquashFilterConfigOwner>(proto_config, context);
+  SquashFilterConfigSharedPtr config = owner->config();
 
-  return [&context,
+  return [&context, owner,
           config](Envoy::Http::FilterChainFactoryCallbacks &callbacks) -> void {
-    auto filter = new Squash::SquashFilter(config, context.clusterManager());
-    callbacks.addStreamDecoderFilter(
-        Envoy::Http::StreamDecoderFilterSharedPtr{filter});
+    // the filter and its control block come from one block of the worker's
+    // pool.
+    callbacks.addStreamDecoderFilter(std::allocate_shared<SquashFilter>(
+        FilterPoolAllocator<SquashFilter>(config->worker().filterPool()),
+        config, context.clusterManager()));
   };
 }
 
@@ -92,6 +166,43 @@ void SquashFilterConfigFactory::translateSquashFilter(const Envoy::Json::Object
   JSON_UTIL_SET_DURATION(json_config, proto_config, attachment_timeout);
   JSON_UTIL_SET_DURATION(json_config, proto_config, attachment_poll_every);
   JSON_UTIL_SET_DURATION(json_config, proto_config, squash_request_timeout);
+  proto_config.set_capture_and_replay(
+      json_config.getBoolean("capture_and_replay", false));
+  JSON_UTIL_SET_STRING(json_config, proto_config, spool_directory);
+  proto_config.set_preprovision_attachment(
+      json_config.getBoolean("preprovision_attachment", false));
+  JSON_UTIL_SET_DURATION(json_config, proto_config, preprovisioned_attachment_ttl);
+  if (json_config.getString("transport", "rest") == "grpc") {
+    proto_config.set_transport(solo::squash::pb::SquashConfig::GRPC);
+  }
+  JSON_UTIL_SET_DURATION(json_config, proto_config, hedge_delay);
+  proto_config.set_hedge_percentile(
+      json_config.getInteger("hedge_percentile", 0));
+  if (json_config.hasObject("hedge_budget_percent")) {
+    proto_config.mutable_hedge_budget_percent()->set_value(
+        json_config.getInteger("hedge_budget_percent"));
+  }
+  proto_config.set_cleanup_abandoned_attachments(
+      json_config.getBoolean("cleanup_abandoned_attachments", false));
+  proto_config.set_max_concurrent_cleanups(
+      json_config.getInteger("max_concurrent_cleanups", 0));
+  proto_config.set_hot_restart_handoff(
+      json_config.getBoolean("hot_restart_handoff", false));
+  JSON_UTIL_SET_STRING(json_config, proto_config, shadow_cluster);
+  JSON_UTIL_SET_STRING(json_config, proto_config, profile_template);
+  proto_config.set_pause_until_profiling(
+      json_config.getBoolean("pause_until_profiling", false));
+  JSON_UTIL_SET_DURATION(json_config, proto_config, profile_interval);
+  JSON_UTIL_SET_STRING(json_config, proto_config, chain_attachment_template);
+  JSON_UTIL_SET_STRING(json_config, proto_config, service_name);
+  proto_config.set_max_concurrent_requests(
+      json_config.getInteger("max_concurrent_requests", 0));
+  if (json_config.hasObject("squash_cluster_shards")) {
+    for (const std::string &shard :
+         json_config.getStringArray("squash_cluster_shards", true)) {
+      proto_config.add_squash_cluster_shards(shard);
+    }
+  }
 }
 
 /**
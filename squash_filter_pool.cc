@@ -0,0 +1,55 @@
+#include <new>
+
+#include "squash_filter_pool.h"
+
+namespace Solo {
+namespace Squash {
+
+FilterPool::FilterPool()
+    : block_size_(0), free_(), outstanding_(0), orphaned_(false) {
+  free_.reserve(MAX_FREE);
+}
+
+FilterPool::~FilterPool() {
+  for (void *block : free_) {
+    ::operator delete(block);
+  }
+}
+
+void *FilterPool::allocate(size_t size) {
+  if (block_size_ == 0) {
+    block_size_ = size;
+  }
+  outstanding_++;
+
+  if (size == block_size_ && !free_.empty()) {
+    void *block = free_.back();
+    free_.pop_back();
+    return block;
+  }
+  return ::operator new(size);
+}
+
+void FilterPool::deallocate(void *block, size_t size) {
+  outstanding_--;
+  if (orphaned_ || size != block_size_ || free_.size() >= MAX_FREE) {
+    ::operator delete(block);
+  } else {
+    free_.push_back(block);
+  }
+
+  if (orphaned_ && outstanding_ == 0) {
+    delete this;
+  }
+}
+
+void FilterPool::orphan() {
+  if (outstanding_ == 0) {
+    delete this;
+    return;
+  }
+  orphaned_ = true;
+}
+
+} // namespace Squash
+} // namespace Solo
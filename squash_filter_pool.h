@@ -0,0 +1,74 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+namespace Solo {
+namespace Squash {
+
+/**
+ * Per worker free list for the filter objects created for every stream. Most
+ * streams are never debugged, so the filter is allocated and freed at the
+ * request rate; recycling its blocks keeps that off the general allocator.
+ * Only used on the owning worker thread. The owner calls orphan() instead of
+ * deleting the pool, which then frees itself once the last block is returned.
+ */
+class FilterPool {
+public:
+  // free blocks kept for reuse; more are returned to the allocator.
+  static const size_t MAX_FREE = 1024;
+
+  FilterPool();
+
+  void *allocate(size_t size);
+  void deallocate(void *block, size_t size);
+  void orphan();
+
+  size_t outstanding() const { return outstanding_; }
+  size_t freeBlocks() const { return free_.size(); }
+
+private:
+  ~FilterPool();
+
+  // the size of the pooled blocks, set by the first allocation.
+  size_t block_size_;
+  std::vector<void *> free_;
+  size_t outstanding_;
+  bool orphaned_;
+};
+
+/**
+ * Allocator for std::allocate_shared, so that a filter and its control block
+ * share one pooled block.
+ */
+template <class T> class FilterPoolAllocator {
+public:
+  typedef T value_type;
+
+  FilterPoolAllocator(FilterPool &pool) : pool_(&pool) {}
+  template <class U>
+  FilterPoolAllocator(const FilterPoolAllocator<U> &other)
+      : pool_(other.pool_) {}
+
+  T *allocate(size_t n) {
+    return static_cast<T *>(pool_->allocate(n * sizeof(T)));
+  }
+  void deallocate(T *p, size_t n) { pool_->deallocate(p, n * sizeof(T)); }
+
+  FilterPool *pool_;
+};
+
+template <class T, class U>
+bool operator==(const FilterPoolAllocator<T> &a,
+                const FilterPoolAllocator<U> &b) {
+  return a.pool_ == b.pool_;
+}
+
+template <class T, class U>
+bool operator!=(const FilterPoolAllocator<T> &a,
+                const FilterPoolAllocator<U> &b) {
+  return !(a == b);
+}
+
+} // namespace Squash
+} // namespace Solo
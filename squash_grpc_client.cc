@@ -0,0 +1,162 @@
+#include <string>
+
+#include "squash_grpc_client.h"
+
+namespace Solo {
+namespace Squash {
+
+GrpcSquashClient::GrpcSquashClient(
+    Envoy::Upstream::ClusterManager &cm, const std::string &squash_cluster_name,
+    DebugAttachmentConstSharedPtr attachment,
+    const std::chrono::milliseconds &squash_request_timeout,
+    const std::chrono::milliseconds &watch_timeout)
+    : create_client_(cm, squash_cluster_name),
+      watch_client_(cm, squash_cluster_name),
+      delete_client_(cm, squash_cluster_name), attachment_(attachment),
+      squash_request_timeout_(squash_request_timeout),
+      watch_timeout_(watch_timeout), create_callbacks_(*this),
+      watch_callbacks_(*this), delete_callbacks_(*this), callbacks_(nullptr),
+      create_stream_(nullptr), watch_stream_(nullptr), delete_stream_(nullptr),
+      created_(false), deleted_(false) {}
+
+GrpcSquashClient::~GrpcSquashClient() { cancel(); }
+
+void GrpcSquashClient::createAttachment(SquashClientCallbacks &callbacks) {
+  callbacks_ = &callbacks;
+  created_ = false;
+  Envoy::Grpc::AsyncStream<solo::squash::pb::DebugAttachment> *stream =
+      create_client_.start(createAttachmentMethod(), create_callbacks_,
+                           squash_request_timeout_);
+  // a null stream means onRemoteClose was called inline.
+  if (stream != nullptr) {
+    create_stream_ = stream;
+    create_stream_->sendMessage(*attachment_, true);
+  }
+}
+
+void GrpcSquashClient::getAttachment(const std::string &attachment_name,
+                                     SquashClientCallbacks &callbacks) {
+  callbacks_ = &callbacks;
+  // the watch lasts until the attachment is final, at most watch_timeout;
+  // the server sees the deadline too.
+  Envoy::Grpc::AsyncStream<solo::squash::pb::GetAttachmentRequest> *stream =
+      watch_client_.start(watchAttachmentMethod(), watch_callbacks_,
+                          Envoy::Optional<std::chrono::milliseconds>(
+                              watch_timeout_));
+  if (stream != nullptr) {
+    watch_stream_ = stream;
+    solo::squash::pb::GetAttachmentRequest request;
+    request.set_name(attachment_name);
+    watch_stream_->sendMessage(request, true);
+    // sendMessage() may have closed the stream inline.
+    if (watch_stream_ != nullptr) {
+      callbacks_->onAttachmentWatched();
+    }
+  }
+}
+
+void GrpcSquashClient::deleteAttachments(const std::vector<std::string> &names,
+                                         SquashClientCallbacks &callbacks) {
+  callbacks_ = &callbacks;
+  deleted_ = false;
+  Envoy::Grpc::AsyncStream<solo::squash::pb::DeleteAttachmentsRequest> *stream =
+      delete_client_.start(deleteAttachmentsMethod(), delete_callbacks_,
+                           squash_request_timeout_);
+  if (stream != nullptr) {
+    delete_stream_ = stream;
+    solo::squash::pb::DeleteAttachmentsRequest request;
+    for (const std::string &name : names) {
+      request.add_names(name);
+    }
+    delete_stream_->sendMessage(request, true);
+  }
+}
+
+void GrpcSquashClient::cancel() {
+  if (create_stream_ != nullptr) {
+    create_stream_->resetStream();
+    create_stream_ = nullptr;
+  }
+  if (watch_stream_ != nullptr) {
+    watch_stream_->resetStream();
+    watch_stream_ = nullptr;
+  }
+  if (delete_stream_ != nullptr) {
+    delete_stream_->resetStream();
+    delete_stream_ = nullptr;
+  }
+}
+
+void GrpcSquashClient::CreateCallbacks::onReceiveMessage(
+    std::unique_ptr<solo::squash::pb::DebugAttachment> &&message) {
+  parent_.created_ = true;
+  parent_.callbacks_->onAttachmentCreated(message->metadata().name());
+}
+
+void GrpcSquashClient::CreateCallbacks::onRemoteClose(
+    Envoy::Grpc::Status::GrpcStatus status, const std::string &message) {
+  parent_.create_stream_ = nullptr;
+  if (!parent_.created_) {
+    ENVOY_LOG(info, "Squash: can't create attachment object. grpc status {} {}",
+              status, message);
+    parent_.created_ = true;
+    parent_.callbacks_->onAttachmentCreated("");
+  }
+}
+
+void GrpcSquashClient::WatchCallbacks::onReceiveMessage(
+    std::unique_ptr<solo::squash::pb::DebugAttachment> &&message) {
+  parent_.callbacks_->onAttachmentState(message->status().state(),
+                                        message->status().endpoint(), true);
+}
+
+void GrpcSquashClient::WatchCallbacks::onRemoteClose(
+    Envoy::Grpc::Status::GrpcStatus, const std::string &) {
+  parent_.watch_stream_ = nullptr;
+  // the watch ended before a final state; the session will watch again.
+  parent_.callbacks_->onAttachmentState("", "", false);
+}
+
+void GrpcSquashClient::DeleteCallbacks::onReceiveMessage(
+    std::unique_ptr<solo::squash::pb::DeleteAttachmentsResponse> &&) {
+  parent_.deleted_ = true;
+  parent_.callbacks_->onAttachmentsDeleted(true);
+}
+
+void GrpcSquashClient::DeleteCallbacks::onRemoteClose(
+    Envoy::Grpc::Status::GrpcStatus status, const std::string &message) {
+  parent_.delete_stream_ = nullptr;
+  if (!parent_.deleted_) {
+    ENVOY_LOG(debug, "Squash: can't delete attachments. grpc status {} {}",
+              status, message);
+    parent_.deleted_ = true;
+    parent_.callbacks_->onAttachmentsDeleted(false);
+  }
+}
+
+const Envoy::Protobuf::MethodDescriptor &
+GrpcSquashClient::createAttachmentMethod() {
+  static const Envoy::Protobuf::MethodDescriptor *method =
+      Envoy::Protobuf::DescriptorPool::generated_pool()->FindMethodByName(
+          "solo.squash.pb.SquashServer.CreateAttachment");
+  return *method;
+}
+
+const Envoy::Protobuf::MethodDescriptor &
+GrpcSquashClient::watchAttachmentMethod() {
+  static const Envoy::Protobuf::MethodDescriptor *method =
+      Envoy::Protobuf::DescriptorPool::generated_pool()->FindMethodByName(
+          "solo.squash.pb.SquashServer.WatchAttachment");
+  return *method;
+}
+
+const Envoy::Protobuf::MethodDescriptor &
+GrpcSquashClient::deleteAttachmentsMethod() {
+  static const Envoy::Protobuf::MethodDescriptor *method =
+      Envoy::Protobuf::DescriptorPool::generated_pool()->FindMethodByName(
+          "solo.squash.pb.SquashServer.DeleteAttachments");
+  return *method;
+}
+
+} // namespace Squash
+} // namespace Solo
@@ -0,0 +1,141 @@
+#pragma once
+
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "envoy/grpc/async_client.h"
+#include "envoy/upstream/cluster_manager.h"
+
+#include "common/common/logger.h"
+#include "common/grpc/async_client_impl.h"
+
+#include "squash.pb.h"
+#include "squash_client.h"
+
+namespace Solo {
+namespace Squash {
+
+typedef std::shared_ptr<const solo::squash::pb::DebugAttachment>
+    DebugAttachmentConstSharedPtr;
+
+/**
+ * SquashClient talking protobuf to the squash server over gRPC. Instead of
+ * polling, the state of an attachment is streamed by WatchAttachment, for at
+ * most watch_timeout.
+ */
+class GrpcSquashClient
+    : public SquashClient,
+      protected Envoy::Logger::Loggable<Envoy::Logger::Id::filter> {
+public:
+  GrpcSquashClient(Envoy::Upstream::ClusterManager &cm,
+                   const std::string &squash_cluster_name,
+                   DebugAttachmentConstSharedPtr attachment,
+                   const std::chrono::milliseconds &squash_request_timeout,
+                   const std::chrono::milliseconds &watch_timeout);
+  ~GrpcSquashClient();
+
+  // SquashClient
+  void createAttachment(SquashClientCallbacks &callbacks) override;
+  void getAttachment(const std::string &attachment_name,
+                     SquashClientCallbacks &callbacks) override;
+  void deleteAttachments(const std::vector<std::string> &names,
+                         SquashClientCallbacks &callbacks) override;
+  size_t maxDeleteBatch() override { return MAX_DELETE_BATCH; }
+  void cancel() override;
+
+  static const Envoy::Protobuf::MethodDescriptor &createAttachmentMethod();
+  static const Envoy::Protobuf::MethodDescriptor &watchAttachmentMethod();
+  static const Envoy::Protobuf::MethodDescriptor &deleteAttachmentsMethod();
+
+private:
+  static const size_t MAX_DELETE_BATCH = 100;
+
+  typedef Envoy::Grpc::AsyncStreamCallbacks<solo::squash::pb::DebugAttachment>
+      DebugAttachmentCallbacks;
+
+  /**
+   * Base for the per rpc callbacks; nothing is done with metadata.
+   */
+  class RpcCallbacks : public DebugAttachmentCallbacks {
+  public:
+    RpcCallbacks(GrpcSquashClient &parent) : parent_(parent) {}
+
+    // Grpc::AsyncStreamCallbacks
+    void onCreateInitialMetadata(Envoy::Http::HeaderMap &) override {}
+    void onReceiveInitialMetadata(Envoy::Http::HeaderMapPtr &&) override {}
+    void onReceiveTrailingMetadata(Envoy::Http::HeaderMapPtr &&) override {}
+
+  protected:
+    GrpcSquashClient &parent_;
+  };
+
+  class CreateCallbacks : public RpcCallbacks {
+  public:
+    CreateCallbacks(GrpcSquashClient &parent) : RpcCallbacks(parent) {}
+
+    void onReceiveMessage(
+        std::unique_ptr<solo::squash::pb::DebugAttachment> &&message) override;
+    void onRemoteClose(Envoy::Grpc::Status::GrpcStatus status,
+                       const std::string &message) override;
+  };
+
+  class WatchCallbacks : public RpcCallbacks {
+  public:
+    WatchCallbacks(GrpcSquashClient &parent) : RpcCallbacks(parent) {}
+
+    void onReceiveMessage(
+        std::unique_ptr<solo::squash::pb::DebugAttachment> &&message) override;
+    void onRemoteClose(Envoy::Grpc::Status::GrpcStatus status,
+                       const std::string &message) override;
+  };
+
+  class DeleteCallbacks
+      : public Envoy::Grpc::AsyncStreamCallbacks<
+            solo::squash::pb::DeleteAttachmentsResponse> {
+  public:
+    DeleteCallbacks(GrpcSquashClient &parent) : parent_(parent) {}
+
+    // Grpc::AsyncStreamCallbacks
+    void onCreateInitialMetadata(Envoy::Http::HeaderMap &) override {}
+    void onReceiveInitialMetadata(Envoy::Http::HeaderMapPtr &&) override {}
+    void onReceiveMessage(
+        std::unique_ptr<solo::squash::pb::DeleteAttachmentsResponse> &&)
+        override;
+    void onReceiveTrailingMetadata(Envoy::Http::HeaderMapPtr &&) override {}
+    void onRemoteClose(Envoy::Grpc::Status::GrpcStatus status,
+                       const std::string &message) override;
+
+  private:
+    GrpcSquashClient &parent_;
+  };
+
+  Envoy::Grpc::AsyncClientImpl<solo::squash::pb::DebugAttachment,
+                               solo::squash::pb::DebugAttachment>
+      create_client_;
+  Envoy::Grpc::AsyncClientImpl<solo::squash::pb::GetAttachmentRequest,
+                               solo::squash::pb::DebugAttachment>
+      watch_client_;
+  Envoy::Grpc::AsyncClientImpl<solo::squash::pb::DeleteAttachmentsRequest,
+                               solo::squash::pb::DeleteAttachmentsResponse>
+      delete_client_;
+  DebugAttachmentConstSharedPtr attachment_;
+  const std::chrono::milliseconds squash_request_timeout_;
+  const std::chrono::milliseconds watch_timeout_;
+
+  CreateCallbacks create_callbacks_;
+  WatchCallbacks watch_callbacks_;
+  DeleteCallbacks delete_callbacks_;
+  SquashClientCallbacks *callbacks_;
+  Envoy::Grpc::AsyncStream<solo::squash::pb::DebugAttachment> *create_stream_;
+  Envoy::Grpc::AsyncStream<solo::squash::pb::GetAttachmentRequest>
+      *watch_stream_;
+  Envoy::Grpc::AsyncStream<solo::squash::pb::DeleteAttachmentsRequest>
+      *delete_stream_;
+  bool created_;
+  bool deleted_;
+};
+
+} // namespace Squash
+} // namespace Solo
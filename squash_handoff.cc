@@ -0,0 +1,307 @@
+#include <dirent.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+
+#include "squash.pb.h"
+#include "squash_handoff.h"
+
+namespace Solo {
+namespace Squash {
+
+const std::chrono::milliseconds SessionHandoff::FLUSH_INTERVAL(100);
+
+SessionHandoff::SessionHandoff(const std::string &spool_directory,
+                               const std::string &squash_cluster_name,
+                               std::chrono::milliseconds ttl)
+    : directory_(spool_directory),
+      prefix_("squash-handoff-" + squash_cluster_name + "."),
+      path_(directory_ + "/" + prefix_ + std::to_string(::getpid())),
+      claimed_path_(path_ + ".claimed"), ttl_(ttl), inherited_(), active_(),
+      dirty_(false), stopping_(false), written_names_(), handed_off_(),
+      file_exists_(false) {
+  // left by an earlier process with our pid.
+  ::unlink(claimed_path_.c_str());
+  load();
+  thread_.reset(new Envoy::Thread::Thread([this]() -> void { run(); }));
+}
+
+SessionHandoff::~SessionHandoff() {
+  {
+    std::unique_lock<std::mutex> guard(lock_);
+    stopping_ = true;
+    wakeup_.notify_one();
+  }
+  // writes what is still pending on the way out.
+  thread_->join();
+  ::unlink(claimed_path_.c_str());
+}
+
+SessionHandoffSharedPtr
+SessionHandoff::get(const std::string &spool_directory,
+                    const std::string &squash_cluster_name,
+                    std::chrono::milliseconds ttl) {
+  static std::mutex *lock = new std::mutex();
+  static std::map<std::string, std::weak_ptr<SessionHandoff>> *handoffs =
+      new std::map<std::string, std::weak_ptr<SessionHandoff>>();
+
+  std::string key = spool_directory + "/" + squash_cluster_name;
+  std::unique_lock<std::mutex> guard(*lock);
+  SessionHandoffSharedPtr handoff = (*handoffs)[key].lock();
+  if (!handoff) {
+    handoff = std::make_shared<SessionHandoff>(spool_directory,
+                                               squash_cluster_name, ttl);
+    (*handoffs)[key] = handoff;
+  }
+  return handoff;
+}
+
+std::string SessionHandoff::take() {
+  std::unique_lock<std::mutex> guard(lock_);
+  while (!inherited_.empty()) {
+    std::string attachment_name = inherited_.front().name;
+    inherited_.pop_front();
+    markDirty();
+    if (!handedOff(attachment_name)) {
+      return attachment_name;
+    }
+  }
+  return "";
+}
+
+void SessionHandoff::add(const std::string &attachment_name) {
+  std::unique_lock<std::mutex> guard(lock_);
+  active_.insert(attachment_name);
+  markDirty();
+}
+
+bool SessionHandoff::remove(const std::string &attachment_name) {
+  {
+    std::unique_lock<std::mutex> guard(lock_);
+    auto it = active_.find(attachment_name);
+    if (it != active_.end()) {
+      active_.erase(it);
+      markDirty();
+    }
+    if (handed_off_.erase(attachment_name) > 0) {
+      return false;
+    }
+    // never written, so nobody else can have it.
+    if (written_names_.count(attachment_name) == 0) {
+      return true;
+    }
+  }
+
+  checkClaimed();
+  std::unique_lock<std::mutex> guard(lock_);
+  return handed_off_.erase(attachment_name) == 0;
+}
+
+void SessionHandoff::keep(const std::string &attachment_name) {
+  std::unique_lock<std::mutex> guard(lock_);
+  auto it = active_.find(attachment_name);
+  if (it == active_.end()) {
+    return;
+  }
+  active_.erase(it);
+  markDirty();
+  if (!handedOff(attachment_name)) {
+    inherited_.push_back(
+        Kept{attachment_name, std::chrono::steady_clock::now() + ttl_});
+  }
+}
+
+std::vector<std::string> SessionHandoff::expire() {
+  checkClaimed();
+
+  std::vector<std::string> expired;
+  std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+  std::unique_lock<std::mutex> guard(lock_);
+  // kept in the order they expire.
+  while (!inherited_.empty() && inherited_.front().expires <= now) {
+    if (!handedOff(inherited_.front().name)) {
+      expired.push_back(inherited_.front().name);
+    }
+    inherited_.pop_front();
+    markDirty();
+  }
+  return expired;
+}
+
+void SessionHandoff::flush() {
+  std::unique_lock<std::mutex> flushing(flush_lock_);
+  checkClaimed();
+
+  std::set<std::string> names;
+  {
+    std::unique_lock<std::mutex> guard(lock_);
+    if (!dirty_) {
+      return;
+    }
+    dirty_ = false;
+    for (const std::string &attachment_name : active_) {
+      if (!handedOff(attachment_name)) {
+        names.insert(attachment_name);
+      }
+    }
+    for (const Kept &kept : inherited_) {
+      if (!handedOff(kept.name)) {
+        names.insert(kept.name);
+      }
+    }
+  }
+
+  if (names.empty()) {
+    if (file_exists_) {
+      ::unlink(path_.c_str());
+      file_exists_ = false;
+    }
+    return;
+  }
+
+  solo::squash::pb::SessionHandoff handoff;
+  for (const std::string &attachment_name : names) {
+    handoff.add_attachment_names(attachment_name);
+  }
+  std::string data;
+  handoff.SerializeToString(&data);
+
+  // the next process may read the file at any time; replace it in one step.
+  std::string tmp_path = path_ + ".tmp";
+  int fd = ::open(tmp_path.c_str(),
+                  O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0600);
+  bool written = fd != -1;
+  for (size_t offset = 0; written && offset < data.size();) {
+    ssize_t rc = ::write(fd, data.data() + offset, data.size() - offset);
+    if (rc == -1 && errno == EINTR) {
+      continue;
+    }
+    written = rc > 0;
+    offset += written ? rc : 0;
+  }
+  if (fd != -1 && ::close(fd) != 0) {
+    written = false;
+  }
+  if (!written || ::rename(tmp_path.c_str(), path_.c_str()) != 0) {
+    ENVOY_LOG(debug, "Squash: can't write {}", path_);
+    std::unique_lock<std::mutex> guard(lock_);
+    // tried again after the next FLUSH_INTERVAL.
+    markDirty();
+    return;
+  }
+
+  file_exists_ = true;
+  std::unique_lock<std::mutex> guard(lock_);
+  written_names_.insert(names.begin(), names.end());
+}
+
+void SessionHandoff::load() {
+  DIR *directory = ::opendir(directory_.c_str());
+  if (directory == nullptr) {
+    return;
+  }
+  std::vector<std::string> pids;
+  while (struct dirent *entry = ::readdir(directory)) {
+    std::string file_name = entry->d_name;
+    if (file_name.compare(0, prefix_.size(), prefix_) != 0) {
+      continue;
+    }
+    // skips the temporary and .claimed files.
+    std::string pid = file_name.substr(prefix_.size());
+    if (pid.empty() || pid.find_first_not_of("0123456789") != std::string::npos) {
+      continue;
+    }
+    pids.push_back(pid);
+  }
+  ::closedir(directory);
+
+  std::chrono::steady_clock::time_point expires =
+      std::chrono::steady_clock::now() + ttl_;
+  for (const std::string &pid : pids) {
+    std::string path = directory_ + "/" + prefix_ + pid;
+    solo::squash::pb::SessionHandoff handoff;
+    {
+      std::ifstream file(path, std::ios::binary);
+      if (!file || !handoff.ParseFromIstream(&file)) {
+        continue;
+      }
+    }
+    // read first, claimed second: the writer then treats everything it
+    // wrote until it notices as ours, which covers what we read.
+    bool running = pid != std::to_string(::getpid()) &&
+                   (::kill(std::strtol(pid.c_str(), nullptr, 10), 0) == 0 ||
+                    errno != ESRCH);
+    if (running) {
+      int fd = ::open((path + ".claimed").c_str(),
+                      O_WRONLY | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0600);
+      if (fd != -1) {
+        ::close(fd);
+      }
+    }
+    ::unlink(path.c_str());
+    for (const std::string &attachment_name : handoff.attachment_names()) {
+      inherited_.push_back(Kept{attachment_name, expires});
+    }
+  }
+  if (!inherited_.empty()) {
+    ENVOY_LOG(info, "Squash: resuming {} attachments from previous processes",
+              inherited_.size());
+    // written again in case this process is replaced before they are taken.
+    dirty_ = true;
+  }
+}
+
+void SessionHandoff::markDirty() {
+  dirty_ = true;
+  wakeup_.notify_one();
+}
+
+bool SessionHandoff::handedOff(const std::string &attachment_name) const {
+  return handed_off_.count(attachment_name) > 0;
+}
+
+void SessionHandoff::checkClaimed() {
+  {
+    std::unique_lock<std::mutex> guard(lock_);
+    if (written_names_.empty()) {
+      return;
+    }
+  }
+  if (::access(claimed_path_.c_str(), F_OK) != 0) {
+    return;
+  }
+  ::unlink(claimed_path_.c_str());
+
+  std::unique_lock<std::mutex> guard(lock_);
+  ENVOY_LOG(info, "Squash: handed {} attachments over to the next process",
+            written_names_.size());
+  handed_off_.insert(written_names_.begin(), written_names_.end());
+  written_names_.clear();
+}
+
+void SessionHandoff::run() {
+  std::unique_lock<std::mutex> guard(lock_);
+  while (true) {
+    wakeup_.wait(guard, [this]() -> bool { return stopping_ || dirty_; });
+    if (!dirty_) {
+      return;
+    }
+    guard.unlock();
+    flush();
+    guard.lock();
+    if (stopping_) {
+      return;
+    }
+    // changes of the next FLUSH_INTERVAL share a write.
+    wakeup_.wait_for(guard, FLUSH_INTERVAL, [this]() -> bool { return stopping_; });
+  }
+}
+
+} // namespace Squash
+} // namespace Solo
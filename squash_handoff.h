@@ -0,0 +1,138 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "common/common/logger.h"
+#include "common/common/thread.h"
+
+namespace Solo {
+namespace Squash {
+
+class SessionHandoff;
+typedef std::shared_ptr<SessionHandoff> SessionHandoffSharedPtr;
+
+/**
+ * Hands the attachments of in-progress sessions over to the next process on
+ * hot restart. Each process writes the attachments being polled (or kept) to
+ * a file of its own in the spool directory, in the background and at most
+ * every FLUSH_INTERVAL. A new process reads and removes the files of the
+ * previous ones when its config is created and lets sessions resume those
+ * attachments, which are then likely already attached, before creating new
+ * ones. Shared by all the configs of a process that use the same squash
+ * cluster. May be used from any thread.
+ *
+ * A newer process that read the file of a running one leaves a .claimed file
+ * next to it. From then on the attachments this process ever wrote are the
+ * newer one's: this process no longer hands them out and never reports them
+ * for deletion.
+ */
+class SessionHandoff
+    : protected Envoy::Logger::Loggable<Envoy::Logger::Id::filter> {
+public:
+  /**
+   * @param ttl how long an inherited or kept attachment may wait for take()
+   *        before expire() gives it up.
+   */
+  SessionHandoff(const std::string &spool_directory,
+                 const std::string &squash_cluster_name,
+                 std::chrono::milliseconds ttl);
+  ~SessionHandoff();
+
+  /**
+   * @return the handoff for the squash cluster, created and loaded on first
+   *         use.
+   */
+  static SessionHandoffSharedPtr get(const std::string &spool_directory,
+                                     const std::string &squash_cluster_name,
+                                     std::chrono::milliseconds ttl);
+
+  /**
+   * Takes an attachment left by the previous process, or kept by this one.
+   * @return the attachment name or an empty string if there is none left.
+   */
+  std::string take();
+
+  /**
+   * Records that a session of this process polls attachment_name.
+   */
+  void add(const std::string &attachment_name);
+
+  /**
+   * Records that attachment_name reached a final state or was given up.
+   * @return false if attachment_name was handed over to a newer process,
+   *         which must be left to delete it.
+   */
+  bool remove(const std::string &attachment_name);
+
+  /**
+   * Records that no session polls attachment_name anymore, e.g. because the
+   * stream was reset on hot restart, but keeps it for the next process or a
+   * later session of this one to take().
+   */
+  void keep(const std::string &attachment_name);
+
+  /**
+   * Gives up the inherited and kept attachments nobody took within ttl.
+   * @return the ones not handed over to a newer process, to be deleted.
+   */
+  std::vector<std::string> expire();
+
+  /**
+   * Writes the pending changes now rather than in the background.
+   */
+  void flush();
+
+private:
+  static const std::chrono::milliseconds FLUSH_INTERVAL;
+
+  struct Kept {
+    std::string name;
+    std::chrono::steady_clock::time_point expires;
+  };
+
+  void load();
+  void markDirty();
+  // must be called with lock_ held.
+  bool handedOff(const std::string &attachment_name) const;
+  /**
+   * Checks whether a newer process claimed our file; if so, everything
+   * written to it is handed off. Must be called without lock_ held.
+   */
+  void checkClaimed();
+  void run();
+
+  const std::string directory_;
+  // file names of this cluster's handoffs, followed by the pid.
+  const std::string prefix_;
+  const std::string path_;
+  const std::string claimed_path_;
+  const std::chrono::milliseconds ttl_;
+
+  std::mutex lock_;
+  std::condition_variable wakeup_;
+  // left by previous processes or kept; served by take().
+  std::deque<Kept> inherited_;
+  std::multiset<std::string> active_;
+  bool dirty_;
+  bool stopping_;
+  // everything written to our file since it was last claimed.
+  std::set<std::string> written_names_;
+  // taken over by a newer process.
+  std::set<std::string> handed_off_;
+  // serializes flush() with itself.
+  std::mutex flush_lock_;
+  // only used by flush().
+  bool file_exists_;
+  Envoy::Thread::ThreadPtr thread_;
+};
+
+} // namespace Squash
+} // namespace Solo
@@ -0,0 +1,114 @@
+#include <string>
+
+#include "squash_profiler.h"
+
+namespace Solo {
+namespace Squash {
+
+ProfileWindow::ProfileWindow(std::chrono::milliseconds interval)
+    : interval_(interval), admitted_(false), last_admitted_() {}
+
+bool ProfileWindow::admit(Envoy::MonotonicTime now) {
+  std::unique_lock<std::mutex> guard(lock_);
+  if (admitted_ && now - last_admitted_ < interval_) {
+    return false;
+  }
+  admitted_ = true;
+  last_admitted_ = now;
+  return true;
+}
+
+void ProfileWindow::release(Envoy::MonotonicTime admitted) {
+  std::unique_lock<std::mutex> guard(lock_);
+  // a later admission stands.
+  if (admitted_ && last_admitted_ == admitted) {
+    admitted_ = false;
+  }
+}
+
+ProfileTrigger::ProfileTrigger(SquashClientFactoryConstSharedPtr client_factory,
+                               Envoy::Event::Dispatcher &dispatcher,
+                               Envoy::Upstream::ClusterManager &cm,
+                               Envoy::MonotonicTimeSource &time_source,
+                               ProfileWindowSharedPtr window)
+    : client_factory_(client_factory), dispatcher_(dispatcher), cm_(cm),
+      time_source_(time_source), window_(window), creations_() {}
+
+ProfileTrigger::~ProfileTrigger() {
+  for (CreationPtr &creation : creations_) {
+    creation->cancel();
+  }
+}
+
+void ProfileTrigger::trigger(RequestScheduler &scheduler) {
+  Envoy::MonotonicTime now = time_source_.currentTime();
+  if (!window_->admit(now)) {
+    ENVOY_LOG(debug, "Squash: the pod is being profiled already");
+    return;
+  }
+
+  CreationPtr creation(
+      new Creation(*this, scheduler, client_factory_->create(cm_), now));
+  creation->moveIntoList(std::move(creation), creations_);
+  // may complete inline and remove itself from the list. Sessions due
+  // before the next profile may be admitted go first.
+  creations_.front()->start(now + window_->interval());
+}
+
+void ProfileTrigger::onCreationDone(Creation &creation) {
+  dispatcher_.deferredDelete(creation.removeFromList(creations_));
+}
+
+ProfileTrigger::Creation::Creation(ProfileTrigger &parent,
+                                   RequestScheduler &scheduler,
+                                   SquashClientPtr &&client,
+                                   Envoy::MonotonicTime admitted)
+    : parent_(parent), scheduler_(scheduler), client_(std::move(client)),
+      admitted_(admitted), queue_position_(), queued_(false), holds_slot_(false) {}
+
+void ProfileTrigger::Creation::start(RequestScheduler::Deadline deadline) {
+  if (scheduler_.acquire(*this, deadline, queue_position_)) {
+    onScheduled();
+    return;
+  }
+  queued_ = true;
+}
+
+void ProfileTrigger::Creation::cancel() {
+  if (queued_) {
+    queued_ = false;
+    scheduler_.dequeue(queue_position_);
+  }
+  client_->cancel();
+  releaseSlot();
+}
+
+void ProfileTrigger::Creation::onScheduled() {
+  queued_ = false;
+  holds_slot_ = true;
+  client_->createAttachment(*this);
+}
+
+void ProfileTrigger::Creation::onAttachmentCreated(
+    const std::string &attachment_name) {
+  if (attachment_name.empty()) {
+    ENVOY_LOG(info, "Squash: can't create profile attachment");
+    // nothing profiles the pod; don't hold off the next trigger.
+    parent_.window_->release(admitted_);
+  } else {
+    ENVOY_LOG(debug, "Squash: profiling with attachment {}", attachment_name);
+  }
+  parent_.onCreationDone(*this);
+  releaseSlot();
+}
+
+void ProfileTrigger::Creation::releaseSlot() {
+  if (holds_slot_) {
+    holds_slot_ = false;
+    // may start the next queued request inline.
+    scheduler_.release();
+  }
+}
+
+} // namespace Squash
+} // namespace Solo
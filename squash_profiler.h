@@ -0,0 +1,132 @@
+#pragma once
+
+#include <chrono>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "envoy/common/time.h"
+#include "envoy/event/deferred_deletable.h"
+#include "envoy/event/dispatcher.h"
+#include "envoy/upstream/cluster_manager.h"
+
+#include "common/common/linked_object.h"
+#include "common/common/logger.h"
+
+#include "squash_client.h"
+#include "squash_client_factory.h"
+#include "squash_scheduler.h"
+
+namespace Solo {
+namespace Squash {
+
+/**
+ * Admits one profile of the pod per interval. A profile covers what the pod
+ * does while it runs, so the triggers that arrive meanwhile have nothing to
+ * add. Shared by the workers of a config, which all profile the same pod.
+ */
+class ProfileWindow {
+public:
+  ProfileWindow(std::chrono::milliseconds interval);
+
+  /**
+   * @return whether a profile may be created now; if so the next one may
+   *         only be created interval later.
+   */
+  bool admit(Envoy::MonotonicTime now);
+
+  /**
+   * Gives back the admission made at admitted, e.g. because its profile could
+   * not be created, so the next trigger may create one.
+   */
+  void release(Envoy::MonotonicTime admitted);
+
+  std::chrono::milliseconds interval() const { return interval_; }
+
+private:
+  const std::chrono::milliseconds interval_;
+  std::mutex lock_;
+  bool admitted_;
+  Envoy::MonotonicTime last_admitted_;
+};
+
+typedef std::shared_ptr<ProfileWindow> ProfileWindowSharedPtr;
+
+/**
+ * Asks the squash server for CPU profiles on behalf of requests that are not
+ * paused. Only the create request is sent; the squash server bounds the
+ * capture by the profile duration in the template, so nothing is polled.
+ * The creates wait for a slot of the worker's RequestScheduler like the
+ * requests of the debug sessions.
+ */
+class ProfileTrigger
+    : protected Envoy::Logger::Loggable<Envoy::Logger::Id::filter> {
+public:
+  ProfileTrigger(SquashClientFactoryConstSharedPtr client_factory,
+                 Envoy::Event::Dispatcher &dispatcher,
+                 Envoy::Upstream::ClusterManager &cm,
+                 Envoy::MonotonicTimeSource &time_source,
+                 ProfileWindowSharedPtr window);
+  ~ProfileTrigger();
+
+  /**
+   * Creates a profile attachment, unless one was created within the
+   * interval of the window.
+   * @param scheduler the worker's, which admits the create.
+   */
+  void trigger(RequestScheduler &scheduler);
+
+  size_t inFlight() const { return creations_.size(); }
+
+private:
+  class Creation : public SquashClientCallbacks,
+                   public ScheduledRequest,
+                   public Envoy::LinkedObject<Creation>,
+                   public Envoy::Event::DeferredDeletable {
+  public:
+    Creation(ProfileTrigger &parent, RequestScheduler &scheduler,
+             SquashClientPtr &&client, Envoy::MonotonicTime admitted);
+
+    void start(RequestScheduler::Deadline deadline);
+    void cancel();
+
+    // ScheduledRequest
+    void onScheduled() override;
+
+    // SquashClientCallbacks
+    void onAttachmentCreated(const std::string &attachment_name) override;
+    void onAttachmentState(const std::string &, const std::string &,
+                           bool) override {}
+    void onAttachmentWatched() override {}
+    void onAttachmentsDeleted(bool) override {}
+
+  private:
+    void releaseSlot();
+
+    ProfileTrigger &parent_;
+    RequestScheduler &scheduler_;
+    SquashClientPtr client_;
+    // when the window admitted this profile.
+    const Envoy::MonotonicTime admitted_;
+    RequestScheduler::Queue::iterator queue_position_;
+    bool queued_;
+    bool holds_slot_;
+  };
+
+  typedef std::unique_ptr<Creation> CreationPtr;
+
+  void onCreationDone(Creation &creation);
+
+  SquashClientFactoryConstSharedPtr client_factory_;
+  Envoy::Event::Dispatcher &dispatcher_;
+  Envoy::Upstream::ClusterManager &cm_;
+  Envoy::MonotonicTimeSource &time_source_;
+  ProfileWindowSharedPtr window_;
+  std::list<CreationPtr> creations_;
+};
+
+typedef std::unique_ptr<ProfileTrigger> ProfileTriggerPtr;
+
+} // namespace Squash
+} // namespace Solo
@@ -0,0 +1,106 @@
+#include <string>
+
+#include "squash_provisioner.h"
+
+namespace Solo {
+namespace Squash {
+
+AttachmentProvisioner::AttachmentProvisioner(
+    SquashClientPtr &&client, Envoy::Event::Dispatcher &dispatcher,
+    std::chrono::milliseconds retry_every, std::chrono::milliseconds ttl,
+    ExpiredCb on_expired)
+    : client_(std::move(client)), dispatcher_(dispatcher),
+      retry_every_(retry_every), ttl_(ttl), on_expired_(on_expired),
+      attachment_name_(),
+      timer_(nullptr), provisioning_(false), stopped_(false) {}
+
+AttachmentProvisioner::~AttachmentProvisioner() { stop(); }
+
+void AttachmentProvisioner::start() { scheduleProvision(); }
+
+void AttachmentProvisioner::stop() {
+  if (stopped_) {
+    return;
+  }
+  stopped_ = true;
+  client_->cancel();
+
+  if (timer_) {
+    timer_->disableTimer();
+    timer_.reset();
+  }
+}
+
+std::string AttachmentProvisioner::take() {
+  std::string attachment_name;
+  {
+    std::unique_lock<std::mutex> lock(lock_);
+    attachment_name.swap(attachment_name_);
+  }
+
+  if (!attachment_name.empty()) {
+    scheduleProvision();
+  }
+  return attachment_name;
+}
+
+void AttachmentProvisioner::scheduleProvision() {
+  std::weak_ptr<AttachmentProvisioner> weak_this = shared_from_this();
+  dispatcher_.post([weak_this]() -> void {
+    AttachmentProvisionerSharedPtr self = weak_this.lock();
+    if (self) {
+      self->provision();
+    }
+  });
+}
+
+void AttachmentProvisioner::provision() {
+  if (provisioning_ || stopped_) {
+    return;
+  }
+  if (timer_) {
+    timer_->disableTimer();
+  }
+
+  provisioning_ = true;
+  client_->createAttachment(*this);
+}
+
+void AttachmentProvisioner::onAttachmentCreated(
+    const std::string &attachment_name) {
+  provisioning_ = false;
+  if (attachment_name.empty()) {
+    ENVOY_LOG(info, "Squash: can't pre-provision attachment object");
+    armTimer(retry_every_);
+    return;
+  }
+
+  ENVOY_LOG(debug, "Squash: pre-provisioned attachment {}", attachment_name);
+  {
+    std::unique_lock<std::mutex> lock(lock_);
+    attachment_name_ = attachment_name;
+  }
+
+  // refresh the attachment once it expires.
+  armTimer(ttl_);
+}
+
+void AttachmentProvisioner::armTimer(std::chrono::milliseconds timeout) {
+  if (!timer_) {
+    timer_ = dispatcher_.createTimer([this]() -> void {
+      std::string expired;
+      {
+        std::unique_lock<std::mutex> lock(lock_);
+        expired.swap(attachment_name_);
+      }
+      if (!expired.empty() && on_expired_) {
+        on_expired_(expired);
+      }
+      provision();
+    });
+  }
+  timer_->enableTimer(timeout);
+}
+
+} // namespace Squash
+} // namespace Solo
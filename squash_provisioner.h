@@ -0,0 +1,89 @@
+#pragma once
+
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "envoy/event/dispatcher.h"
+#include "envoy/event/timer.h"
+
+#include "common/common/logger.h"
+
+#include "squash_client.h"
+
+namespace Solo {
+namespace Squash {
+
+/**
+ * Keeps one debugattachment object created ahead of time, so a triggered
+ * session can skip the create round trip. Lives on the main thread; workers
+ * only take() the provisioned attachment, which schedules a refresh. Once
+ * stop()ped it may be released on any thread.
+ */
+class AttachmentProvisioner
+    : public SquashClientCallbacks,
+      public std::enable_shared_from_this<AttachmentProvisioner>,
+      protected Envoy::Logger::Loggable<Envoy::Logger::Id::filter> {
+public:
+  /**
+   * Called on the main thread with an attachment that expired unused.
+   */
+  typedef std::function<void(const std::string &)> ExpiredCb;
+
+  AttachmentProvisioner(SquashClientPtr &&client,
+                        Envoy::Event::Dispatcher &dispatcher,
+                        std::chrono::milliseconds retry_every,
+                        std::chrono::milliseconds ttl,
+                        ExpiredCb on_expired = nullptr);
+  ~AttachmentProvisioner();
+
+  /**
+   * Schedules creation of the first attachment on the main thread.
+   */
+  void start();
+
+  /**
+   * Stops provisioning on the main thread. An attachment provisioned already
+   * can still be taken.
+   */
+  void stop();
+
+  /**
+   * Takes ownership of the provisioned attachment. May be called from any
+   * thread.
+   * @return the attachment name or an empty string if none is ready.
+   */
+  std::string take();
+
+  // SquashClientCallbacks
+  void onAttachmentCreated(const std::string &attachment_name) override;
+  void onAttachmentState(const std::string &, const std::string &,
+                         bool) override {}
+  void onAttachmentWatched() override {}
+  void onAttachmentsDeleted(bool) override {}
+
+private:
+  void provision();
+  void scheduleProvision();
+  void armTimer(std::chrono::milliseconds timeout);
+
+  SquashClientPtr client_;
+  Envoy::Event::Dispatcher &dispatcher_;
+  const std::chrono::milliseconds retry_every_;
+  const std::chrono::milliseconds ttl_;
+  ExpiredCb on_expired_;
+
+  std::mutex lock_;
+  std::string attachment_name_;
+
+  Envoy::Event::TimerPtr timer_;
+  bool provisioning_;
+  bool stopped_;
+};
+
+typedef std::shared_ptr<AttachmentProvisioner> AttachmentProvisionerSharedPtr;
+
+} // namespace Squash
+} // namespace Solo
@@ -0,0 +1,140 @@
+#include <algorithm>
+#include <iterator>
+#include <string>
+
+#include "squash_reaper.h"
+
+namespace Solo {
+namespace Squash {
+
+const uint32_t AttachmentReaper::MAX_BACKOFF_INTERVALS;
+
+AttachmentReaper::AttachmentReaper(
+    SquashClientFactoryConstSharedPtr client_factory,
+    Envoy::Event::Dispatcher &dispatcher, Envoy::Upstream::ClusterManager &cm,
+    const SquashFilterStats &stats, uint32_t max_concurrent,
+    std::chrono::milliseconds interval)
+    : client_factory_(client_factory), dispatcher_(dispatcher), cm_(cm),
+      stats_(stats), max_concurrent_(std::max(max_concurrent, 1U)),
+      interval_(interval), queue_(), deletions_(), timer_(nullptr),
+      backoff_(interval), backing_off_(false), draining_(false) {}
+
+AttachmentReaper::~AttachmentReaper() {
+  for (DeletionPtr &deletion : deletions_) {
+    deletion->cancel();
+  }
+
+  if (timer_) {
+    timer_->disableTimer();
+    timer_.reset();
+  }
+}
+
+void AttachmentReaper::abandon(const std::string &attachment_name,
+                               const std::string &shard_key) {
+  enqueue(Abandoned{attachment_name, shard_key, 0});
+  drain();
+}
+
+void AttachmentReaper::enqueue(Abandoned &&abandoned) {
+  if (queue_.size() >= MAX_QUEUED) {
+    ENVOY_LOG(debug, "Squash: too many abandoned attachments, not deleting {}",
+              queue_.front().name);
+    stats_.abandoned_attachments_dropped_.inc();
+    queue_.pop_front();
+  }
+  queue_.push_back(std::move(abandoned));
+}
+
+void AttachmentReaper::backOff() {
+  if (backing_off_) {
+    return;
+  }
+  if (!timer_) {
+    timer_ = dispatcher_.createTimer([this]() -> void {
+      backing_off_ = false;
+      drain();
+    });
+  }
+  backing_off_ = true;
+  timer_->enableTimer(backoff_);
+  backoff_ = std::min(backoff_ * 2, interval_ * MAX_BACKOFF_INTERVALS);
+}
+
+void AttachmentReaper::drain() {
+  if (draining_) {
+    return;
+  }
+  draining_ = true;
+  while (!backing_off_ && !queue_.empty() &&
+         deletions_.size() < max_concurrent_) {
+    const std::string shard_key = queue_.front().shard_key;
+    SquashClientPtr client = shard_key.empty()
+                                 ? client_factory_->create(cm_)
+                                 : client_factory_->createForShard(cm_, shard_key);
+    size_t max_batch = std::min(std::max(client->maxDeleteBatch(), size_t(1)),
+                                queue_.size());
+    // a batch goes to a single cluster.
+    size_t batch = 1;
+    while (batch < max_batch && queue_[batch].shard_key == shard_key) {
+      batch++;
+    }
+    std::vector<Abandoned> abandoned(
+        std::make_move_iterator(queue_.begin()),
+        std::make_move_iterator(queue_.begin() + batch));
+    queue_.erase(queue_.begin(), queue_.begin() + batch);
+
+    DeletionPtr deletion(
+        new Deletion(*this, std::move(client), std::move(abandoned)));
+    deletion->moveIntoList(std::move(deletion), deletions_);
+    // may complete inline and remove itself from the list.
+    deletions_.front()->start();
+  }
+  draining_ = false;
+}
+
+void AttachmentReaper::onDeletionDone(Deletion &deletion, bool success,
+                                      std::vector<Abandoned> &abandoned) {
+  dispatcher_.deferredDelete(deletion.removeFromList(deletions_));
+  if (success) {
+    backoff_ = interval_;
+  } else {
+    for (Abandoned &entry : abandoned) {
+      if (++entry.attempts < MAX_ATTEMPTS) {
+        enqueue(std::move(entry));
+      } else {
+        stats_.abandoned_attachments_dropped_.inc();
+      }
+    }
+    backOff();
+  }
+  // a free slot takes the next batch right away.
+  drain();
+}
+
+AttachmentReaper::Deletion::Deletion(AttachmentReaper &parent,
+                                     SquashClientPtr &&client,
+                                     std::vector<Abandoned> &&abandoned)
+    : parent_(parent), client_(std::move(client)),
+      abandoned_(std::move(abandoned)), names_() {
+  for (const Abandoned &entry : abandoned_) {
+    names_.push_back(entry.name);
+  }
+}
+
+void AttachmentReaper::Deletion::start() {
+  client_->deleteAttachments(names_, *this);
+}
+
+void AttachmentReaper::Deletion::onAttachmentsDeleted(bool success) {
+  if (success) {
+    ENVOY_LOG(debug, "Squash: deleted {} abandoned attachments", names_.size());
+  } else {
+    ENVOY_LOG(info, "Squash: can't delete {} abandoned attachments",
+              names_.size());
+  }
+  parent_.onDeletionDone(*this, success, abandoned_);
+}
+
+} // namespace Squash
+} // namespace Solo
@@ -0,0 +1,121 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <list>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "envoy/event/deferred_deletable.h"
+#include "envoy/event/dispatcher.h"
+#include "envoy/event/timer.h"
+#include "envoy/upstream/cluster_manager.h"
+
+#include "common/common/linked_object.h"
+#include "common/common/logger.h"
+
+#include "squash_client.h"
+#include "squash_client_factory.h"
+#include "squash_filter_config.h"
+
+namespace Solo {
+namespace Squash {
+
+/**
+ * Deletes the debugattachment objects nobody waits for anymore, e.g. the ones
+ * left behind by timed out sessions. Abandoned names are sent as soon as one
+ * of the max_concurrent delete requests is free; the names that queued up
+ * meanwhile share a batch if they go to the same squash cluster. A failed
+ * delete is retried up to MAX_ATTEMPTS times, after a backoff that starts at
+ * interval.
+ */
+class AttachmentReaper
+    : protected Envoy::Logger::Loggable<Envoy::Logger::Id::filter> {
+public:
+  AttachmentReaper(SquashClientFactoryConstSharedPtr client_factory,
+                   Envoy::Event::Dispatcher &dispatcher,
+                   Envoy::Upstream::ClusterManager &cm,
+                   const SquashFilterStats &stats, uint32_t max_concurrent,
+                   std::chrono::milliseconds interval);
+  ~AttachmentReaper();
+
+  /**
+   * Queues an attachment for deletion.
+   * @param shard_key the chain attachment it was created from, whose squash
+   *        cluster the delete goes to, or empty for the pod's.
+   */
+  void abandon(const std::string &attachment_name,
+               const std::string &shard_key = "");
+
+  size_t pending() const { return queue_.size(); }
+
+private:
+  // bounds the memory used while the squash server is unreachable; the
+  // oldest names are dropped first and counted in
+  // abandoned_attachments_dropped.
+  static const size_t MAX_QUEUED = 10000;
+  static const uint32_t MAX_ATTEMPTS = 3;
+  // the backoff doubles after every failed delete up to this many intervals.
+  static const uint32_t MAX_BACKOFF_INTERVALS = 32;
+
+  struct Abandoned {
+    std::string name;
+    std::string shard_key;
+    uint32_t attempts;
+  };
+
+  class Deletion : public SquashClientCallbacks,
+                   public Envoy::LinkedObject<Deletion>,
+                   public Envoy::Event::DeferredDeletable {
+  public:
+    Deletion(AttachmentReaper &parent, SquashClientPtr &&client,
+             std::vector<Abandoned> &&abandoned);
+
+    void start();
+    void cancel() { client_->cancel(); }
+
+    // SquashClientCallbacks
+    void onAttachmentCreated(const std::string &) override {}
+    void onAttachmentState(const std::string &, const std::string &,
+                           bool) override {}
+    void onAttachmentWatched() override {}
+    void onAttachmentsDeleted(bool success) override;
+
+  private:
+    AttachmentReaper &parent_;
+    SquashClientPtr client_;
+    std::vector<Abandoned> abandoned_;
+    std::vector<std::string> names_;
+  };
+
+  typedef std::unique_ptr<Deletion> DeletionPtr;
+
+  void enqueue(Abandoned &&abandoned);
+  void backOff();
+  void drain();
+  void onDeletionDone(Deletion &deletion, bool success,
+                      std::vector<Abandoned> &abandoned);
+
+  SquashClientFactoryConstSharedPtr client_factory_;
+  Envoy::Event::Dispatcher &dispatcher_;
+  Envoy::Upstream::ClusterManager &cm_;
+  SquashFilterStats stats_;
+  const uint32_t max_concurrent_;
+  const std::chrono::milliseconds interval_;
+
+  std::deque<Abandoned> queue_;
+  std::list<DeletionPtr> deletions_;
+  Envoy::Event::TimerPtr timer_;
+  std::chrono::milliseconds backoff_;
+  // true while the timer runs; nothing is sent until it fires.
+  bool backing_off_;
+  // true while drain() is on the stack; deletions may complete inline.
+  bool draining_;
+};
+
+typedef std::unique_ptr<AttachmentReaper> AttachmentReaperPtr;
+
+} // namespace Squash
+} // namespace Solo
@@ -0,0 +1,321 @@
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <fstream>
+#include <string>
+
+#include "squash_replay.h"
+#include "squash_worker.h"
+
+#include "common/buffer/buffer_impl.h"
+#include "common/http/header_map_impl.h"
+#include "common/http/message_impl.h"
+#include "common/protobuf/utility.h"
+
+namespace Solo {
+namespace Squash {
+
+namespace {
+void addHeader(const Envoy::Http::HeaderEntry &header, void *context) {
+  auto *captured = static_cast<
+      Envoy::Protobuf::RepeatedPtrField<solo::squash::pb::CapturedHeader> *>(
+      context);
+  solo::squash::pb::CapturedHeader *entry = captured->Add();
+  entry->set_key(header.key().c_str());
+  entry->set_value(header.value().c_str());
+}
+
+// credentials are not written to disk.
+bool sensitive(const std::string &key) {
+  return key == "authorization" || key == "proxy-authorization" ||
+         key == "cookie";
+}
+
+void addRedactedHeader(const Envoy::Http::HeaderEntry &header, void *context) {
+  if (!sensitive(header.key().c_str())) {
+    addHeader(header, context);
+  }
+}
+} // namespace
+
+void Spool::capture(const Envoy::Http::HeaderMap &headers,
+                    const Envoy::Router::RouteEntry *route, bool redact,
+                    solo::squash::pb::CapturedRequest &request) {
+  Envoy::Http::HeaderMapImpl forwarded(headers);
+  if (route != nullptr) {
+    // on a copy; the request may still continue through the router.
+    route->finalizeRequestHeaders(forwarded);
+    if (route->timeout().count() > 0) {
+      request.mutable_timeout()->CopyFrom(
+          Envoy::Protobuf::util::TimeUtil::MillisecondsToDuration(
+              route->timeout().count()));
+    }
+  }
+  forwarded.iterate(redact ? addRedactedHeader : addHeader,
+                    request.mutable_headers());
+}
+
+void Spool::addHeaders(
+    const Envoy::Http::HeaderMap &headers,
+    Envoy::Protobuf::RepeatedPtrField<solo::squash::pb::CapturedHeader>
+        &captured) {
+  headers.iterate(addHeader, &captured);
+}
+
+bool Spool::write(const std::string &path,
+                  const solo::squash::pb::CapturedRequest &request) {
+  std::string data;
+  if (!request.SerializeToString(&data)) {
+    return false;
+  }
+
+  // a new file only we can read; never one planted in a shared spool
+  // directory.
+  int fd = ::open(path.c_str(),
+                  O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600);
+  if (fd < 0) {
+    return false;
+  }
+  size_t written = 0;
+  while (written < data.size()) {
+    ssize_t rc = ::write(fd, data.data() + written, data.size() - written);
+    if (rc < 0 && errno == EINTR) {
+      continue;
+    }
+    if (rc <= 0) {
+      break;
+    }
+    written += rc;
+  }
+  return ::close(fd) == 0 && written == data.size();
+}
+
+bool Spool::read(const std::string &path,
+                 solo::squash::pb::CapturedRequest &request) {
+  std::ifstream file(path, std::ios::binary);
+  return file && request.ParseFromIstream(&file);
+}
+
+void Spool::remove(const std::string &path) { ::unlink(path.c_str()); }
+
+Envoy::Http::MessagePtr
+Spool::toMessage(const solo::squash::pb::CapturedRequest &captured) {
+  Envoy::Http::MessagePtr request(new Envoy::Http::RequestMessageImpl());
+  for (const solo::squash::pb::CapturedHeader &header : captured.headers()) {
+    request->headers().addCopy(Envoy::Http::LowerCaseString(header.key()),
+                               header.value());
+  }
+  if (!captured.body().empty()) {
+    request->body().reset(new Envoy::Buffer::OwnedImpl(captured.body()));
+  }
+  if (captured.trailers_size() > 0) {
+    Envoy::Http::HeaderMapPtr trailers(new Envoy::Http::HeaderMapImpl());
+    for (const solo::squash::pb::CapturedHeader &header : captured.trailers()) {
+      trailers->addCopy(Envoy::Http::LowerCaseString(header.key()),
+                        header.value());
+    }
+    request->trailers(std::move(trailers));
+  }
+  return request;
+}
+
+Envoy::Optional<std::chrono::milliseconds>
+Spool::timeout(const solo::squash::pb::CapturedRequest &request) {
+  if (!request.has_timeout()) {
+    return Envoy::Optional<std::chrono::milliseconds>();
+  }
+  return std::chrono::milliseconds(
+      Envoy::Protobuf::util::TimeUtil::DurationToMilliseconds(
+          request.timeout()));
+}
+
+SpoolIo::SpoolIo(Envoy::Event::Dispatcher &dispatcher)
+    : dispatcher_(dispatcher), jobs_(), stopping_(false), thread_(),
+      unfinished_writes_(), alive_(std::make_shared<bool>(true)) {}
+
+SpoolIo::~SpoolIo() {
+  if (thread_) {
+    {
+      std::unique_lock<std::mutex> guard(lock_);
+      stopping_ = true;
+    }
+    wakeup_.notify_one();
+    thread_->join();
+  }
+  // nobody will replay these anymore.
+  for (const std::string &path : unfinished_writes_) {
+    Spool::remove(path);
+  }
+}
+
+void SpoolIo::write(const std::string &path, CapturedRequestPtr &&request,
+                    WriteCb cb) {
+  unfinished_writes_.insert(path);
+  std::shared_ptr<solo::squash::pb::CapturedRequest> shared(std::move(request));
+  enqueue([this, path, shared, cb]() -> void {
+    bool written = Spool::write(path, *shared);
+    complete([this, path, cb, written]() -> void {
+      unfinished_writes_.erase(path);
+      cb(written);
+    });
+  });
+}
+
+void SpoolIo::read(const std::string &path, ReadCb cb) {
+  enqueue([this, path, cb]() -> void {
+    std::shared_ptr<solo::squash::pb::CapturedRequest> request =
+        std::make_shared<solo::squash::pb::CapturedRequest>();
+    if (!Spool::read(path, *request)) {
+      request.reset();
+    }
+    complete([cb, request]() -> void { cb(request.get()); });
+  });
+}
+
+void SpoolIo::remove(const std::string &path) {
+  enqueue([path]() -> void { Spool::remove(path); });
+}
+
+void SpoolIo::enqueue(Job job) {
+  std::unique_lock<std::mutex> guard(lock_);
+  jobs_.push_back(job);
+  if (!thread_) {
+    thread_.reset(new Envoy::Thread::Thread([this]() -> void { run(); }));
+  }
+  wakeup_.notify_one();
+}
+
+void SpoolIo::complete(std::function<void()> cb) {
+  std::weak_ptr<bool> alive = alive_;
+  dispatcher_.post([alive, cb]() -> void {
+    if (alive.lock()) {
+      cb();
+    }
+  });
+}
+
+void SpoolIo::run() {
+  std::unique_lock<std::mutex> guard(lock_);
+  while (true) {
+    wakeup_.wait(guard, [this]() -> bool { return stopping_ || !jobs_.empty(); });
+    // the queued removes still run on the way out.
+    if (jobs_.empty()) {
+      return;
+    }
+    Job job = jobs_.front();
+    jobs_.pop_front();
+    guard.unlock();
+    job();
+    guard.lock();
+  }
+}
+
+ReplaySession::ReplaySession(SquashFilterConfigSharedPtr config,
+                             SquashWorker &worker,
+                             const std::string &spool_path)
+    : config_(config), worker_(worker), spool_path_(spool_path),
+      session_(nullptr), replay_request_(nullptr), sending_(false),
+      replayed_(false) {}
+
+ReplaySession::~ReplaySession() {}
+
+void ReplaySession::start() {
+  // the worker we run on rather than config_->worker(): a replay may outlive
+  // the filter factory, and with it the slot config_->worker() looks up.
+  session_.reset(
+      new SquashSession(config_, worker_, worker_.clusterManager(), *this));
+  if (!session_->start()) {
+    replay();
+  }
+}
+
+void ReplaySession::cancel() {
+  if (session_) {
+    session_->cancel();
+  }
+  if (replay_request_ != nullptr) {
+    replay_request_->cancel();
+    replay_request_ = nullptr;
+  }
+  worker_.spoolIo().remove(spool_path_);
+}
+
+Envoy::Event::Dispatcher &ReplaySession::dispatcher() {
+  return worker_.dispatcher();
+}
+
+void ReplaySession::onSessionDone(bool attached) {
+  ENVOY_LOG(debug, "Squash: replaying {} (attached: {})", spool_path_,
+            attached);
+  replay();
+}
+
+void ReplaySession::replay() {
+  worker_.spoolIo().read(
+      spool_path_,
+      [this](const solo::squash::pb::CapturedRequest *captured) -> void {
+        if (captured == nullptr) {
+          ENVOY_LOG(warn, "Squash: can't read captured request {}",
+                    spool_path_);
+          done();
+          return;
+        }
+        send(*captured);
+      });
+}
+
+void ReplaySession::send(const solo::squash::pb::CapturedRequest &captured) {
+  if (!worker_.clusterManager().get(captured.cluster())) {
+    // e.g. removed through CDS since the request was captured.
+    ENVOY_LOG(info, "Squash: no cluster {} to replay {} to", captured.cluster(),
+              spool_path_);
+    config_->stats().failed_replays_.inc();
+    done();
+    return;
+  }
+  Envoy::Http::MessagePtr request = Spool::toMessage(captured);
+
+  // the route's timeout applies as it would have to the original request.
+  sending_ = true;
+  Envoy::Http::AsyncClient::Request *replay_request =
+      worker_.clusterManager()
+          .httpAsyncClientForCluster(captured.cluster())
+          .send(std::move(request), *this, Spool::timeout(captured));
+  sending_ = false;
+  if (replay_request != nullptr) {
+    replay_request_ = replay_request;
+  }
+  // the async client may answer inline, in which case we finish here.
+  if (replayed_) {
+    done();
+  }
+}
+
+void ReplaySession::onSuccess(Envoy::Http::MessagePtr &&m) {
+  ENVOY_LOG(debug, "Squash: replayed {} with status {}", spool_path_,
+            m->headers().Status()->value().c_str());
+  onReplayed();
+}
+
+void ReplaySession::onFailure(Envoy::Http::AsyncClient::FailureReason) {
+  ENVOY_LOG(info, "Squash: failed replaying {}", spool_path_);
+  config_->stats().failed_replays_.inc();
+  onReplayed();
+}
+
+void ReplaySession::onReplayed() {
+  replay_request_ = nullptr;
+  replayed_ = true;
+  if (!sending_) {
+    done();
+  }
+}
+
+void ReplaySession::done() {
+  worker_.spoolIo().remove(spool_path_);
+  worker_.onReplayDone(*this);
+}
+
+} // namespace Squash
+} // namespace Solo
@@ -0,0 +1,170 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+
+#include "envoy/common/optional.h"
+#include "envoy/event/deferred_deletable.h"
+#include "envoy/event/dispatcher.h"
+#include "envoy/http/async_client.h"
+#include "envoy/http/header_map.h"
+#include "envoy/router/router.h"
+
+#include "common/common/linked_object.h"
+#include "common/common/logger.h"
+#include "common/common/thread.h"
+
+#include "squash.pb.h"
+#include "squash_filter_config.h"
+#include "squash_session.h"
+
+namespace Solo {
+namespace Squash {
+
+class SquashWorker;
+
+typedef std::unique_ptr<solo::squash::pb::CapturedRequest> CapturedRequestPtr;
+
+/**
+ * Reads and writes captured requests to the spool directory.
+ */
+class Spool {
+public:
+  /**
+   * Captures request headers as route forwards them: rewritten, and with the
+   * route's timeout.
+   * @param route the route of the request, or nullptr to keep the headers as
+   *        they are.
+   * @param redact whether to leave out credentials, for requests that are
+   *        written to disk.
+   */
+  static void capture(const Envoy::Http::HeaderMap &headers,
+                      const Envoy::Router::RouteEntry *route, bool redact,
+                      solo::squash::pb::CapturedRequest &request);
+  static void addHeaders(
+      const Envoy::Http::HeaderMap &headers,
+      Envoy::Protobuf::RepeatedPtrField<solo::squash::pb::CapturedHeader>
+          &captured);
+
+  /**
+   * Writes request to a new file only the current user can read. Blocks on
+   * the disk; see SpoolIo.
+   */
+  static bool write(const std::string &path,
+                    const solo::squash::pb::CapturedRequest &request);
+  static bool read(const std::string &path,
+                   solo::squash::pb::CapturedRequest &request);
+  static void remove(const std::string &path);
+
+  /**
+   * @return the request to send for a captured one.
+   */
+  static Envoy::Http::MessagePtr
+  toMessage(const solo::squash::pb::CapturedRequest &request);
+
+  /**
+   * @return the timeout to send a captured request with.
+   */
+  static Envoy::Optional<std::chrono::milliseconds>
+  timeout(const solo::squash::pb::CapturedRequest &request);
+};
+
+/**
+ * Runs the spool file I/O of a worker on a thread of its own, so that the
+ * event loop never waits for the disk. The thread starts with the first
+ * request. Completions are posted to the worker's dispatcher and dropped
+ * once the SpoolIo is gone; the files of writes that did not complete by then
+ * are removed.
+ */
+class SpoolIo : protected Envoy::Logger::Loggable<Envoy::Logger::Id::filter> {
+public:
+  typedef std::function<void(bool written)> WriteCb;
+  /**
+   * Called with the request read, or nullptr if it can't be read.
+   */
+  typedef std::function<void(const solo::squash::pb::CapturedRequest *)>
+      ReadCb;
+
+  SpoolIo(Envoy::Event::Dispatcher &dispatcher);
+  ~SpoolIo();
+
+  void write(const std::string &path, CapturedRequestPtr &&request,
+             WriteCb cb);
+  void read(const std::string &path, ReadCb cb);
+  void remove(const std::string &path);
+
+private:
+  typedef std::function<void()> Job;
+
+  void enqueue(Job job);
+  void complete(std::function<void()> cb);
+  void run();
+
+  Envoy::Event::Dispatcher &dispatcher_;
+  std::mutex lock_;
+  std::condition_variable wakeup_;
+  std::deque<Job> jobs_;
+  bool stopping_;
+  Envoy::Thread::ThreadPtr thread_;
+  // the writes not reported yet; only used on the worker thread.
+  std::set<std::string> unfinished_writes_;
+  // completions run only while this is alive.
+  std::shared_ptr<bool> alive_;
+};
+
+/**
+ * A debug session for a request that was already answered with a 202. Once
+ * the session is done the captured request is replayed to its upstream.
+ */
+class ReplaySession
+    : public SquashSessionCallbacks,
+      public Envoy::Http::AsyncClient::Callbacks,
+      public Envoy::LinkedObject<ReplaySession>,
+      public Envoy::Event::DeferredDeletable,
+      protected Envoy::Logger::Loggable<Envoy::Logger::Id::filter> {
+public:
+  ReplaySession(SquashFilterConfigSharedPtr config, SquashWorker &worker,
+                const std::string &spool_path);
+  ~ReplaySession();
+
+  void start();
+
+  /**
+   * Cancels the session; the request is not replayed and its spool file is
+   * removed.
+   */
+  void cancel();
+
+  // SquashSessionCallbacks
+  Envoy::Event::Dispatcher &dispatcher() override;
+  void onSessionDone(bool attached) override;
+
+  // Http::AsyncClient::Callbacks
+  void onSuccess(Envoy::Http::MessagePtr &&) override;
+  void onFailure(Envoy::Http::AsyncClient::FailureReason) override;
+
+private:
+  void replay();
+  void send(const solo::squash::pb::CapturedRequest &captured);
+  void onReplayed();
+  void done();
+
+  SquashFilterConfigSharedPtr config_;
+  SquashWorker &worker_;
+  std::string spool_path_;
+  SquashSessionPtr session_;
+  Envoy::Http::AsyncClient::Request *replay_request_;
+  bool sending_;
+  bool replayed_;
+};
+
+typedef std::unique_ptr<ReplaySession> ReplaySessionPtr;
+
+} // namespace Squash
+} // namespace Solo
@@ -0,0 +1,127 @@
+#include <string>
+
+#include "squash_api.h"
+#include "squash_rest_client.h"
+
+#include "common/common/assert.h"
+#include "common/http/utility.h"
+
+namespace Solo {
+namespace Squash {
+
+RestSquashClient::RestSquashClient(
+    Envoy::Upstream::ClusterManager &cm, const std::string &squash_cluster_name,
+    const std::string &attachment_json,
+    const std::chrono::milliseconds &squash_request_timeout)
+    : cm_(cm), squash_cluster_name_(squash_cluster_name),
+      attachment_json_(attachment_json),
+      squash_request_timeout_(squash_request_timeout), pending_(NONE),
+      callbacks_(nullptr), in_flight_request_(nullptr) {}
+
+RestSquashClient::~RestSquashClient() { cancel(); }
+
+void RestSquashClient::createAttachment(SquashClientCallbacks &callbacks) {
+  send(SquashApi::createAttachmentRequest(attachment_json_), CREATE,
+       callbacks);
+}
+
+void RestSquashClient::getAttachment(const std::string &attachment_name,
+                                     SquashClientCallbacks &callbacks) {
+  send(SquashApi::getAttachmentRequest(
+           SquashApi::attachmentPath(attachment_name)),
+       GET, callbacks);
+}
+
+void RestSquashClient::deleteAttachments(const std::vector<std::string> &names,
+                                         SquashClientCallbacks &callbacks) {
+  ASSERT(names.size() == 1);
+  send(SquashApi::deleteAttachmentRequest(SquashApi::attachmentPath(names[0])),
+       DELETE, callbacks);
+}
+
+void RestSquashClient::cancel() {
+  pending_ = NONE;
+  if (in_flight_request_ != nullptr) {
+    in_flight_request_->cancel();
+    in_flight_request_ = nullptr;
+  }
+}
+
+void RestSquashClient::send(Envoy::Http::MessagePtr &&request, Request type,
+                            SquashClientCallbacks &callbacks) {
+  pending_ = type;
+  callbacks_ = &callbacks;
+  // the squash cluster may not have arrived through CDS yet.
+  if (!cm_.get(squash_cluster_name_)) {
+    onFailure(Envoy::Http::AsyncClient::FailureReason::Reset);
+    return;
+  }
+  Envoy::Http::AsyncClient::Request *in_flight_request =
+      cm_.httpAsyncClientForCluster(squash_cluster_name_)
+          .send(std::move(request), *this, squash_request_timeout_);
+  // a null request means onSuccess/onFailure were called inline, and the
+  // callbacks may have sent the next request already.
+  if (in_flight_request != nullptr) {
+    in_flight_request_ = in_flight_request;
+  }
+}
+
+void RestSquashClient::onSuccess(Envoy::Http::MessagePtr &&m) {
+  in_flight_request_ = nullptr;
+  Request type = pending_;
+  pending_ = NONE;
+
+  switch (type) {
+  case NONE: {
+    // Should never happen..
+    break;
+  }
+  case CREATE: {
+    if (m->headers().Status()->value() != "201") {
+      ENVOY_LOG(info, "Squash: can't create attachment object. status {}",
+                m->headers().Status()->value().c_str());
+    }
+    callbacks_->onAttachmentCreated(SquashApi::attachmentName(*m));
+    break;
+  }
+  case GET: {
+    SquashApi::AttachmentStatus status = SquashApi::attachmentStatus(*m);
+    callbacks_->onAttachmentState(status.state, status.endpoint, false);
+    break;
+  }
+  case DELETE: {
+    // an attachment that is already gone is as good as deleted.
+    uint64_t status = Envoy::Http::Utility::getResponseStatus(m->headers());
+    callbacks_->onAttachmentsDeleted((status >= 200 && status < 300) ||
+                                     status == 404);
+    break;
+  }
+  }
+}
+
+void RestSquashClient::onFailure(Envoy::Http::AsyncClient::FailureReason) {
+  in_flight_request_ = nullptr;
+  Request type = pending_;
+  pending_ = NONE;
+
+  switch (type) {
+  case NONE: {
+    break;
+  }
+  case CREATE: {
+    callbacks_->onAttachmentCreated("");
+    break;
+  }
+  case GET: {
+    callbacks_->onAttachmentState("", "", false);
+    break;
+  }
+  case DELETE: {
+    callbacks_->onAttachmentsDeleted(false);
+    break;
+  }
+  }
+}
+
+} // namespace Squash
+} // namespace Solo
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <chrono>
+#include <string>
+
+#include "envoy/http/async_client.h"
+#include "envoy/upstream/cluster_manager.h"
+
+#include "common/common/logger.h"
+
+#include "squash_client.h"
+
+namespace Solo {
+namespace Squash {
+
+/**
+ * SquashClient talking JSON to the squash server REST api.
+ */
+class RestSquashClient
+    : public SquashClient,
+      public Envoy::Http::AsyncClient::Callbacks,
+      protected Envoy::Logger::Loggable<Envoy::Logger::Id::filter> {
+public:
+  RestSquashClient(Envoy::Upstream::ClusterManager &cm,
+                   const std::string &squash_cluster_name,
+                   const std::string &attachment_json,
+                   const std::chrono::milliseconds &squash_request_timeout);
+  ~RestSquashClient();
+
+  // SquashClient
+  void createAttachment(SquashClientCallbacks &callbacks) override;
+  void getAttachment(const std::string &attachment_name,
+                     SquashClientCallbacks &callbacks) override;
+  void deleteAttachments(const std::vector<std::string> &names,
+                         SquashClientCallbacks &callbacks) override;
+  // the REST api deletes one attachment per request.
+  size_t maxDeleteBatch() override { return 1; }
+  void cancel() override;
+
+  // Http::AsyncClient::Callbacks
+  void onSuccess(Envoy::Http::MessagePtr &&) override;
+  void onFailure(Envoy::Http::AsyncClient::FailureReason) override;
+
+private:
+  enum Request {
+    NONE,
+    CREATE,
+    GET,
+    DELETE,
+  };
+
+  void send(Envoy::Http::MessagePtr &&request, Request type,
+            SquashClientCallbacks &callbacks);
+
+  Envoy::Upstream::ClusterManager &cm_;
+  const std::string squash_cluster_name_;
+  const std::string attachment_json_;
+  const std::chrono::milliseconds squash_request_timeout_;
+
+  Request pending_;
+  SquashClientCallbacks *callbacks_;
+  Envoy::Http::AsyncClient::Request *in_flight_request_;
+};
+
+} // namespace Squash
+} // namespace Solo
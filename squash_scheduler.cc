@@ -0,0 +1,37 @@
+#include "squash_scheduler.h"
+
+namespace Solo {
+namespace Squash {
+
+RequestScheduler::RequestScheduler(uint32_t max_in_flight)
+    : max_in_flight_(max_in_flight), in_flight_(0), queue_(),
+      scheduling_(false) {}
+
+bool RequestScheduler::acquire(ScheduledRequest &request, Deadline deadline,
+                               Queue::iterator &position) {
+  if (max_in_flight_ == 0 || in_flight_ < max_in_flight_) {
+    in_flight_++;
+    return true;
+  }
+  position = queue_.emplace(deadline, &request);
+  return false;
+}
+
+void RequestScheduler::release() {
+  in_flight_--;
+  if (scheduling_) {
+    return;
+  }
+
+  scheduling_ = true;
+  while (!queue_.empty() && in_flight_ < max_in_flight_) {
+    ScheduledRequest *request = queue_.begin()->second;
+    queue_.erase(queue_.begin());
+    in_flight_++;
+    request->onScheduled();
+  }
+  scheduling_ = false;
+}
+
+} // namespace Squash
+} // namespace Solo
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <map>
+
+#include "envoy/common/pure.h"
+
+namespace Solo {
+namespace Squash {
+
+/**
+ * A request waiting for its turn in a RequestScheduler.
+ */
+class ScheduledRequest {
+public:
+  virtual ~ScheduledRequest() {}
+
+  /**
+   * Called once the request holds a slot and may be sent. The slot is given
+   * back with RequestScheduler::release().
+   */
+  virtual void onScheduled() PURE;
+};
+
+/**
+ * Caps the squash requests a worker has in flight. Requests beyond the cap
+ * wait and get a slot in order of their deadline, so the sessions closest to
+ * their attachment_timeout are served first. Only used on the owning worker
+ * thread.
+ */
+class RequestScheduler {
+public:
+  typedef std::chrono::steady_clock::time_point Deadline;
+  typedef std::multimap<Deadline, ScheduledRequest *> Queue;
+
+  /**
+   * @param max_in_flight the cap, or 0 for no cap.
+   */
+  RequestScheduler(uint32_t max_in_flight);
+
+  /**
+   * Takes a slot if one is free. Otherwise queues request, whose
+   * onScheduled() is called once it gets a slot.
+   * @param position set to the queue position if the request was queued.
+   * @return whether the slot was taken and the request may be sent now.
+   */
+  bool acquire(ScheduledRequest &request, Deadline deadline,
+               Queue::iterator &position);
+
+  /**
+   * Removes a queued request.
+   */
+  void dequeue(Queue::iterator position) { queue_.erase(position); }
+
+  /**
+   * Gives a slot back and hands it to the queued requests.
+   */
+  void release();
+
+  size_t inFlight() const { return in_flight_; }
+  size_t queued() const { return queue_.size(); }
+
+private:
+  const uint32_t max_in_flight_;
+  uint32_t in_flight_;
+  Queue queue_;
+  // true while queued requests are handed slots; requests that complete
+  // inline give their slot back to the running loop.
+  bool scheduling_;
+};
+
+} // namespace Squash
+} // namespace Solo
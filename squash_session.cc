@@ -0,0 +1,353 @@
+#include <string>
+
+#include "squash_provisioner.h"
+#include "squash_session.h"
+#include "squash_worker.h"
+
+namespace Solo {
+namespace Squash {
+
+SquashSession::SquashSession(SquashFilterConfigSharedPtr config,
+                             SquashWorker &worker,
+                             Envoy::Upstream::ClusterManager &cm,
+                             SquashSessionCallbacks &callbacks, bool profile)
+    : config_(config), cm_(cm), profile_(profile),
+      handoff_(profile ? SessionHandoffSharedPtr() : config->handoff()),
+      shard_key_(), client_(createClient()),
+      hedge_client_(), callbacks_(callbacks), worker_(worker),
+      events_(worker_.events()), id_(events_.nextSessionId()),
+      state_(INITIAL),
+      debugConfigId_(), endpoint_(), attached_(false), delay_timer_(nullptr),
+      attachment_timeout_timer_(nullptr), hedge_timer_(nullptr),
+      starting_(false), registration_(), registered_(false), polling_(false),
+      polls_in_flight_(0), poll_started_(), deadline_(), queue_position_(), queued_(false),
+      holds_slot_(false) {}
+
+SquashSession::~SquashSession() {
+  if (registered_) {
+    worker_.removeSession(registration_);
+  }
+  if (queued_) {
+    worker_.scheduler().dequeue(queue_position_);
+  }
+}
+
+bool SquashSession::start(const std::string &attachment_name) {
+  if (!attachment_name.empty()) {
+    shard_key_ = config_->chainAttachment(config_->service_name());
+    client_ = createClient();
+    // the next process would look for it on the pod's squash cluster.
+    handoff_.reset();
+  }
+
+  // an attachment left by the previous process may already be attached.
+  std::string provisioned = attachment_name;
+  if (provisioned.empty() && handoff_) {
+    provisioned = handoff_->take();
+  }
+  if (provisioned.empty() && !profile_ && config_->provisioner()) {
+    provisioned = config_->provisioner()->take();
+  }
+
+  starting_ = true;
+  deadline_ =
+      worker_.timeSource().currentTime() + config_->attachment_timeout();
+  events_.record(id_, SquashEventType::SessionStarted, !provisioned.empty());
+  if (!provisioned.empty()) {
+    // the attachment object already exists, go straight to checking it.
+    ENVOY_LOG(debug, "Squash: using existing attachment {}", provisioned);
+    checkAttachment(provisioned);
+  } else {
+    state_ = CREATE_CONFIG;
+    schedule();
+  }
+
+  // a failed create finishes the session inline.
+  if (!active()) {
+    starting_ = false;
+    return false;
+  }
+
+  attachment_timeout_timer_ = callbacks_.dispatcher().createTimer(
+      [this]() -> void {
+        events_.record(id_, SquashEventType::Timeout);
+        giveUp();
+        doneSquashing(false);
+      });
+  attachment_timeout_timer_->enableTimer(config_->attachment_timeout());
+  starting_ = false;
+
+  // check if the timer expired inline.
+  if (!active()) {
+    return false;
+  }
+  registration_ = worker_.addSession(*this);
+  registered_ = true;
+  return true;
+}
+
+SquashClientPtr SquashSession::createClient() {
+  if (!shard_key_.empty()) {
+    return config_->createChainClient(cm_, config_->service_name());
+  }
+  return profile_ ? config_->createProfileClient(cm_)
+                  : config_->createClient(cm_);
+}
+
+void SquashSession::cancel() {
+  if (active()) {
+    events_.record(id_, SquashEventType::Cancelled);
+    abandon();
+  }
+  reset();
+}
+
+void SquashSession::release() {
+  if (!active()) {
+    reset();
+    return;
+  }
+
+  events_.record(id_, SquashEventType::Released);
+  abandon();
+  reset();
+  callbacks_.onSessionDone(false);
+}
+
+void SquashSession::abandon() {
+  // a chain attachment is the ingress', whose token may not be trusted.
+  if (state_ != CHECK_ATTACHMENT || debugConfigId_.empty() ||
+      !shard_key_.empty()) {
+    return;
+  }
+  if (handoff_) {
+    // streams are reset and sessions released while draining for a hot
+    // restart; the next process resumes the attachment.
+    handoff_->keep(debugConfigId_);
+    return;
+  }
+  // the debugger may still attach to an attachment we no longer wait for.
+  worker_.abandonAttachment(debugConfigId_);
+}
+
+void SquashSession::giveUp() {
+  if (state_ != CHECK_ATTACHMENT || debugConfigId_.empty() ||
+      !shard_key_.empty()) {
+    return;
+  }
+  // once handed over, deleting it would pull it from under the session of
+  // the next process.
+  if (!handoff_ || handoff_->remove(debugConfigId_)) {
+    worker_.abandonAttachment(debugConfigId_);
+  }
+}
+
+void SquashSession::forget() {
+  if (state_ == CHECK_ATTACHMENT && handoff_) {
+    handoff_->remove(debugConfigId_);
+  }
+}
+
+void SquashSession::reset() {
+  state_ = INITIAL;
+  polling_ = false;
+  polls_in_flight_ = 0;
+  if (registered_) {
+    registered_ = false;
+    worker_.removeSession(registration_);
+  }
+  client_->cancel();
+  if (hedge_client_) {
+    hedge_client_->cancel();
+  }
+  if (queued_) {
+    queued_ = false;
+    worker_.scheduler().dequeue(queue_position_);
+  }
+  releaseSlot();
+
+  if (hedge_timer_) {
+    hedge_timer_->disableTimer();
+    hedge_timer_.reset();
+  }
+
+  if (attachment_timeout_timer_) {
+    attachment_timeout_timer_->disableTimer();
+    attachment_timeout_timer_.reset();
+  }
+
+  if (delay_timer_) {
+    delay_timer_->disableTimer();
+    delay_timer_.reset();
+  }
+}
+
+void SquashSession::onAttachmentCreated(const std::string &attachment_name) {
+  if (state_ != CREATE_CONFIG) {
+    return;
+  }
+  events_.record(id_, SquashEventType::CreateReceived, !attachment_name.empty());
+  releaseSlot();
+
+  if (attachment_name.empty()) {
+    // no retries here, as we couldnt create the attachment object.
+    ENVOY_LOG(info, "Squash: can't create attachment object - not squashing");
+    doneSquashing(false);
+    return;
+  }
+
+  checkAttachment(attachment_name);
+}
+
+void SquashSession::checkAttachment(const std::string &attachment_name) {
+  state_ = CHECK_ATTACHMENT;
+  debugConfigId_ = attachment_name;
+  if (handoff_) {
+    handoff_->add(debugConfigId_);
+  }
+  pollForAttachment();
+}
+
+void SquashSession::onAttachmentState(const std::string &attachmentstate,
+                                      const std::string &endpoint, bool more) {
+  if (state_ != CHECK_ATTACHMENT) {
+    return;
+  }
+  events_.record(id_, SquashEventType::PollReceived, !attachmentstate.empty());
+  releaseSlot();
+
+  if (polling_ && !more) {
+    if (polls_in_flight_ > 0) {
+      polls_in_flight_--;
+    }
+    if (attachmentstate.empty() && polls_in_flight_ > 0) {
+      // failed; the other of a hedged pair may still answer.
+      return;
+    }
+    // first successful answer wins; drop the other poll if it was hedged.
+    polling_ = false;
+    polls_in_flight_ = 0;
+    if (hedge_client_) {
+      client_->cancel();
+      hedge_client_->cancel();
+    }
+    if (hedge_timer_) {
+      hedge_timer_->disableTimer();
+    }
+    if (config_->hedging() && !attachmentstate.empty()) {
+      worker_.recordPollLatency(
+          std::chrono::duration_cast<std::chrono::milliseconds>(
+              worker_.timeSource().currentTime() - poll_started_));
+    }
+  }
+
+  // a profile request waits only until the capture started.
+  bool attached = profile_ ? attachmentstate == "profiling" ||
+                                 attachmentstate == "profiled"
+                           : attachmentstate == "attached";
+  bool error = attachmentstate == "error";
+  bool finalstate = attached || error;
+
+  if (finalstate) {
+    if (attached) {
+      endpoint_ = endpoint;
+    }
+    forget();
+    doneSquashing(attached);
+  } else if (!more) {
+    retry();
+  }
+}
+
+void SquashSession::onAttachmentWatched() {
+  if (state_ != CHECK_ATTACHMENT) {
+    return;
+  }
+  // the watch can last until attachment_timeout; don't hold a slot for it.
+  releaseSlot();
+}
+
+void SquashSession::retry() {
+  if (delay_timer_.get() == nullptr) {
+    delay_timer_ = callbacks_.dispatcher().createTimer(
+        [this]() -> void { pollForAttachment(); });
+  }
+  delay_timer_->enableTimer(config_->attachment_poll_every());
+}
+
+void SquashSession::schedule() {
+  if (worker_.scheduler().acquire(*this, deadline_, queue_position_)) {
+    onScheduled();
+    return;
+  }
+  queued_ = true;
+}
+
+void SquashSession::onScheduled() {
+  queued_ = false;
+  holds_slot_ = true;
+  if (state_ == CREATE_CONFIG) {
+    events_.record(id_, SquashEventType::CreateSent);
+    client_->createAttachment(*this);
+  } else {
+    sendPoll();
+  }
+}
+
+void SquashSession::releaseSlot() {
+  if (holds_slot_) {
+    holds_slot_ = false;
+    worker_.scheduler().release();
+  }
+}
+
+void SquashSession::pollForAttachment() { schedule(); }
+
+void SquashSession::sendPoll() {
+  polling_ = true;
+  polls_in_flight_ = 1;
+  poll_started_ = worker_.timeSource().currentTime();
+  events_.record(id_, SquashEventType::PollSent);
+  client_->getAttachment(debugConfigId_, *this);
+
+  if (!config_->hedging() || !polling_) {
+    return;
+  }
+
+  worker_.recordPoll();
+  if (!hedge_timer_) {
+    hedge_timer_ = callbacks_.dispatcher().createTimer(
+        [this]() -> void { hedgePoll(); });
+  }
+  hedge_timer_->enableTimer(worker_.pollLatencyPercentile(
+      config_->hedge_percentile(), config_->hedge_delay()));
+}
+
+void SquashSession::hedgePoll() {
+  if (!polling_ || !worker_.tryHedge(config_->hedge_budget_percent())) {
+    return;
+  }
+
+  // the squash cluster load balancer picks the host; with more than one
+  // replica this is most likely not the slow one.
+  ENVOY_LOG(debug, "Squash: hedging status poll for {}", debugConfigId_);
+  events_.record(id_, SquashEventType::PollHedged);
+  if (!hedge_client_) {
+    hedge_client_ = createClient();
+  }
+  polls_in_flight_++;
+  hedge_client_->getAttachment(debugConfigId_, *this);
+}
+
+void SquashSession::doneSquashing(bool attached) {
+  reset();
+  attached_ = attached;
+  events_.record(id_, SquashEventType::Resumed, attached);
+
+  if (!starting_) {
+    callbacks_.onSessionDone(attached);
+  }
+}
+
+} // namespace Squash
+} // namespace Solo
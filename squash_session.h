@@ -0,0 +1,180 @@
+#pragma once
+
+#include <chrono>
+#include <list>
+#include <string>
+
+#include "envoy/event/dispatcher.h"
+#include "envoy/event/timer.h"
+#include "envoy/upstream/cluster_manager.h"
+
+#include "common/common/logger.h"
+#include "squash_client.h"
+#include "squash_event_log.h"
+#include "squash_filter_config.h"
+#include "squash_scheduler.h"
+
+namespace Solo {
+namespace Squash {
+
+class SquashSession;
+class SquashWorker;
+typedef std::list<SquashSession *> SquashSessionList;
+
+/**
+ * Callbacks used by a SquashSession to reach its owner.
+ */
+class SquashSessionCallbacks {
+public:
+  virtual ~SquashSessionCallbacks() {}
+
+  /**
+   * @return the dispatcher the session should create its timers on.
+   */
+  virtual Envoy::Event::Dispatcher &dispatcher() PURE;
+
+  /**
+   * Called once when the session finished (attached, error, timeout or
+   * released).
+   * Not called if the session completed inline in start() or was cancelled.
+   * @param attached whether a debugger reported attached.
+   */
+  virtual void onSessionDone(bool attached) PURE;
+};
+
+/**
+ * Drives a single debug attachment against the squash server: creates the
+ * debugattachment object, polls it until it reaches a final state and gives up
+ * after attachment_timeout. Create and poll requests go through the worker's
+ * RequestScheduler.
+ */
+class SquashSession
+    : public SquashClientCallbacks,
+      public ScheduledRequest,
+      protected Envoy::Logger::Loggable<Envoy::Logger::Id::filter> {
+public:
+  /**
+   * @param profile whether to create a profile attachment and wait only until
+   *        the capture started, rather than for a debugger.
+   */
+  SquashSession(SquashFilterConfigSharedPtr config, SquashWorker &worker,
+                Envoy::Upstream::ClusterManager &cm,
+                SquashSessionCallbacks &callbacks, bool profile = false);
+  ~SquashSession();
+
+  /**
+   * Starts the session.
+   * @param attachment_name the chain attachment the ingress of the call chain
+   *        created for this service, or empty to create one. It is polled on
+   *        the squash cluster the ingress created it on, and left to the
+   *        ingress once the session ends.
+   * @return false if the session already completed inline and the caller
+   *         should not wait for onSessionDone().
+   */
+  bool start(const std::string &attachment_name = "");
+
+  /**
+   * Cancels any outstanding request and timer without invoking callbacks.
+   */
+  void cancel();
+
+  /**
+   * Ends the session now as if the debugger did not attach, e.g. because the
+   * listener drains.
+   */
+  void release();
+
+  bool active() const { return state_ != INITIAL; }
+
+  /**
+   * @return true if the session is done and the debugger attached (or the
+   *         profile started). Tells how a session that completed inline in
+   *         start() ended.
+   */
+  bool attached() const { return attached_; }
+
+  /**
+   * @return the endpoint the debugger attached to (or that is profiled), if
+   *         the squash server reported it.
+   */
+  const std::string &endpoint() const { return endpoint_; }
+
+  // SquashClientCallbacks
+  void onAttachmentCreated(const std::string &attachment_name) override;
+  void onAttachmentState(const std::string &state, const std::string &endpoint,
+                         bool more) override;
+  void onAttachmentWatched() override;
+  void onAttachmentsDeleted(bool) override {}
+
+  // ScheduledRequest
+  void onScheduled() override;
+
+private:
+  enum State {
+    INITIAL,
+    CREATE_CONFIG,
+    CHECK_ATTACHMENT,
+  };
+
+  SquashFilterConfigSharedPtr config_;
+  Envoy::Upstream::ClusterManager &cm_;
+  const bool profile_;
+  // the config's handoff; profile sessions are not handed over.
+  SessionHandoffSharedPtr handoff_;
+  // the chain attachment when resuming one created by the ingress, which
+  // ranks the squash clusters for its requests; empty for the pod's own.
+  // Resumed attachments are never abandoned: the session token names them
+  // and anyone may send one.
+  std::string shard_key_;
+  SquashClientPtr client_;
+  // duplicate of a slow status poll, see hedge_delay.
+  SquashClientPtr hedge_client_;
+  SquashSessionCallbacks &callbacks_;
+  SquashWorker &worker_;
+  SquashEventRing &events_;
+  const uint64_t id_;
+
+  State state_;
+  std::string debugConfigId_;
+  std::string endpoint_;
+  bool attached_;
+  Envoy::Event::TimerPtr delay_timer_;
+  Envoy::Event::TimerPtr attachment_timeout_timer_;
+  Envoy::Event::TimerPtr hedge_timer_;
+  // true while start() is on the stack; suppresses onSessionDone().
+  bool starting_;
+  // the position in the worker's active sessions while registered_.
+  SquashSessionList::iterator registration_;
+  bool registered_;
+  // true while a status poll is outstanding.
+  bool polling_;
+  // the poll and its hedge that have not answered yet.
+  uint32_t polls_in_flight_;
+  std::chrono::steady_clock::time_point poll_started_;
+  // start time plus attachment_timeout; orders the scheduled requests.
+  RequestScheduler::Deadline deadline_;
+  RequestScheduler::Queue::iterator queue_position_;
+  // true while a request waits for a slot.
+  bool queued_;
+  // true while a create or poll request holds a slot.
+  bool holds_slot_;
+
+  SquashClientPtr createClient();
+  void reset();
+  void abandon();
+  void giveUp();
+  void forget();
+  void checkAttachment(const std::string &attachment_name);
+  void schedule();
+  void releaseSlot();
+  void pollForAttachment();
+  void sendPoll();
+  void hedgePoll();
+  void doneSquashing(bool attached);
+  void retry();
+};
+
+typedef std::unique_ptr<SquashSession> SquashSessionPtr;
+
+} // namespace Squash
+} // namespace Solo
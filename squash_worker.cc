@@ -0,0 +1,224 @@
+#include <algorithm>
+#include <string>
+
+#include "squash_worker.h"
+
+namespace Solo {
+namespace Squash {
+
+SquashWorker::SquashWorker(Envoy::Event::Dispatcher &dispatcher,
+                           Envoy::Upstream::ClusterManager &cm,
+                           Envoy::Network::DrainDecision &drain_decision,
+                           Envoy::MonotonicTimeSource &time_source,
+                           const SquashFilterStats &stats,
+                           AttachmentReaperPtr &&reaper,
+                           ProfileTriggerPtr &&profiler,
+                           SessionHandoffSharedPtr handoff,
+                           uint32_t max_concurrent_requests)
+    : dispatcher_(dispatcher), cm_(cm), drain_decision_(drain_decision),
+      time_source_(time_source), stats_(stats), spool_io_(dispatcher), replay_sessions_(), sessions_(),
+      scheduler_(max_concurrent_requests), chain_creations_(),
+      drain_timer_(nullptr),
+      filter_pool_(new FilterPool()),
+      events_(SquashEventLog::createRing()),
+      reaper_(std::move(reaper)), profiler_(std::move(profiler)),
+      handoff_(handoff), handoff_timer_(nullptr),
+      hedge_window_start_(time_source.currentTime()), polls_(0),
+      hedges_(0), previous_polls_(0), previous_hedges_(0), poll_latencies_(),
+      next_poll_latency_(0), sorted_poll_latencies_(), cached_percentile_(0),
+      cached_poll_latency_(0), poll_latencies_since_cached_(0) {
+  if (handoff_) {
+    handoff_timer_ =
+        dispatcher_.createTimer([this]() -> void { expireHandoff(); });
+    handoff_timer_->enableTimer(HANDOFF_EXPIRE_INTERVAL);
+  }
+}
+
+const std::chrono::milliseconds SquashWorker::DRAIN_CHECK_INTERVAL(1000);
+const std::chrono::milliseconds SquashWorker::HANDOFF_EXPIRE_INTERVAL(10000);
+const std::chrono::milliseconds SquashWorker::HEDGE_BUDGET_WINDOW(10000);
+
+SquashWorker::~SquashWorker() {
+  for (ReplaySessionPtr &session : replay_sessions_) {
+    session->cancel();
+  }
+  for (ChainCreationPtr &creation : chain_creations_) {
+    creation->cancel();
+  }
+  if (drain_timer_) {
+    drain_timer_->disableTimer();
+  }
+  if (handoff_timer_) {
+    handoff_timer_->disableTimer();
+  }
+  filter_pool_->orphan();
+  SquashEventLog::removeRing(events_);
+}
+
+void SquashWorker::capture(SquashFilterConfigSharedPtr config,
+                           const std::string &spool_path,
+                           CapturedRequestPtr &&request) {
+  spool_io_.write(spool_path, std::move(request),
+                  [this, config, spool_path](bool written) -> void {
+                    if (!written) {
+                      ENVOY_LOG(warn, "Squash: can't write {} - not replaying",
+                                spool_path);
+                      spool_io_.remove(spool_path);
+                      return;
+                    }
+                    replay(config, spool_path);
+                  });
+}
+
+void SquashWorker::replay(SquashFilterConfigSharedPtr config,
+                          const std::string &spool_path) {
+  ReplaySessionPtr session(new ReplaySession(config, *this, spool_path));
+  session->moveIntoList(std::move(session), replay_sessions_);
+  replay_sessions_.front()->start();
+}
+
+void SquashWorker::onReplayDone(ReplaySession &session) {
+  dispatcher_.deferredDelete(session.removeFromList(replay_sessions_));
+}
+
+void SquashWorker::adoptChainCreation(ChainCreationPtr &&creation) {
+  creation->orphan();
+  creation->moveIntoList(std::move(creation), chain_creations_);
+}
+
+void SquashWorker::onChainCreationDone(ChainCreation &creation) {
+  dispatcher_.deferredDelete(creation.removeFromList(chain_creations_));
+}
+
+void SquashWorker::abandonAttachment(const std::string &attachment_name,
+                                     const std::string &shard_key) {
+  if (reaper_) {
+    reaper_->abandon(attachment_name, shard_key);
+  }
+}
+
+void SquashWorker::triggerProfile() {
+  if (profiler_) {
+    profiler_->trigger(scheduler_);
+  }
+}
+
+SquashSessionList::iterator SquashWorker::addSession(SquashSession &session) {
+  sessions_.push_front(&session);
+  if (sessions_.size() == 1) {
+    if (!drain_timer_) {
+      drain_timer_ = dispatcher_.createTimer([this]() -> void { checkDrain(); });
+    }
+    drain_timer_->enableTimer(DRAIN_CHECK_INTERVAL);
+  }
+  return sessions_.begin();
+}
+
+void SquashWorker::removeSession(SquashSessionList::iterator session) {
+  sessions_.erase(session);
+  if (sessions_.empty() && drain_timer_) {
+    drain_timer_->disableTimer();
+  }
+}
+
+size_t SquashWorker::releaseSessions() {
+  size_t released = 0;
+  // a released session removes itself from the list.
+  while (!sessions_.empty()) {
+    sessions_.front()->release();
+    released++;
+  }
+  if (released > 0) {
+    ENVOY_LOG(info, "Squash: released {} paused streams", released);
+    stats_.released_streams_.add(released);
+  }
+  return released;
+}
+
+void SquashWorker::checkDrain() {
+  if (sessions_.empty()) {
+    return;
+  }
+  if (drain_decision_.drainClose()) {
+    releaseSessions();
+    return;
+  }
+  drain_timer_->enableTimer(DRAIN_CHECK_INTERVAL);
+}
+
+void SquashWorker::expireHandoff() {
+  // inherited or kept, and nobody resumed them in time.
+  for (const std::string &attachment_name : handoff_->expire()) {
+    abandonAttachment(attachment_name);
+  }
+  handoff_timer_->enableTimer(HANDOFF_EXPIRE_INTERVAL);
+}
+
+void SquashWorker::recordPoll() {
+  rollHedgeWindow();
+  polls_++;
+}
+
+void SquashWorker::recordPollLatency(std::chrono::milliseconds latency) {
+  if (poll_latencies_.size() < POLL_LATENCY_SAMPLES) {
+    poll_latencies_.push_back(latency);
+  } else {
+    poll_latencies_[next_poll_latency_] = latency;
+    next_poll_latency_ = (next_poll_latency_ + 1) % POLL_LATENCY_SAMPLES;
+  }
+  poll_latencies_since_cached_++;
+}
+
+std::chrono::milliseconds
+SquashWorker::pollLatencyPercentile(uint32_t percentile,
+                                    std::chrono::milliseconds floor) {
+  if (poll_latencies_.empty()) {
+    return floor;
+  }
+
+  // every poll asks; sort only once enough new samples came in.
+  if (percentile != cached_percentile_ ||
+      poll_latencies_since_cached_ >= POLL_LATENCY_REFRESH ||
+      poll_latencies_since_cached_ >= poll_latencies_.size()) {
+    sorted_poll_latencies_.assign(poll_latencies_.begin(),
+                                  poll_latencies_.end());
+    size_t index =
+        std::min(sorted_poll_latencies_.size() - 1,
+                 sorted_poll_latencies_.size() * std::min(percentile, 100U) /
+                     100);
+    std::nth_element(sorted_poll_latencies_.begin(),
+                     sorted_poll_latencies_.begin() + index,
+                     sorted_poll_latencies_.end());
+    cached_percentile_ = percentile;
+    cached_poll_latency_ = sorted_poll_latencies_[index];
+    poll_latencies_since_cached_ = 0;
+  }
+  return std::max(floor, cached_poll_latency_);
+}
+
+bool SquashWorker::tryHedge(uint32_t budget_percent) {
+  rollHedgeWindow();
+  if ((previous_hedges_ + hedges_ + 1) * 100 >
+      (previous_polls_ + polls_) * budget_percent) {
+    return false;
+  }
+  hedges_++;
+  return true;
+}
+
+void SquashWorker::rollHedgeWindow() {
+  std::chrono::steady_clock::time_point now = time_source_.currentTime();
+  if (now - hedge_window_start_ < HEDGE_BUDGET_WINDOW) {
+    return;
+  }
+  // a burst of slow polls can spend only what the recent polls earned.
+  bool idle = now - hedge_window_start_ >= 2 * HEDGE_BUDGET_WINDOW;
+  previous_polls_ = idle ? 0 : polls_;
+  previous_hedges_ = idle ? 0 : hedges_;
+  polls_ = 0;
+  hedges_ = 0;
+  hedge_window_start_ = now;
+}
+
+} // namespace Squash
+} // namespace Solo
@@ -0,0 +1,198 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <list>
+#include <string>
+#include <vector>
+
+#include "envoy/common/time.h"
+#include "envoy/event/dispatcher.h"
+#include "envoy/event/timer.h"
+#include "envoy/network/drain_decision.h"
+#include "envoy/thread_local/thread_local.h"
+#include "envoy/upstream/cluster_manager.h"
+
+#include "common/common/logger.h"
+
+#include "squash_chain.h"
+#include "squash_event_log.h"
+#include "squash_filter_config.h"
+#include "squash_filter_pool.h"
+#include "squash_profiler.h"
+#include "squash_reaper.h"
+#include "squash_replay.h"
+#include "squash_scheduler.h"
+#include "squash_session.h"
+
+namespace Solo {
+namespace Squash {
+
+/**
+ * Per worker squash state. Owns the debug sessions that outlive the stream
+ * that triggered them and tracks every active session, so that they can all
+ * be released at once when the listener drains.
+ */
+class SquashWorker
+    : public Envoy::ThreadLocal::ThreadLocalObject,
+      protected Envoy::Logger::Loggable<Envoy::Logger::Id::filter> {
+public:
+  /**
+   * @param time_source times polls, hedge budget windows and session
+   *        deadlines.
+   * @param reaper deletes abandoned attachments, or null if they are left to
+   *        the squash server.
+   * @param profiler creates profile attachments for requests that are not
+   *        paused, or null if profiling is off.
+   * @param handoff whose expired attachments the worker abandons, or null.
+   * @param max_concurrent_requests caps the create and poll requests in
+   *        flight, 0 for no cap.
+   */
+  SquashWorker(Envoy::Event::Dispatcher &dispatcher,
+               Envoy::Upstream::ClusterManager &cm,
+               Envoy::Network::DrainDecision &drain_decision,
+               Envoy::MonotonicTimeSource &time_source,
+               const SquashFilterStats &stats, AttachmentReaperPtr &&reaper,
+               ProfileTriggerPtr &&profiler, SessionHandoffSharedPtr handoff,
+               uint32_t max_concurrent_requests);
+  ~SquashWorker();
+
+  Envoy::Event::Dispatcher &dispatcher() { return dispatcher_; }
+  Envoy::Upstream::ClusterManager &clusterManager() { return cm_; }
+  Envoy::MonotonicTimeSource &timeSource() { return time_source_; }
+  SquashEventRing &events() { return *events_; }
+  FilterPool &filterPool() { return *filter_pool_; }
+  RequestScheduler &scheduler() { return scheduler_; }
+  SpoolIo &spoolIo() { return spool_io_; }
+
+  /**
+   * Writes a captured request to spool_path in the background, then starts a
+   * debug session for it and replays the request once the session is done.
+   */
+  void capture(SquashFilterConfigSharedPtr config, const std::string &spool_path,
+               CapturedRequestPtr &&request);
+
+  /**
+   * Starts a debug session for a request captured to spool_path and replays
+   * the request once the session is done.
+   */
+  void replay(SquashFilterConfigSharedPtr config, const std::string &spool_path);
+
+  /**
+   * Called by a replay session once it is finished.
+   */
+  void onReplayDone(ReplaySession &session);
+
+  /**
+   * Takes over a chain create still in flight after its stream is done with
+   * it, until the squash server answers.
+   */
+  void adoptChainCreation(ChainCreationPtr &&creation);
+
+  /**
+   * Called by an adopted chain create once it is answered.
+   */
+  void onChainCreationDone(ChainCreation &creation);
+
+  /**
+   * Called with an attachment nobody waits for anymore.
+   * @param shard_key the attachment's chain attachment if it was created for
+   *        another service, or empty for the pod's own.
+   */
+  void abandonAttachment(const std::string &attachment_name,
+                         const std::string &shard_key = "");
+
+  /**
+   * Asks the squash server for a profile without waiting for it.
+   */
+  void triggerProfile();
+
+  /**
+   * Tracks an active session until removeSession() is called.
+   */
+  SquashSessionList::iterator addSession(SquashSession &session);
+  void removeSession(SquashSessionList::iterator session);
+
+  /**
+   * Ends every active session without waiting for the debugger; the paused
+   * streams continue.
+   * @return the number of released sessions.
+   */
+  size_t releaseSessions();
+
+  /**
+   * Accounts a status poll sent to the squash server.
+   */
+  void recordPoll();
+
+  /**
+   * Records the latency of an answered status poll.
+   */
+  void recordPollLatency(std::chrono::milliseconds latency);
+
+  /**
+   * @return the percentile of the recently recorded poll latencies, or floor
+   *         if that is larger.
+   */
+  std::chrono::milliseconds pollLatencyPercentile(uint32_t percentile,
+                                                  std::chrono::milliseconds floor);
+
+  /**
+   * Accounts a hedged poll if it keeps hedges within budget_percent of the
+   * polls of the current and the previous HEDGE_BUDGET_WINDOW.
+   * @return whether the poll may be hedged.
+   */
+  bool tryHedge(uint32_t budget_percent);
+
+private:
+  // number of poll latencies kept for pollLatencyPercentile().
+  static const size_t POLL_LATENCY_SAMPLES = 128;
+  // new samples after which pollLatencyPercentile() is computed again.
+  static const size_t POLL_LATENCY_REFRESH = 16;
+  // period over which tryHedge() counts polls and hedges.
+  static const std::chrono::milliseconds HEDGE_BUDGET_WINDOW;
+  // how often the drain decision is checked while sessions are active.
+  static const std::chrono::milliseconds DRAIN_CHECK_INTERVAL;
+  // how often the handoff is checked for attachments nobody took.
+  static const std::chrono::milliseconds HANDOFF_EXPIRE_INTERVAL;
+
+  void checkDrain();
+  void expireHandoff();
+  void rollHedgeWindow();
+
+  Envoy::Event::Dispatcher &dispatcher_;
+  Envoy::Upstream::ClusterManager &cm_;
+  Envoy::Network::DrainDecision &drain_decision_;
+  Envoy::MonotonicTimeSource &time_source_;
+  SquashFilterStats stats_;
+  SpoolIo spool_io_;
+  std::list<ReplaySessionPtr> replay_sessions_;
+  SquashSessionList sessions_;
+  RequestScheduler scheduler_;
+  // adopted; they hold slots of scheduler_.
+  std::list<ChainCreationPtr> chain_creations_;
+  Envoy::Event::TimerPtr drain_timer_;
+  // orphaned on destruction; filters may still hold blocks.
+  FilterPool *filter_pool_;
+  SquashEventRingSharedPtr events_;
+  AttachmentReaperPtr reaper_;
+  ProfileTriggerPtr profiler_;
+  SessionHandoffSharedPtr handoff_;
+  Envoy::Event::TimerPtr handoff_timer_;
+
+  std::chrono::steady_clock::time_point hedge_window_start_;
+  uint64_t polls_;
+  uint64_t hedges_;
+  uint64_t previous_polls_;
+  uint64_t previous_hedges_;
+  std::vector<std::chrono::milliseconds> poll_latencies_;
+  size_t next_poll_latency_;
+  // scratch space for pollLatencyPercentile().
+  std::vector<std::chrono::milliseconds> sorted_poll_latencies_;
+  uint32_t cached_percentile_;
+  std::chrono::milliseconds cached_poll_latency_;
+  size_t poll_latencies_since_cached_;
+};
+
+} // namespace Squash
+} // namespace Solo
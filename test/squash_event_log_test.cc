@@ -0,0 +1,73 @@
+#include <fstream>
+#include <thread>
+
+#include "squash_event_log.h"
+
+#include "test/test_common/environment.h"
+
+#include "gtest/gtest.h"
+
+namespace Solo {
+namespace Squash {
+
+TEST(SquashEventLogTest, RingKeepsLatestEvents) {
+  SquashEventRing ring(0);
+  for (uint64_t i = 0; i < SquashEventRing::SIZE + 10; i++) {
+    ring.record(i, SquashEventType::PollSent);
+  }
+
+  std::vector<SquashEvent> events = ring.snapshot();
+  ASSERT_EQ(SquashEventRing::SIZE, events.size());
+  EXPECT_EQ(10U, events.front().session);
+  EXPECT_EQ(SquashEventRing::SIZE + 9, events.back().session);
+  for (size_t i = 1; i < events.size(); i++) {
+    EXPECT_LE(events[i - 1].time_ns, events[i].time_ns);
+  }
+}
+
+TEST(SquashEventLogTest, SnapshotWhileRecording) {
+  SquashEventRing ring(0);
+  const uint64_t count = 20 * SquashEventRing::SIZE;
+  std::thread worker([&ring, count]() -> void {
+    for (uint64_t i = 1; i <= count; i++) {
+      ring.record(i, SquashEventType::PollSent, static_cast<uint16_t>(i));
+    }
+  });
+
+  // every reported record is one the worker wrote as a whole.
+  for (int i = 0; i < 100; i++) {
+    for (const SquashEvent &event : ring.snapshot()) {
+      EXPECT_EQ(SquashEventType::PollSent, event.type);
+      EXPECT_EQ(static_cast<uint16_t>(event.session), event.value);
+    }
+  }
+  worker.join();
+  EXPECT_EQ(count, ring.snapshot().back().session);
+}
+
+TEST(SquashEventLogTest, DumpsBinaryRecords) {
+  SquashEventRingSharedPtr ring = SquashEventLog::createRing();
+  uint64_t session = ring->nextSessionId();
+  ring->record(session, SquashEventType::SessionStarted);
+  ring->record(session, SquashEventType::Resumed, 1);
+
+  std::string path = Envoy::TestEnvironment::temporaryPath("squash_events");
+  EXPECT_TRUE(SquashEventLog::dump(path));
+  SquashEventLog::removeRing(ring);
+
+  // rings of other tests may still be registered; ours are the latest events.
+  std::ifstream file(path, std::ios::binary | std::ios::ate);
+  ASSERT_LE(2 * sizeof(SquashEvent), static_cast<size_t>(file.tellg()));
+  file.seekg(-2 * static_cast<std::streamoff>(sizeof(SquashEvent)),
+             std::ios::end);
+  SquashEvent events[2];
+  file.read(reinterpret_cast<char *>(events), sizeof(events));
+  ASSERT_TRUE(file.good());
+  EXPECT_EQ(SquashEventType::SessionStarted, events[0].type);
+  EXPECT_EQ(SquashEventType::Resumed, events[1].type);
+  EXPECT_EQ(1, events[1].value);
+  EXPECT_EQ(session, events[1].session);
+}
+
+} // namespace Squash
+} // namespace Solo
@@ -4,6 +4,8 @@
 #include "squash_filter_config.h"
 #include "squash_filter_config_factory.h"
 
+#include "envoy/common/exception.h"
+
 #include "test/mocks/upstream/mocks.h"
 #include "test/test_common/utility.h"
 #include "test/mocks/server/mocks.h"
@@ -43,8 +45,10 @@ TEST(SoloFilterConfigTest, NoCluster) {
 
   EXPECT_CALL(factory_context.cluster_manager_, get("fake_cluster")).WillOnce(Return(nullptr));
 
-  EXPECT_THROW(constructSquashFilterConfigFromJson(*config, factory_context),
-               Envoy::EnvoyException);
+  // the cluster may still arrive through CDS.
+  SquashFilterConfig squash_config =
+      constructSquashFilterConfigFromJson(*config, factory_context);
+  EXPECT_EQ("fake_cluster", squash_config.squash_cluster_name());
 }
 
 TEST(SoloFilterConfigTest, ParsesEnvironment) {
@@ -102,5 +106,54 @@ TEST(SoloFilterConfigTest, ParsesDefaultEnvironment) {
   EXPECT_EQ("pod1", attachment_json_obj->getString("pod"));
   EXPECT_EQ("namespace1", attachment_json_obj->getString("namespace"));
 }
+
+TEST(SoloFilterConfigTest, RejectsBadGrpcChainTemplate) {
+  std::string json = R"EOF(
+    {
+      "squash_cluster" : "squash",
+      "transport" : "grpc",
+      "chain_attachment_template" : "{\"spec\":{\"match_request\":\"{{ SQUASH_SERVICE }}\"}}"
+    }
+    )EOF";
+
+  Envoy::Json::ObjectSharedPtr json_config = Envoy::Json::Factory::loadFromString(json);
+  NiceMock<Envoy::Server::Configuration::MockFactoryContext> factory_context;
+  // at config load, not on the first chained request.
+  EXPECT_THROW(constructSquashFilterConfigFromJson(*json_config, factory_context),
+               Envoy::EnvoyException);
+}
+
+TEST(SoloFilterConfigTest, ShardsAttachmentsOverClusters) {
+  SquashClientFactory factory(solo::squash::pb::SquashConfig::REST,
+                              {"squash0", "squash1", "squash2"},
+                              "{\"pod\":\"pod1\"}", "{\"pod\":\"pod1\"}",
+                              nullptr,
+                              std::chrono::milliseconds(1000),
+                              std::chrono::milliseconds(60000));
+  // the ranking depends on the shard key, not on the configured order.
+  SquashClientFactory reordered(solo::squash::pb::SquashConfig::REST,
+                                {"squash2", "squash0", "squash1"},
+                                "{\"pod\":\"pod1\"}", "{\"pod\":\"pod1\"}",
+                                nullptr,
+                                std::chrono::milliseconds(1000),
+                                std::chrono::milliseconds(60000));
+  ASSERT_EQ(3U, factory.rankedClusters().size());
+  EXPECT_EQ(factory.rankedClusters(), reordered.rankedClusters());
+  // nor on the attachment created: profile attachments of the pod go along.
+  SquashClientFactory profile(solo::squash::pb::SquashConfig::REST,
+                              {"squash0", "squash1", "squash2"},
+                              "{\"pod\":\"pod1\"}",
+                              "{\"pod\":\"pod1\",\"profile\":true}", nullptr,
+                              std::chrono::milliseconds(1000),
+                              std::chrono::milliseconds(60000));
+  EXPECT_EQ(factory.rankedClusters(), profile.rankedClusters());
+
+  NiceMock<Envoy::Upstream::MockClusterManager> cm;
+  EXPECT_EQ(factory.rankedClusters()[0], *factory.cluster(cm));
+
+  // a missing cluster moves its attachments to the next one.
+  EXPECT_CALL(cm, get(factory.rankedClusters()[0])).WillRepeatedly(Return(nullptr));
+  EXPECT_EQ(factory.rankedClusters()[1], *factory.cluster(cm));
+}
 } // namespace Squash
-} // namespace Solo
\ No newline at end of file
+} // namespace Solo
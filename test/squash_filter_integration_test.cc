@@ -7,6 +7,10 @@
 #include "test/integration/autonomous_upstream.h"
 #include "test/integration/http_integration.h"
 
+#include "common/grpc/common.h"
+
+#include "squash.pb.h"
+
 #define ENV_VAR_VALUE "somerandomevalue"
 
 namespace Solo {
@@ -26,19 +30,25 @@ public:
     fake_upstreams_.emplace_back(new Envoy::AutonomousUpstream(
         0, Envoy::FakeHttpConnection::Type::HTTP1, version_));
     registerPort("upstream", fake_upstreams_[0]->localAddress()->ip()->port());
-    fake_upstreams_.emplace_back(new Envoy::FakeUpstream(
-        0, Envoy::FakeHttpConnection::Type::HTTP1, version_));
+    fake_upstreams_.emplace_back(
+        new Envoy::FakeUpstream(0, squashUpstreamType(), version_));
     registerPort("upstream_squash",
                  fake_upstreams_[1]->localAddress()->ip()->port());
     fake_upstreams_.back()->set_allow_unexpected_disconnects(true);
 
     ::setenv("SQUASH_ENV_TEST", ENV_VAR_VALUE, 1);
 
-    createTestServer("test/envoy-test.yaml", {"http"});
+    createTestServer(configPath(), {"http"});
 
     codec_client_ = makeHttpConnection(lookupPort("http"));
   }
 
+  virtual std::string configPath() { return "test/envoy-test.yaml"; }
+
+  virtual Envoy::FakeHttpConnection::Type squashUpstreamType() {
+    return Envoy::FakeHttpConnection::Type::HTTP1;
+  }
+
   /**
    * Destructor for an individual integration test.
    */
@@ -93,10 +103,39 @@ public:
   Envoy::IntegrationCodecClientPtr codec_client_;
 };
 
+/**
+ * Same as above, with the filter talking gRPC to the fake squash upstream.
+ */
+class SquashFilterGrpcIntegrationTest : public SquashFilterIntegrationTest {
+public:
+  std::string configPath() override { return "test/envoy-grpc-test.yaml"; }
+
+  Envoy::FakeHttpConnection::Type squashUpstreamType() override {
+    return Envoy::FakeHttpConnection::Type::HTTP2;
+  }
+
+  void sendGrpcMessage(Envoy::FakeStreamPtr &request_stream,
+                       const Envoy::Protobuf::Message &message,
+                       bool end_stream) {
+    request_stream->encodeHeaders(
+        Envoy::Http::TestHeaderMapImpl{{":status", "200"}}, false);
+    request_stream->encodeData(*Envoy::Grpc::Common::serializeBody(message),
+                               false);
+    if (end_stream) {
+      request_stream->encodeTrailers(
+          Envoy::Http::TestHeaderMapImpl{{"grpc-status", "0"}});
+    }
+  }
+};
+
 INSTANTIATE_TEST_CASE_P(
     IpVersions, SquashFilterIntegrationTest,
     testing::ValuesIn(Envoy::TestEnvironment::getIpVersionsForTest()));
 
+INSTANTIATE_TEST_CASE_P(
+    IpVersions, SquashFilterGrpcIntegrationTest,
+    testing::ValuesIn(Envoy::TestEnvironment::getIpVersionsForTest()));
+
 TEST_P(SquashFilterIntegrationTest, TestHappyPath) {
 
   Envoy::IntegrationStreamDecoderPtr response = sendDebugRequest(codec_client_);
@@ -251,4 +290,56 @@ TEST_P(SquashFilterIntegrationTest, BadGetResponse) {
   fake_squash_connection->waitForDisconnect();
 }
 
+TEST_P(SquashFilterGrpcIntegrationTest, TestHappyPath) {
+
+  Envoy::IntegrationStreamDecoderPtr response = sendDebugRequest(codec_client_);
+
+  Envoy::FakeHttpConnectionPtr fake_squash_connection =
+      fake_upstreams_[1]->waitForHttpConnection(*dispatcher_);
+
+  // respond to create request
+  Envoy::FakeStreamPtr create_stream =
+      fake_squash_connection->waitForNewStream(*dispatcher_);
+  solo::squash::pb::DebugAttachment create_request;
+  create_stream->waitForGrpcMessage(*dispatcher_, create_request);
+  create_stream->waitForEndStream(*dispatcher_);
+
+  solo::squash::pb::DebugAttachment created;
+  created.mutable_metadata()->set_name("oF8iVdiJs5");
+  created.mutable_status()->set_state("none");
+  sendGrpcMessage(create_stream, created, true);
+
+  // stream the attachment state on the watch request
+  Envoy::FakeStreamPtr watch_stream =
+      fake_squash_connection->waitForNewStream(*dispatcher_);
+  solo::squash::pb::GetAttachmentRequest watch_request;
+  watch_stream->waitForGrpcMessage(*dispatcher_, watch_request);
+
+  solo::squash::pb::DebugAttachment attached(created);
+  attached.mutable_status()->set_state("attached");
+  sendGrpcMessage(watch_stream, attached, false);
+
+  response->waitForEndStream();
+
+  EXPECT_STREQ("/solo.squash.pb.SquashServer.CreateAttachment",
+               create_stream->headers().Path()->value().c_str());
+  // make sure the env var was replaced
+  EXPECT_EQ(ENV_VAR_VALUE, create_request.spec()
+                               .attachment()
+                               .fields()
+                               .at("env")
+                               .string_value());
+
+  EXPECT_STREQ("/solo.squash.pb.SquashServer.WatchAttachment",
+               watch_stream->headers().Path()->value().c_str());
+  EXPECT_EQ("oF8iVdiJs5", watch_request.name());
+  // the watch is bounded by attachment_timeout.
+  EXPECT_STREQ("100m", watch_stream->headers().GrpcTimeout()->value().c_str());
+  EXPECT_STREQ("200", response->headers().Status()->value().c_str());
+
+  codec_client_->close();
+  fake_squash_connection->close();
+  fake_squash_connection->waitForDisconnect();
+}
+
 } // namespace Solo
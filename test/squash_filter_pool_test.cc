@@ -0,0 +1,43 @@
+#include <memory>
+#include <string>
+
+#include "squash_filter_pool.h"
+
+#include "gtest/gtest.h"
+
+namespace Solo {
+namespace Squash {
+
+TEST(FilterPoolTest, ReusesFreedBlocks) {
+  FilterPool *pool = new FilterPool();
+  FilterPoolAllocator<std::string> allocator(*pool);
+
+  std::shared_ptr<std::string> first =
+      std::allocate_shared<std::string>(allocator, "first");
+  const void *block = first.get();
+  first.reset();
+  EXPECT_EQ(0U, pool->outstanding());
+  EXPECT_EQ(1U, pool->freeBlocks());
+
+  std::shared_ptr<std::string> second =
+      std::allocate_shared<std::string>(allocator, "second");
+  EXPECT_EQ(block, second.get());
+  EXPECT_EQ(1U, pool->outstanding());
+  EXPECT_EQ(0U, pool->freeBlocks());
+
+  pool->orphan();
+}
+
+TEST(FilterPoolTest, OrphanedPoolOutlivesItsBlocks) {
+  FilterPool *pool = new FilterPool();
+  std::shared_ptr<std::string> filter = std::allocate_shared<std::string>(
+      FilterPoolAllocator<std::string>(*pool), "filter");
+
+  // the worker goes away first; the pool is freed with the last block.
+  pool->orphan();
+  EXPECT_EQ("filter", *filter);
+  filter.reset();
+}
+
+} // namespace Squash
+} // namespace Solo
@@ -0,0 +1,241 @@
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <ctime>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <vector>
+
+#include "squash_filter.h"
+#include "squash_filter_config.h"
+
+#include "common/memory/stats.h"
+
+#include "test/mocks/http/mocks.h"
+#include "test/mocks/server/mocks.h"
+#include "test/mocks/upstream/mocks.h"
+#include "test/squash_server_sim.h"
+#include "test/test_common/utility.h"
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+using testing::Invoke;
+using testing::NiceMock;
+using testing::_;
+
+namespace Solo {
+namespace Squash {
+
+/**
+ * Adds what the simulation allocates while in scope to sim_bytes, so that it
+ * can be told apart from what the filters and sessions allocate.
+ */
+class SimAllocationScope {
+public:
+  SimAllocationScope(int64_t &sim_bytes)
+      : sim_bytes_(sim_bytes),
+        start_(Envoy::Memory::Stats::totalCurrentlyAllocated()) {}
+  ~SimAllocationScope() {
+    sim_bytes_ += static_cast<int64_t>(
+                      Envoy::Memory::Stats::totalCurrentlyAllocated()) -
+                  static_cast<int64_t>(start_);
+  }
+
+private:
+  int64_t &sim_bytes_;
+  const uint64_t start_;
+};
+
+class AccountedSimTimer : public SimTimer {
+public:
+  AccountedSimTimer(SimClock &clock, Envoy::Event::TimerCb cb,
+                    int64_t &sim_bytes)
+      : SimTimer(clock, cb), sim_bytes_(sim_bytes) {}
+
+  // Event::Timer
+  void enableTimer(const std::chrono::milliseconds &delay) override {
+    SimAllocationScope scope(sim_bytes_);
+    SimTimer::enableTimer(delay);
+  }
+
+private:
+  int64_t &sim_bytes_;
+};
+
+/**
+ * The doubles below answer what the filter calls per stream and per request
+ * themselves rather than through gmock, which would otherwise dominate the
+ * cpu measured.
+ */
+class SimDispatcher : public NiceMock<Envoy::Event::MockDispatcher> {
+public:
+  SimDispatcher(SimClock &clock, int64_t &sim_bytes)
+      : clock_(clock), sim_bytes_(sim_bytes) {}
+
+  // Event::Dispatcher
+  Envoy::Event::TimerPtr createTimer(Envoy::Event::TimerCb cb) override {
+    SimAllocationScope scope(sim_bytes_);
+    return Envoy::Event::TimerPtr{
+        new AccountedSimTimer(clock_, cb, sim_bytes_)};
+  }
+
+private:
+  SimClock &clock_;
+  int64_t &sim_bytes_;
+};
+
+class SimFilterCallbacks
+    : public NiceMock<Envoy::Http::MockStreamDecoderFilterCallbacks> {
+public:
+  SimFilterCallbacks(SimDispatcher &dispatcher,
+                     std::function<void()> on_continue)
+      : sim_dispatcher_(dispatcher), on_continue_(on_continue) {}
+
+  // Http::StreamDecoderFilterCallbacks
+  Envoy::Event::Dispatcher &dispatcher() override { return sim_dispatcher_; }
+  void continueDecoding() override { on_continue_(); }
+
+private:
+  SimDispatcher &sim_dispatcher_;
+  std::function<void()> on_continue_;
+};
+
+class SimAsyncClient : public NiceMock<Envoy::Http::MockAsyncClient> {
+public:
+  SimAsyncClient(std::unique_ptr<SimSquashServer> &server, int64_t &sim_bytes)
+      : server_(server), sim_bytes_(sim_bytes) {}
+
+  // Http::AsyncClient
+  Envoy::Http::AsyncClient::Request *
+  send(Envoy::Http::MessagePtr &&request,
+       Envoy::Http::AsyncClient::Callbacks &callbacks,
+       const Envoy::Optional<std::chrono::milliseconds> &) override {
+    SimAllocationScope scope(sim_bytes_);
+    return server_->send(request, callbacks);
+  }
+
+private:
+  std::unique_ptr<SimSquashServer> &server_;
+  int64_t &sim_bytes_;
+};
+
+class SimClusterManager : public NiceMock<Envoy::Upstream::MockClusterManager> {
+public:
+  SimClusterManager(SimAsyncClient &client) : client_(client) {}
+
+  // Upstream::ClusterManager
+  Envoy::Upstream::ThreadLocalCluster *get(const std::string &) override {
+    return &thread_local_cluster_;
+  }
+  Envoy::Http::AsyncClient &
+  httpAsyncClientForCluster(const std::string &) override {
+    return client_;
+  }
+
+private:
+  SimAsyncClient &client_;
+};
+
+/**
+ * Benchmark of many paused streams against the simulated squash server. Not
+ * run in CI (tagged manual); run it with
+ *   bazel test //test:squash_filter_scale_benchmark --test_output=streamed
+ * and SQUASH_SCALE_STREAMS in --test_env to change the number of streams.
+ */
+class SquashFilterScaleBenchmark : public testing::Test {
+protected:
+  SquashFilterScaleBenchmark()
+      : dispatcher_(clock_, sim_bytes_), client_(server_, sim_bytes_),
+        cm_(client_),
+        filter_callbacks_(dispatcher_, [this]() -> void { continued_++; }) {}
+
+  void SetUp() override {
+    const char *streams = std::getenv("SQUASH_SCALE_STREAMS");
+    streams_ = streams != nullptr ? std::strtoul(streams, nullptr, 10) : 10000;
+
+    ON_CALL(factory_context_.thread_local_.dispatcher_, createTimer_(_))
+        .WillByDefault(Invoke([this](Envoy::Event::TimerCb cb)
+                                  -> Envoy::Event::Timer * {
+          return new SimTimer(clock_, cb);
+        }));
+  }
+
+  uint64_t streams_;
+  uint64_t continued_{0};
+  int64_t sim_bytes_{0};
+  SimClock clock_;
+  std::unique_ptr<SimSquashServer> server_;
+  SimDispatcher dispatcher_;
+  SimAsyncClient client_;
+  SimClusterManager cm_;
+  SimFilterCallbacks filter_callbacks_;
+  NiceMock<Envoy::Server::Configuration::MockFactoryContext> factory_context_;
+};
+
+TEST_F(SquashFilterScaleBenchmark, PausedStreams) {
+  solo::squash::pb::SquashConfig p;
+  p.set_squash_cluster("squash");
+  p.mutable_attachment_timeout()->set_seconds(10);
+  SquashFilterConfigOwner owner(p, factory_context_, clock_);
+  SquashFilterConfigSharedPtr config = owner.config();
+
+  SimSquashServer::Options options;
+  options.never_attach_rate = 0.25;
+  server_.reset(new SimSquashServer(clock_, options));
+
+  Envoy::Http::TestHeaderMapImpl headers{{":method", "GET"},
+                                         {":authority", "www.solo.io"},
+                                         {"x-squash-debug", "true"},
+                                         {":path", "/getsomething"}};
+
+  std::vector<std::unique_ptr<SquashFilter>> filters;
+  filters.reserve(streams_);
+  std::clock_t cpu_start = std::clock();
+  uint64_t memory_start = Envoy::Memory::Stats::totalCurrentlyAllocated();
+
+  for (uint64_t i = 0; i < streams_; i++) {
+    filters.emplace_back(new SquashFilter(config, cm_));
+    filters.back()->setDecoderFilterCallbacks(filter_callbacks_);
+    ASSERT_EQ(Envoy::Http::FilterHeadersStatus::StopIteration,
+              filters.back()->decodeHeaders(headers, true));
+  }
+  // every stream is paused with its create in flight; the clock has not
+  // moved, so nothing the simulation allocated was freed yet.
+  int64_t memory_paused =
+      static_cast<int64_t>(Envoy::Memory::Stats::totalCurrentlyAllocated()) -
+      static_cast<int64_t>(memory_start) - sim_bytes_;
+
+  // attach_time passes, then attachment_timeout.
+  uint64_t transitions = clock_.advanceTo(std::chrono::milliseconds(30000));
+  for (std::unique_ptr<SquashFilter> &filter : filters) {
+    filter->onDestroy();
+  }
+  filters.clear();
+  std::clock_t cpu_end = std::clock();
+
+  const SimSquashServer::Counts &counts = server_->counts();
+  EXPECT_EQ(streams_, continued_);
+
+  std::cout << "squash scale: " << streams_ << " streams, " << transitions
+            << " state transitions" << std::endl;
+  if (memory_start > 0) {
+    std::cout << "  memory per paused stream: "
+              << memory_paused / static_cast<int64_t>(streams_)
+              << " bytes (filter and session only)" << std::endl;
+  } else {
+    std::cout << "  memory per paused stream: n/a (no tcmalloc)" << std::endl;
+  }
+  // includes the simulated server answering, which is cheap next to the
+  // filter.
+  std::cout << "  cpu per transition: "
+            << 1e9 * (cpu_end - cpu_start) / CLOCKS_PER_SEC / transitions
+            << " ns" << std::endl;
+  std::cout << "  requests: " << counts.creates << " create, " << counts.polls
+            << " poll, " << counts.deletes << " delete, " << counts.cancels
+            << " cancelled" << std::endl;
+}
+
+} // namespace Squash
+} // namespace Solo
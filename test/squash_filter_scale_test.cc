@@ -0,0 +1,179 @@
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <vector>
+
+#include "squash_filter.h"
+#include "squash_filter_config.h"
+
+#include "test/mocks/upstream/mocks.h"
+#include "test/mocks/server/mocks.h"
+#include "test/squash_server_sim.h"
+#include "test/test_common/utility.h"
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+using testing::Invoke;
+using testing::NiceMock;
+using testing::ReturnRef;
+using testing::_;
+
+namespace Solo {
+namespace Squash {
+
+class SquashFilterScaleTest : public testing::Test {
+protected:
+  void SetUp() override {
+    auto create_timer = [this](Envoy::Event::TimerCb cb) -> Envoy::Event::Timer * {
+      return new SimTimer(clock_, cb);
+    };
+    ON_CALL(filter_callbacks_.dispatcher_, createTimer_(_))
+        .WillByDefault(Invoke(create_timer));
+    ON_CALL(factory_context_.thread_local_.dispatcher_, createTimer_(_))
+        .WillByDefault(Invoke(create_timer));
+    ON_CALL(filter_callbacks_, continueDecoding())
+        .WillByDefault(Invoke([this]() -> void {
+          continued_++;
+          continue_times_.push_back(clock_.now());
+        }));
+
+    ON_CALL(cm_, httpAsyncClientForCluster("squash"))
+        .WillByDefault(ReturnRef(cm_.async_client_));
+    ON_CALL(cm_.async_client_, send_(_, _, _))
+        .WillByDefault(Invoke([this](Envoy::Http::MessagePtr &message,
+                                     Envoy::Http::AsyncClient::Callbacks &cb,
+                                     const Envoy::Optional<std::chrono::milliseconds> &)
+                                     -> Envoy::Http::AsyncClient::Request * {
+          return server_->send(message, cb);
+        }));
+  }
+
+  /**
+   * @return the time by which percentile of the streams continued.
+   */
+  std::chrono::milliseconds continuedBy(uint32_t percentile) {
+    std::vector<std::chrono::milliseconds> sorted(continue_times_);
+    std::sort(sorted.begin(), sorted.end());
+    return sorted[std::min(sorted.size() - 1, sorted.size() * percentile / 100)];
+  }
+
+  // enough for the scheduler and worker state to matter; see
+  // squash_filter_scale_benchmark for numbers.
+  const uint64_t streams_{1000};
+  uint64_t continued_{0};
+  std::vector<std::chrono::milliseconds> continue_times_;
+  SimClock clock_;
+  std::unique_ptr<SimSquashServer> server_;
+  NiceMock<Envoy::Http::MockStreamDecoderFilterCallbacks> filter_callbacks_;
+  NiceMock<Envoy::Server::Configuration::MockFactoryContext> factory_context_;
+  NiceMock<Envoy::Upstream::MockClusterManager> cm_;
+};
+
+TEST_F(SquashFilterScaleTest, PausedStreams) {
+  solo::squash::pb::SquashConfig p;
+  p.set_squash_cluster("squash");
+  p.mutable_attachment_timeout()->set_seconds(10);
+  SquashFilterConfigOwner owner(p, factory_context_, clock_);
+  SquashFilterConfigSharedPtr config = owner.config();
+
+  SimSquashServer::Options options;
+  options.never_attach_rate = 0.25;
+  server_.reset(new SimSquashServer(clock_, options));
+
+  Envoy::Http::TestHeaderMapImpl headers{{":method", "GET"},
+                                         {":authority", "www.solo.io"},
+                                         {"x-squash-debug", "true"},
+                                         {":path", "/getsomething"}};
+
+  std::vector<std::unique_ptr<SquashFilter>> filters;
+  filters.reserve(streams_);
+  for (uint64_t i = 0; i < streams_; i++) {
+    filters.emplace_back(new SquashFilter(config, cm_));
+    filters.back()->setDecoderFilterCallbacks(filter_callbacks_);
+    ASSERT_EQ(Envoy::Http::FilterHeadersStatus::StopIteration,
+              filters.back()->decodeHeaders(headers, true));
+  }
+
+  // every stream is created and waits for its next poll.
+  clock_.advanceTo(std::chrono::milliseconds(500));
+  EXPECT_EQ(0U, continued_);
+
+  // attach_time passes, then attachment_timeout.
+  clock_.advanceTo(std::chrono::milliseconds(30000));
+  for (std::unique_ptr<SquashFilter> &filter : filters) {
+    filter->onDestroy();
+  }
+  filters.clear();
+
+  const SimSquashServer::Counts &counts = server_->counts();
+  EXPECT_EQ(streams_, continued_);
+  EXPECT_EQ(streams_, counts.creates);
+  EXPECT_EQ(streams_ - counts.never_attaching, counts.attached);
+  // a poll per attachment_poll_every, bounded by the attachment timeout.
+  EXPECT_LE(counts.polls, streams_ * (10 + 1));
+  EXPECT_GE(counts.polls, streams_ * 3);
+}
+
+TEST_F(SquashFilterScaleTest, HedgesAroundSlowReplica) {
+  solo::squash::pb::SquashConfig p;
+  p.set_squash_cluster("squash");
+  p.mutable_attachment_timeout()->set_seconds(30);
+  p.mutable_hedge_delay()->set_nanos(100 * 1000 * 1000);
+  // a poll is hedged once it took longer than most; a quarter of them, and
+  // their hedges, land on the slow replica.
+  p.set_hedge_percentile(50);
+  p.mutable_hedge_budget_percent()->set_value(50);
+  SquashFilterConfigOwner owner(p, factory_context_, clock_);
+  SquashFilterConfigSharedPtr config = owner.config();
+
+  // one of four squash server replicas takes two seconds per answer.
+  SimSquashServer::Options options;
+  options.attach_time =
+      SimDistribution::logNormal(std::chrono::milliseconds(2000), 0.5);
+  options.replicas = 4;
+  options.slow_replicas = 1;
+  options.slow_latency = std::chrono::milliseconds(2000);
+  server_.reset(new SimSquashServer(clock_, options));
+
+  Envoy::Http::TestHeaderMapImpl headers{{":method", "GET"},
+                                         {":authority", "www.solo.io"},
+                                         {"x-squash-debug", "true"},
+                                         {":path", "/getsomething"}};
+
+  std::vector<std::unique_ptr<SquashFilter>> filters;
+  filters.reserve(streams_);
+  for (uint64_t i = 0; i < streams_; i++) {
+    filters.emplace_back(new SquashFilter(config, cm_));
+    filters.back()->setDecoderFilterCallbacks(filter_callbacks_);
+    ASSERT_EQ(Envoy::Http::FilterHeadersStatus::StopIteration,
+              filters.back()->decodeHeaders(headers, true));
+  }
+  clock_.advanceTo(std::chrono::milliseconds(60000));
+  for (std::unique_ptr<SquashFilter> &filter : filters) {
+    filter->onDestroy();
+  }
+  filters.clear();
+
+  // every attachment attaches well within the timeout; a poll and its hedge
+  // may both see it attached.
+  const SimSquashServer::Counts &counts = server_->counts();
+  EXPECT_EQ(streams_, continued_);
+  EXPECT_LE(streams_, counts.attached);
+
+  // the polls that land on the slow replica are hedged, within the budget of
+  // half the polls; a hedge that answers first cancels its poll.
+  EXPECT_LT(streams_ / 10, counts.hedged_polls);
+  EXPECT_LE(counts.hedged_polls * 100,
+            (counts.polls - counts.hedged_polls) * 50);
+  EXPECT_LT(0U, counts.cancels);
+
+  // half attach within the median attach time and are seen by the poll
+  // after. The slowest wait for the tail of the attach time and a slow
+  // create, which is not hedged, but not for slow polls on top.
+  EXPECT_GE(std::chrono::milliseconds(3500), continuedBy(50));
+  EXPECT_GE(std::chrono::milliseconds(9500), continuedBy(99));
+}
+
+} // namespace Squash
+} // namespace Solo
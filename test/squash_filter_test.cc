@@ -1,11 +1,23 @@
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
 
 #include "squash_filter.h"
 #include "squash_filter_config.h"
 
+#include "common/http/message_impl.h"
+
 #include "test/mocks/upstream/mocks.h"
 #include "test/mocks/server/mocks.h"
+#include "test/test_common/environment.h"
 #include "test/test_common/utility.h"
 
 #include "gmock/gmock.h"
@@ -13,6 +25,8 @@
 
 using testing::Invoke;
 using testing::NiceMock;
+using testing::Return;
+using testing::ReturnRef;
 using testing::_;
 
 namespace Solo {
@@ -20,24 +34,102 @@ namespace Squash {
 
 class SquashFilterTest : public testing::Test {
 public:
-  SquashFilterTest() {
+  SquashFilterTest() : squash_request_(&cm_.async_client_) {
   }
 
 protected:
   void SetUp() override {
   }
 
+  /**
+   * @return an answer of the squash server.
+   */
+  static Envoy::Http::MessagePtr squashResponse(const std::string &status,
+                                                const std::string &body = "") {
+    Envoy::Http::MessagePtr response(new Envoy::Http::ResponseMessageImpl(
+        Envoy::Http::HeaderMapPtr{
+            new Envoy::Http::TestHeaderMapImpl{{":status", status}}}));
+    if (!body.empty()) {
+      response->body().reset(new Envoy::Buffer::OwnedImpl(body));
+    }
+    return response;
+  }
+
+  /**
+   * Expects the next request, in the order of all expected squash requests,
+   * to be a method request through client and answers it inline.
+   */
+  void expectSquashResponse(Envoy::Http::MockAsyncClient &client,
+                            const std::string &method,
+                            const std::string &status,
+                            const std::string &body = "") {
+    EXPECT_CALL(client, send_(_, _, _))
+        .InSequence(squash_requests_)
+        .WillOnce(Invoke([this, method, status, body](
+                             Envoy::Http::MessagePtr &message,
+                             Envoy::Http::AsyncClient::Callbacks &cb,
+                             const Envoy::Optional<std::chrono::milliseconds> &)
+                             -> Envoy::Http::AsyncClient::Request * {
+          record(method, message, cb);
+          cb.onSuccess(squashResponse(status, body));
+          return nullptr;
+        }));
+  }
+
+  void expectSquashResponse(const std::string &method,
+                            const std::string &status,
+                            const std::string &body = "") {
+    expectSquashResponse(cm_.async_client_, method, status, body);
+  }
+
+  /**
+   * Like expectSquashResponse(), but leaves the request in flight as
+   * squash_request_; it is answered through squash_callbacks_.
+   */
+  void expectSquashRequest(Envoy::Http::MockAsyncClient &client,
+                           const std::string &method) {
+    EXPECT_CALL(client, send_(_, _, _))
+        .InSequence(squash_requests_)
+        .WillOnce(Invoke([this, method](
+                             Envoy::Http::MessagePtr &message,
+                             Envoy::Http::AsyncClient::Callbacks &cb,
+                             const Envoy::Optional<std::chrono::milliseconds> &)
+                             -> Envoy::Http::AsyncClient::Request * {
+          record(method, message, cb);
+          return &squash_request_;
+        }));
+  }
+
+  void expectSquashRequest(const std::string &method) {
+    expectSquashRequest(cm_.async_client_, method);
+  }
+
   NiceMock<Envoy::Http::MockStreamDecoderFilterCallbacks> filter_callbacks_;
   NiceMock<Envoy::Server::Configuration::MockFactoryContext> factory_context_;
   NiceMock<Envoy::Event::MockTimer>* attachment_timeout_timer_{};
-  NiceMock<Envoy::Upstream::MockClusterManager> cm_;  
+  NiceMock<Envoy::Upstream::MockClusterManager> cm_;
+  Envoy::Http::MockAsyncClientRequest squash_request_;
+  // every request sent to the squash server, in order.
+  std::vector<Envoy::Http::MessagePtr> squash_messages_;
+  std::vector<Envoy::Http::AsyncClient::Callbacks *> squash_callbacks_;
+
+private:
+  void record(const std::string &method, Envoy::Http::MessagePtr &message,
+              Envoy::Http::AsyncClient::Callbacks &cb) {
+    EXPECT_STREQ(method.c_str(), message->headers().Method()->value().c_str());
+    squash_messages_.push_back(std::move(message));
+    squash_callbacks_.push_back(&cb);
+  }
+
+  testing::Sequence squash_requests_;
 };
 
 TEST_F(SquashFilterTest, DecodeHeaderContinuesOnClientFail) {
 
   solo::squash::pb::SquashConfig p;
   p.set_squash_cluster("squash");
-  SquashFilterConfigSharedPtr config(new SquashFilterConfig(p, factory_context_));
+  SquashFilterConfigOwner owner(p, factory_context_);
+  SquashFilterConfigSharedPtr config = owner.config();
   EXPECT_CALL(cm_, httpAsyncClientForCluster("squash"))
       .WillOnce(ReturnRef(cm_.async_client_));
 
@@ -68,7 +160,8 @@ TEST_F(SquashFilterTest, Timeout) {
 
   solo::squash::pb::SquashConfig p;
   p.set_squash_cluster("squash");
-  SquashFilterConfigSharedPtr config(new SquashFilterConfig(p, factory_context_));
+  SquashFilterConfigOwner owner(p, factory_context_);
+  SquashFilterConfigSharedPtr config = owner.config();
 
   EXPECT_CALL(cm_, httpAsyncClientForCluster("squash"))
       .WillOnce(ReturnRef(cm_.async_client_));
@@ -110,5 +203,965 @@ TEST_F(SquashFilterTest, Timeout) {
             filter.decodeData(buffer, false));
 }
 
+TEST_F(SquashFilterTest, CaptureAndReplay) {
+  NiceMock<Envoy::Event::MockTimer> *worker_timer =
+      new NiceMock<Envoy::Event::MockTimer>(
+          &factory_context_.thread_local_.dispatcher_);
+
+  // the spool is written and read on a thread of its own, which posts back
+  // to the worker.
+  std::mutex posted_lock;
+  std::condition_variable posted_cv;
+  std::list<std::function<void()>> posted;
+  ON_CALL(factory_context_.thread_local_.dispatcher_, post(_))
+      .WillByDefault(Invoke([&](std::function<void()> cb) -> void {
+        std::unique_lock<std::mutex> guard(posted_lock);
+        posted.push_back(cb);
+        posted_cv.notify_one();
+      }));
+  auto run_posted = [&]() -> void {
+    std::function<void()> cb;
+    {
+      std::unique_lock<std::mutex> guard(posted_lock);
+      posted_cv.wait(guard, [&]() -> bool { return !posted.empty(); });
+      cb = posted.front();
+      posted.pop_front();
+    }
+    cb();
+  };
+
+  solo::squash::pb::SquashConfig p;
+  p.set_squash_cluster("squash");
+  p.set_capture_and_replay(true);
+  p.set_spool_directory(Envoy::TestEnvironment::temporaryDirectory());
+  SquashFilterConfigOwner owner(p, factory_context_);
+  SquashFilterConfigSharedPtr config = owner.config();
+  EXPECT_CALL(factory_context_.random_, uuid())
+      .WillOnce(Return("replaytoken"));
+  std::string spool_path = Envoy::TestEnvironment::temporaryPath("replaytoken");
+  ::unlink(spool_path.c_str());
+
+  // the debug session is owned by the worker, not by the filter.
+  EXPECT_CALL(cm_, httpAsyncClientForCluster(_)).Times(0);
+
+  SquashFilter filter(config, cm_);
+  filter.setDecoderFilterCallbacks(filter_callbacks_);
+
+  EXPECT_CALL(filter_callbacks_, encodeHeaders_(_, true))
+      .WillOnce(Invoke([](Envoy::Http::HeaderMap &headers, bool) -> void {
+        EXPECT_STREQ("202", headers.Status()->value().c_str());
+        EXPECT_STREQ("replaytoken",
+                     headers.get(Envoy::Http::LowerCaseString(
+                                     "x-squash-replay-token"))
+                         ->value()
+                         .c_str());
+      }));
+
+  Envoy::Http::TestHeaderMapImpl headers{{":method", "POST"},
+                                         {":authority", "www.solo.io"},
+                                         {"x-squash-debug", "true"},
+                                         {"authorization", "Bearer secret"},
+                                         {"cookie", "session=secret"},
+                                         {":path", "/postsomething"}};
+  EXPECT_EQ(Envoy::Http::FilterHeadersStatus::StopIteration,
+            filter.decodeHeaders(headers, false));
+
+  Envoy::Buffer::OwnedImpl buffer("request body");
+  EXPECT_EQ(Envoy::Http::FilterDataStatus::StopIterationNoBuffer,
+            filter.decodeData(buffer, true));
+  filter.onDestroy();
+
+  // once the spool file is written, the session starts.
+  expectSquashRequest(factory_context_.cluster_manager_.async_client_, "POST");
+  run_posted();
+  struct stat spool_stat;
+  ASSERT_EQ(0, ::stat(spool_path.c_str(), &spool_stat));
+  EXPECT_EQ(0600U, spool_stat.st_mode & 0777);
+
+  // the stream is gone. once the session times out the request is replayed.
+  EXPECT_CALL(squash_request_, cancel());
+  worker_timer->callback_();
+
+  EXPECT_CALL(factory_context_.cluster_manager_, httpAsyncClientForCluster("fake_cluster"))
+      .WillOnce(ReturnRef(factory_context_.cluster_manager_.async_client_));
+  EXPECT_CALL(factory_context_.cluster_manager_.async_client_, send_(_, _, _))
+      .WillOnce(Invoke([&](Envoy::Http::MessagePtr &message,
+                           Envoy::Http::AsyncClient::Callbacks &callbacks,
+                           const Envoy::Optional<std::chrono::milliseconds> &)
+                           -> Envoy::Http::AsyncClient::Request * {
+        EXPECT_STREQ("/postsomething",
+                     message->headers().Path()->value().c_str());
+        EXPECT_EQ("request body", message->bodyAsString());
+        // credentials never reach the disk.
+        EXPECT_EQ(nullptr, message->headers().get(
+                               Envoy::Http::LowerCaseString("authorization")));
+        EXPECT_EQ(nullptr, message->headers().get(
+                               Envoy::Http::LowerCaseString("cookie")));
+        callbacks.onSuccess(squashResponse("200"));
+        return nullptr;
+      }));
+  run_posted();
+
+  // the spool file is removed in the background.
+  for (int i = 0; i < 1000 && ::access(spool_path.c_str(), F_OK) == 0; i++) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  EXPECT_NE(0, ::access(spool_path.c_str(), F_OK));
+}
+
+TEST_F(SquashFilterTest, DropsReplayToMissingCluster) {
+  NiceMock<Envoy::Event::MockTimer> *worker_timer =
+      new NiceMock<Envoy::Event::MockTimer>(
+          &factory_context_.thread_local_.dispatcher_);
+
+  std::mutex posted_lock;
+  std::condition_variable posted_cv;
+  std::list<std::function<void()>> posted;
+  ON_CALL(factory_context_.thread_local_.dispatcher_, post(_))
+      .WillByDefault(Invoke([&](std::function<void()> cb) -> void {
+        std::unique_lock<std::mutex> guard(posted_lock);
+        posted.push_back(cb);
+        posted_cv.notify_one();
+      }));
+  auto run_posted = [&]() -> void {
+    std::function<void()> cb;
+    {
+      std::unique_lock<std::mutex> guard(posted_lock);
+      posted_cv.wait(guard, [&]() -> bool { return !posted.empty(); });
+      cb = posted.front();
+      posted.pop_front();
+    }
+    cb();
+  };
+
+  solo::squash::pb::SquashConfig p;
+  p.set_squash_cluster("squash");
+  p.set_capture_and_replay(true);
+  p.set_spool_directory(Envoy::TestEnvironment::temporaryDirectory());
+  SquashFilterConfigOwner owner(p, factory_context_);
+  SquashFilterConfigSharedPtr config = owner.config();
+  EXPECT_CALL(factory_context_.random_, uuid())
+      .WillOnce(Return("missingcluster"));
+  std::string spool_path =
+      Envoy::TestEnvironment::temporaryPath("missingcluster");
+  ::unlink(spool_path.c_str());
+
+  SquashFilter filter(config, cm_);
+  filter.setDecoderFilterCallbacks(filter_callbacks_);
+  Envoy::Http::TestHeaderMapImpl headers{{":method", "GET"},
+                                         {":authority", "www.solo.io"},
+                                         {"x-squash-debug", "true"},
+                                         {":path", "/getsomething"}};
+  EXPECT_EQ(Envoy::Http::FilterHeadersStatus::StopIteration,
+            filter.decodeHeaders(headers, true));
+  filter.onDestroy();
+
+  expectSquashRequest(factory_context_.cluster_manager_.async_client_, "POST");
+  run_posted();
+  EXPECT_CALL(squash_request_, cancel());
+  worker_timer->callback_();
+
+  // the route's cluster went away while the session ran.
+  EXPECT_CALL(factory_context_.cluster_manager_, get("fake_cluster"))
+      .WillRepeatedly(Return(nullptr));
+  EXPECT_CALL(factory_context_.cluster_manager_,
+              httpAsyncClientForCluster("fake_cluster"))
+      .Times(0);
+  run_posted();
+  EXPECT_EQ(1U, factory_context_.scope_.counter("squash.failed_replays").value());
+
+  for (int i = 0; i < 1000 && ::access(spool_path.c_str(), F_OK) == 0; i++) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  EXPECT_NE(0, ::access(spool_path.c_str(), F_OK));
+}
+
+TEST_F(SquashFilterTest, UsesPreprovisionedAttachment) {
+  new NiceMock<Envoy::Event::MockTimer>(&factory_context_.dispatcher_);
+  ON_CALL(factory_context_.dispatcher_, post(_))
+      .WillByDefault(Invoke([](std::function<void()> cb) -> void { cb(); }));
+
+  // the first attachment and, once taken, its replacement.
+  expectSquashRequest(factory_context_.cluster_manager_.async_client_, "POST");
+  expectSquashRequest(factory_context_.cluster_manager_.async_client_, "POST");
+
+  solo::squash::pb::SquashConfig p;
+  p.set_squash_cluster("squash");
+  p.set_preprovision_attachment(true);
+  SquashFilterConfigOwner owner(p, factory_context_);
+  SquashFilterConfigSharedPtr config = owner.config();
+
+  squash_callbacks_[0]->onSuccess(
+      squashResponse("201", "{\"metadata\":{\"name\":\"provisioned\"}}"));
+
+  // a triggered request goes straight to checking the attachment.
+  EXPECT_CALL(cm_, httpAsyncClientForCluster("squash"))
+      .WillOnce(ReturnRef(cm_.async_client_));
+  expectSquashRequest("GET");
+
+  SquashFilter filter(config, cm_);
+  filter.setDecoderFilterCallbacks(filter_callbacks_);
+
+  Envoy::Http::TestHeaderMapImpl headers{{":method", "GET"},
+                                         {":authority", "www.solo.io"},
+                                         {"x-squash-debug", "true"},
+                                         {":path", "/getsomething"}};
+  EXPECT_EQ(Envoy::Http::FilterHeadersStatus::StopIteration,
+            filter.decodeHeaders(headers, true));
+  ASSERT_EQ(3U, squash_messages_.size());
+  EXPECT_STREQ("/api/v2/debugattachment/provisioned",
+               squash_messages_[2]->headers().Path()->value().c_str());
+
+  // the poll, and the refreshed attachment that is still being created when
+  // the config goes away.
+  EXPECT_CALL(squash_request_, cancel()).Times(2);
+  filter.onDestroy();
+}
+
+TEST_F(SquashFilterTest, HedgesSlowPoll) {
+  // timers are handed out in reverse order of creation.
+  NiceMock<Envoy::Event::MockTimer> *hedge_timer =
+      new NiceMock<Envoy::Event::MockTimer>(&filter_callbacks_.dispatcher_);
+  attachment_timeout_timer_ =
+      new NiceMock<Envoy::Event::MockTimer>(&filter_callbacks_.dispatcher_);
+
+  solo::squash::pb::SquashConfig p;
+  p.set_squash_cluster("squash");
+  p.mutable_hedge_delay()->set_nanos(10000000);
+  p.mutable_hedge_budget_percent()->set_value(100);
+  SquashFilterConfigOwner owner(p, factory_context_);
+  SquashFilterConfigSharedPtr config = owner.config();
+
+  EXPECT_CALL(cm_, httpAsyncClientForCluster("squash"))
+      .WillRepeatedly(ReturnRef(cm_.async_client_));
+  expectSquashRequest("POST");
+  expectSquashRequest("GET");
+  expectSquashRequest("GET");
+
+  SquashFilter filter(config, cm_);
+  filter.setDecoderFilterCallbacks(filter_callbacks_);
+
+  Envoy::Http::TestHeaderMapImpl headers{{":method", "GET"},
+                                         {":authority", "www.solo.io"},
+                                         {"x-squash-debug", "true"},
+                                         {":path", "/getsomething"}};
+  EXPECT_EQ(Envoy::Http::FilterHeadersStatus::StopIteration,
+            filter.decodeHeaders(headers, true));
+
+  EXPECT_CALL(*hedge_timer, enableTimer(std::chrono::milliseconds(10)));
+  squash_callbacks_[0]->onSuccess(
+      squashResponse("201", "{\"metadata\":{\"name\":\"a1\"}}"));
+
+  // the poll is slow, a duplicate goes out and answers first.
+  hedge_timer->callback_();
+  ASSERT_EQ(3U, squash_callbacks_.size());
+
+  EXPECT_CALL(squash_request_, cancel());
+  EXPECT_CALL(filter_callbacks_, continueDecoding());
+  squash_callbacks_[2]->onSuccess(
+      squashResponse("200", "{\"status\":{\"state\":\"attached\"}}"));
+}
+
+TEST_F(SquashFilterTest, FailedPollWaitsForHedge) {
+  // timers are handed out in reverse order of creation.
+  NiceMock<Envoy::Event::MockTimer> *hedge_timer =
+      new NiceMock<Envoy::Event::MockTimer>(&filter_callbacks_.dispatcher_);
+  attachment_timeout_timer_ =
+      new NiceMock<Envoy::Event::MockTimer>(&filter_callbacks_.dispatcher_);
+
+  solo::squash::pb::SquashConfig p;
+  p.set_squash_cluster("squash");
+  p.mutable_hedge_delay()->set_nanos(10000000);
+  p.mutable_hedge_budget_percent()->set_value(100);
+  SquashFilterConfigOwner owner(p, factory_context_);
+  SquashFilterConfigSharedPtr config = owner.config();
+
+  EXPECT_CALL(cm_, httpAsyncClientForCluster("squash"))
+      .WillRepeatedly(ReturnRef(cm_.async_client_));
+  expectSquashRequest("POST");
+  expectSquashRequest("GET");
+  expectSquashRequest("GET");
+
+  SquashFilter filter(config, cm_);
+  filter.setDecoderFilterCallbacks(filter_callbacks_);
+
+  Envoy::Http::TestHeaderMapImpl headers{{":method", "GET"},
+                                         {":authority", "www.solo.io"},
+                                         {"x-squash-debug", "true"},
+                                         {":path", "/getsomething"}};
+  EXPECT_EQ(Envoy::Http::FilterHeadersStatus::StopIteration,
+            filter.decodeHeaders(headers, true));
+
+  squash_callbacks_[0]->onSuccess(
+      squashResponse("201", "{\"metadata\":{\"name\":\"a1\"}}"));
+  hedge_timer->callback_();
+  ASSERT_EQ(3U, squash_callbacks_.size());
+
+  // the hedge fails first; the slow poll still decides.
+  EXPECT_CALL(filter_callbacks_, continueDecoding()).Times(0);
+  squash_callbacks_[2]->onSuccess(squashResponse("503"));
+  testing::Mock::VerifyAndClearExpectations(&filter_callbacks_);
+
+  EXPECT_CALL(filter_callbacks_, continueDecoding());
+  squash_callbacks_[1]->onSuccess(
+      squashResponse("200", "{\"status\":{\"state\":\"attached\"}}"));
+}
+
+TEST_F(SquashFilterTest, NoHedgingWithoutBudget) {
+  solo::squash::pb::SquashConfig p;
+  p.set_squash_cluster("squash");
+  p.mutable_hedge_delay()->set_nanos(10000000);
+  EXPECT_TRUE(SquashFilterConfig(p, factory_context_).hedging());
+
+  p.mutable_hedge_budget_percent()->set_value(0);
+  EXPECT_FALSE(SquashFilterConfig(p, factory_context_).hedging());
+}
+
+TEST_F(SquashFilterTest, DeletesAbandonedAttachment) {
+  // timers are handed out in reverse order of creation.
+  NiceMock<Envoy::Event::MockTimer> *reaper_timer =
+      new NiceMock<Envoy::Event::MockTimer>(
+          &factory_context_.thread_local_.dispatcher_);
+  new NiceMock<Envoy::Event::MockTimer>(
+      &factory_context_.thread_local_.dispatcher_);
+  attachment_timeout_timer_ =
+      new NiceMock<Envoy::Event::MockTimer>(&filter_callbacks_.dispatcher_);
+
+  solo::squash::pb::SquashConfig p;
+  p.set_squash_cluster("squash");
+  p.set_cleanup_abandoned_attachments(true);
+  SquashFilterConfigOwner owner(p, factory_context_);
+  SquashFilterConfigSharedPtr config = owner.config();
+
+  EXPECT_CALL(cm_, httpAsyncClientForCluster("squash"))
+      .WillRepeatedly(ReturnRef(cm_.async_client_));
+  expectSquashRequest("POST");
+  expectSquashRequest("GET");
+
+  SquashFilter filter(config, cm_);
+  filter.setDecoderFilterCallbacks(filter_callbacks_);
+
+  Envoy::Http::TestHeaderMapImpl headers{{":method", "GET"},
+                                         {":authority", "www.solo.io"},
+                                         {"x-squash-debug", "true"},
+                                         {":path", "/getsomething"}};
+  EXPECT_EQ(Envoy::Http::FilterHeadersStatus::StopIteration,
+            filter.decodeHeaders(headers, true));
+
+  squash_callbacks_[0]->onSuccess(
+      squashResponse("201", "{\"metadata\":{\"name\":\"a1\"}}"));
+
+  // nobody attaches in time; the attachment is deleted in the background,
+  // and again after a backoff when that fails.
+  EXPECT_CALL(squash_request_, cancel());
+  EXPECT_CALL(filter_callbacks_, continueDecoding());
+  expectSquashResponse(factory_context_.cluster_manager_.async_client_,
+                       "DELETE", "503");
+  EXPECT_CALL(*reaper_timer, enableTimer(std::chrono::milliseconds(1000)));
+  attachment_timeout_timer_->callback_();
+  ASSERT_EQ(3U, squash_messages_.size());
+  EXPECT_STREQ("/api/v2/debugattachment/a1",
+               squash_messages_[2]->headers().Path()->value().c_str());
+
+  expectSquashResponse(factory_context_.cluster_manager_.async_client_,
+                       "DELETE", "404");
+  reaper_timer->callback_();
+  ASSERT_EQ(4U, squash_messages_.size());
+  EXPECT_STREQ("/api/v2/debugattachment/a1",
+               squash_messages_[3]->headers().Path()->value().c_str());
+}
+
+TEST_F(SquashFilterTest, ReleasesPausedStreamsOnDrain) {
+  NiceMock<Envoy::Event::MockTimer> *drain_timer =
+      new NiceMock<Envoy::Event::MockTimer>(
+          &factory_context_.thread_local_.dispatcher_);
+  attachment_timeout_timer_ =
+      new NiceMock<Envoy::Event::MockTimer>(&filter_callbacks_.dispatcher_);
+
+  solo::squash::pb::SquashConfig p;
+  p.set_squash_cluster("squash");
+  SquashFilterConfigOwner owner(p, factory_context_);
+  SquashFilterConfigSharedPtr config = owner.config();
+
+  EXPECT_CALL(cm_, httpAsyncClientForCluster("squash"))
+      .WillOnce(ReturnRef(cm_.async_client_));
+  expectSquashRequest("POST");
+
+  SquashFilter filter(config, cm_);
+  filter.setDecoderFilterCallbacks(filter_callbacks_);
+
+  Envoy::Http::TestHeaderMapImpl headers{{":method", "GET"},
+                                         {":authority", "www.solo.io"},
+                                         {"x-squash-debug", "true"},
+                                         {":path", "/getsomething"}};
+  EXPECT_CALL(*drain_timer, enableTimer(std::chrono::milliseconds(1000)))
+      .Times(2);
+  EXPECT_EQ(Envoy::Http::FilterHeadersStatus::StopIteration,
+            filter.decodeHeaders(headers, true));
+
+  EXPECT_CALL(factory_context_.drain_manager_, drainClose())
+      .WillOnce(Return(false))
+      .WillOnce(Return(true));
+  drain_timer->callback_();
+
+  EXPECT_CALL(squash_request_, cancel());
+  EXPECT_CALL(filter_callbacks_, continueDecoding());
+  drain_timer->callback_();
+  EXPECT_EQ(1U, factory_context_.scope_.counter("squash.released_streams").value());
+
+  filter.onDestroy();
+}
+
+TEST_F(SquashFilterTest, PassesThroughUntilClusterArrives) {
+  solo::squash::pb::SquashConfig p;
+  p.set_squash_cluster("squash");
+  EXPECT_CALL(factory_context_.cluster_manager_, get("squash"))
+      .WillOnce(Return(nullptr));
+  SquashFilterConfigOwner owner(p, factory_context_);
+  SquashFilterConfigSharedPtr config = owner.config();
+
+  SquashFilter filter(config, cm_);
+  filter.setDecoderFilterCallbacks(filter_callbacks_);
+
+  Envoy::Http::TestHeaderMapImpl headers{{":method", "GET"},
+                                         {":authority", "www.solo.io"},
+                                         {"x-squash-debug", "true"},
+                                         {":path", "/getsomething"}};
+  EXPECT_CALL(cm_, get("squash")).WillOnce(Return(nullptr));
+  EXPECT_CALL(cm_, httpAsyncClientForCluster(_)).Times(0);
+  EXPECT_EQ(Envoy::Http::FilterHeadersStatus::Continue,
+            filter.decodeHeaders(headers, true));
+  EXPECT_EQ(1U,
+            factory_context_.scope_.counter("squash.cluster_unavailable").value());
+
+  // once CDS delivers the cluster, triggered requests are held again.
+  EXPECT_CALL(cm_, get("squash")).WillRepeatedly(Return(&cm_.thread_local_cluster_));
+  EXPECT_CALL(cm_, httpAsyncClientForCluster("squash"))
+      .WillOnce(ReturnRef(cm_.async_client_));
+  expectSquashRequest("POST");
+  SquashFilter next_filter(config, cm_);
+  next_filter.setDecoderFilterCallbacks(filter_callbacks_);
+  EXPECT_EQ(Envoy::Http::FilterHeadersStatus::StopIteration,
+            next_filter.decodeHeaders(headers, true));
+
+  EXPECT_CALL(squash_request_, cancel());
+  next_filter.onDestroy();
+}
+
+TEST_F(SquashFilterTest, ShadowsAttachedRequest) {
+  solo::squash::pb::SquashConfig p;
+  p.set_squash_cluster("squash");
+  p.set_shadow_cluster("debug_replica");
+  SquashFilterConfigOwner owner(p, factory_context_);
+  SquashFilterConfigSharedPtr config = owner.config();
+
+  EXPECT_CALL(cm_, httpAsyncClientForCluster("squash"))
+      .WillRepeatedly(ReturnRef(cm_.async_client_));
+  EXPECT_CALL(cm_, httpAsyncClientForCluster("debug_replica"))
+      .WillOnce(ReturnRef(cm_.async_client_));
+  expectSquashRequest("POST");
+  expectSquashResponse("GET", "200", "{\"status\":{\"state\":\"attached\"}}");
+  // the triggering request itself, answered by the replica.
+  expectSquashResponse("GET", "200", "debugged");
+
+  SquashFilter filter(config, cm_);
+  filter.setDecoderFilterCallbacks(filter_callbacks_);
+
+  Envoy::Http::TestHeaderMapImpl headers{{":method", "GET"},
+                                         {":authority", "www.solo.io"},
+                                         {"x-squash-debug", "true"},
+                                         {":path", "/getsomething"}};
+  EXPECT_EQ(Envoy::Http::FilterHeadersStatus::StopIteration,
+            filter.decodeHeaders(headers, true));
+
+  // the replica answers; the request never continues to production.
+  EXPECT_CALL(filter_callbacks_, continueDecoding()).Times(0);
+  EXPECT_CALL(filter_callbacks_, encodeHeaders_(_, false))
+      .WillOnce(Invoke([](Envoy::Http::HeaderMap &headers, bool) -> void {
+        EXPECT_STREQ("200", headers.Status()->value().c_str());
+      }));
+  EXPECT_CALL(filter_callbacks_, encodeData(_, true));
+  squash_callbacks_[0]->onSuccess(
+      squashResponse("201", "{\"metadata\":{\"name\":\"a1\"}}"));
+
+  ASSERT_EQ(3U, squash_messages_.size());
+  EXPECT_STREQ("/getsomething",
+               squash_messages_[2]->headers().Path()->value().c_str());
+  EXPECT_EQ(1U,
+            factory_context_.scope_.counter("squash.shadowed_requests").value());
+  filter.onDestroy();
+}
+
+TEST_F(SquashFilterTest, PinsRequestToDebuggedEndpoint) {
+  solo::squash::pb::SquashConfig p;
+  p.set_squash_cluster("squash");
+  SquashFilterConfigOwner owner(p, factory_context_);
+  SquashFilterConfigSharedPtr config = owner.config();
+
+  EXPECT_CALL(cm_, httpAsyncClientForCluster("squash"))
+      .WillRepeatedly(ReturnRef(cm_.async_client_));
+  expectSquashRequest("POST");
+  expectSquashRequest("GET");
+
+  SquashFilter filter(config, cm_);
+  filter.setDecoderFilterCallbacks(filter_callbacks_);
+
+  Envoy::Http::TestHeaderMapImpl headers{{":method", "GET"},
+                                         {":authority", "www.solo.io"},
+                                         {"x-squash-debug", "true"},
+                                         {":path", "/getsomething"}};
+  EXPECT_EQ(Envoy::Http::FilterHeadersStatus::StopIteration,
+            filter.decodeHeaders(headers, true));
+
+  squash_callbacks_[0]->onSuccess(
+      squashResponse("201", "{\"metadata\":{\"name\":\"a1\"}}"));
+
+  EXPECT_CALL(filter_callbacks_, continueDecoding());
+  squash_callbacks_[1]->onSuccess(squashResponse(
+      "200",
+      "{\"status\":{\"state\":\"attached\",\"endpoint\":\"10.0.0.5:8080\"}}"));
+
+  EXPECT_EQ("10.0.0.5:8080", headers.get_("x-squash-debug-endpoint"));
+}
+
+TEST_F(SquashFilterTest, DropsClientSuppliedEndpoint) {
+  solo::squash::pb::SquashConfig p;
+  p.set_squash_cluster("squash");
+  SquashFilterConfigOwner owner(p, factory_context_);
+  SquashFilterConfigSharedPtr config = owner.config();
+
+  SquashFilter filter(config, cm_);
+  filter.setDecoderFilterCallbacks(filter_callbacks_);
+
+  // an untriggered request must not pick the debugged instance either.
+  Envoy::Http::TestHeaderMapImpl headers{
+      {":method", "GET"},
+      {":authority", "www.solo.io"},
+      {"x-squash-debug-endpoint", "10.0.0.5:8080"},
+      {":path", "/getsomething"}};
+  EXPECT_EQ(Envoy::Http::FilterHeadersStatus::Continue,
+            filter.decodeHeaders(headers, true));
+  EXPECT_EQ(nullptr, headers.get(Envoy::Http::LowerCaseString(
+                         "x-squash-debug-endpoint")));
+}
+
+TEST_F(SquashFilterTest, PinsRequestAttachedInline) {
+  new NiceMock<Envoy::Event::MockTimer>(&factory_context_.dispatcher_);
+  ON_CALL(factory_context_.dispatcher_, post(_))
+      .WillByDefault(Invoke([](std::function<void()> cb) -> void { cb(); }));
+
+  // the first attachment and, once taken, its replacement.
+  expectSquashRequest(factory_context_.cluster_manager_.async_client_, "POST");
+  expectSquashRequest(factory_context_.cluster_manager_.async_client_, "POST");
+
+  solo::squash::pb::SquashConfig p;
+  p.set_squash_cluster("squash");
+  p.set_preprovision_attachment(true);
+  SquashFilterConfigOwner owner(p, factory_context_);
+  SquashFilterConfigSharedPtr config = owner.config();
+
+  squash_callbacks_[0]->onSuccess(
+      squashResponse("201", "{\"metadata\":{\"name\":\"provisioned\"}}"));
+
+  // the debugger is on the provisioned attachment already.
+  EXPECT_CALL(cm_, httpAsyncClientForCluster("squash"))
+      .WillOnce(ReturnRef(cm_.async_client_));
+  expectSquashResponse(
+      "GET", "200",
+      "{\"status\":{\"state\":\"attached\",\"endpoint\":\"10.0.0.5:8080\"}}");
+
+  SquashFilter filter(config, cm_);
+  filter.setDecoderFilterCallbacks(filter_callbacks_);
+
+  Envoy::Http::TestHeaderMapImpl headers{{":method", "GET"},
+                                         {":authority", "www.solo.io"},
+                                         {"x-squash-debug", "true"},
+                                         {":path", "/getsomething"}};
+  EXPECT_CALL(filter_callbacks_, continueDecoding()).Times(0);
+  EXPECT_EQ(Envoy::Http::FilterHeadersStatus::Continue,
+            filter.decodeHeaders(headers, true));
+  EXPECT_EQ("10.0.0.5:8080", headers.get_("x-squash-debug-endpoint"));
+
+  filter.onDestroy();
+  // the refreshed attachment, still being created when the config goes away.
+  EXPECT_CALL(squash_request_, cancel());
+}
+
+TEST_F(SquashFilterTest, TriggersProfileWithoutPausing) {
+  solo::squash::pb::SquashConfig p;
+  p.set_squash_cluster("squash");
+  p.set_profile_template("{\"spec\":{\"profile_duration\":\"10s\"}}");
+  SquashFilterConfigOwner owner(p, factory_context_);
+  SquashFilterConfigSharedPtr config = owner.config();
+
+  // the worker sends the create; the stream has nothing to wait for.
+  EXPECT_CALL(cm_, httpAsyncClientForCluster(_)).Times(0);
+  expectSquashResponse(factory_context_.cluster_manager_.async_client_, "POST",
+                       "201", "{\"metadata\":{\"name\":\"p1\"}}");
+
+  SquashFilter filter(config, cm_);
+  filter.setDecoderFilterCallbacks(filter_callbacks_);
+
+  Envoy::Http::TestHeaderMapImpl headers{{":method", "GET"},
+                                         {":authority", "www.solo.io"},
+                                         {"x-squash-profile", "true"},
+                                         {":path", "/getsomething"}};
+  EXPECT_EQ(Envoy::Http::FilterHeadersStatus::Continue,
+            filter.decodeHeaders(headers, true));
+  ASSERT_EQ(1U, squash_messages_.size());
+  EXPECT_NE(std::string::npos,
+            squash_messages_[0]->bodyAsString().find("profile_duration"));
+  EXPECT_EQ(1U,
+            factory_context_.scope_.counter("squash.profiles_triggered").value());
+
+  // within profile_interval of the first; no second profile of the pod.
+  SquashFilter second(config, cm_);
+  second.setDecoderFilterCallbacks(filter_callbacks_);
+  EXPECT_EQ(Envoy::Http::FilterHeadersStatus::Continue,
+            second.decodeHeaders(headers, true));
+  EXPECT_EQ(1U, squash_messages_.size());
+  EXPECT_EQ(2U,
+            factory_context_.scope_.counter("squash.profiles_triggered").value());
+}
+
+TEST_F(SquashFilterTest, RetriesProfileAfterFailedCreate) {
+  solo::squash::pb::SquashConfig p;
+  p.set_squash_cluster("squash");
+  p.set_profile_template("{\"spec\":{\"profile_duration\":\"10s\"}}");
+  SquashFilterConfigOwner owner(p, factory_context_);
+  SquashFilterConfigSharedPtr config = owner.config();
+
+  expectSquashResponse(factory_context_.cluster_manager_.async_client_, "POST",
+                       "500");
+  expectSquashResponse(factory_context_.cluster_manager_.async_client_, "POST",
+                       "201", "{\"metadata\":{\"name\":\"p1\"}}");
+
+  Envoy::Http::TestHeaderMapImpl headers{{":method", "GET"},
+                                         {":authority", "www.solo.io"},
+                                         {"x-squash-profile", "true"},
+                                         {":path", "/getsomething"}};
+  SquashFilter filter(config, cm_);
+  filter.setDecoderFilterCallbacks(filter_callbacks_);
+  EXPECT_EQ(Envoy::Http::FilterHeadersStatus::Continue,
+            filter.decodeHeaders(headers, true));
+  ASSERT_EQ(1U, squash_messages_.size());
+
+  // nothing profiles the pod, so the interval does not hold the next one off.
+  SquashFilter second(config, cm_);
+  second.setDecoderFilterCallbacks(filter_callbacks_);
+  EXPECT_EQ(Envoy::Http::FilterHeadersStatus::Continue,
+            second.decodeHeaders(headers, true));
+  EXPECT_EQ(2U, squash_messages_.size());
+}
+
+TEST_F(SquashFilterTest, PausesOnlyUntilProfiling) {
+  solo::squash::pb::SquashConfig p;
+  p.set_squash_cluster("squash");
+  p.set_profile_template("{\"spec\":{\"profile_duration\":\"10s\"}}");
+  p.set_pause_until_profiling(true);
+  SquashFilterConfigOwner owner(p, factory_context_);
+  SquashFilterConfigSharedPtr config = owner.config();
+
+  EXPECT_CALL(cm_, httpAsyncClientForCluster("squash"))
+      .WillRepeatedly(ReturnRef(cm_.async_client_));
+  expectSquashRequest("POST");
+  expectSquashRequest("GET");
+
+  SquashFilter filter(config, cm_);
+  filter.setDecoderFilterCallbacks(filter_callbacks_);
+
+  Envoy::Http::TestHeaderMapImpl headers{{":method", "GET"},
+                                         {":authority", "www.solo.io"},
+                                         {"x-squash-profile", "true"},
+                                         {":path", "/getsomething"}};
+  EXPECT_EQ(Envoy::Http::FilterHeadersStatus::StopIteration,
+            filter.decodeHeaders(headers, true));
+  EXPECT_NE(std::string::npos,
+            squash_messages_[0]->bodyAsString().find("profile_duration"));
+
+  squash_callbacks_[0]->onSuccess(
+      squashResponse("201", "{\"metadata\":{\"name\":\"p1\"}}"));
+
+  // the capture started; the request goes on to the profiled instance.
+  EXPECT_CALL(filter_callbacks_, continueDecoding());
+  squash_callbacks_[1]->onSuccess(squashResponse(
+      "200",
+      "{\"status\":{\"state\":\"profiling\",\"endpoint\":\"10.0.0.5:8080\"}}"));
+
+  EXPECT_EQ("10.0.0.5:8080", headers.get_("x-squash-debug-endpoint"));
+  EXPECT_EQ(1U,
+            factory_context_.scope_.counter("squash.profiles_triggered").value());
+}
+
+TEST_F(SquashFilterTest, CreatesChainAttachmentsInParallel) {
+  solo::squash::pb::SquashConfig p;
+  p.set_squash_cluster("squash");
+  SquashFilterConfigOwner owner(p, factory_context_);
+  SquashFilterConfigSharedPtr config = owner.config();
+
+  EXPECT_CALL(cm_, httpAsyncClientForCluster("squash"))
+      .WillRepeatedly(ReturnRef(cm_.async_client_));
+  for (int i = 0; i < 3; i++) {
+    expectSquashRequest("POST");
+  }
+  expectSquashRequest("GET");
+
+  SquashFilter filter(config, cm_);
+  filter.setDecoderFilterCallbacks(filter_callbacks_);
+
+  Envoy::Http::TestHeaderMapImpl headers{{":method", "GET"},
+                                         {":authority", "www.solo.io"},
+                                         {"x-squash-debug", "true"},
+                                         {"x-squash-debug-chain", "reviews, ratings"},
+                                         {":path", "/getsomething"}};
+  EXPECT_EQ(Envoy::Http::FilterHeadersStatus::StopIteration,
+            filter.decodeHeaders(headers, true));
+
+  // all three creates are out before any of them answered.
+  ASSERT_EQ(3U, squash_callbacks_.size());
+  EXPECT_NE(std::string::npos,
+            squash_messages_[0]->bodyAsString().find("\"reviews\""));
+  EXPECT_NE(std::string::npos,
+            squash_messages_[1]->bodyAsString().find("\"ratings\""));
+  EXPECT_FALSE(headers.has("x-squash-debug-chain"));
+
+  std::vector<std::string> names{"r1", "ra1", "a1"};
+  for (size_t i = 0; i < names.size(); i++) {
+    squash_callbacks_[i]->onSuccess(squashResponse(
+        "201", "{\"metadata\":{\"name\":\"" + names[i] + "\"}}"));
+  }
+
+  EXPECT_CALL(filter_callbacks_, continueDecoding());
+  squash_callbacks_[3]->onSuccess(
+      squashResponse("200", "{\"status\":{\"state\":\"attached\"}}"));
+
+  EXPECT_EQ("reviews=r1,ratings=ra1", headers.get_("x-squash-session"));
+}
+
+TEST_F(SquashFilterTest, AbandonsChainAttachmentCreatedAfterTheStream) {
+  solo::squash::pb::SquashConfig p;
+  p.set_squash_cluster("squash");
+  p.set_cleanup_abandoned_attachments(true);
+  SquashFilterConfigOwner owner(p, factory_context_);
+  SquashFilterConfigSharedPtr config = owner.config();
+
+  EXPECT_CALL(cm_, httpAsyncClientForCluster("squash"))
+      .WillRepeatedly(ReturnRef(cm_.async_client_));
+  expectSquashRequest("POST");
+  expectSquashRequest("POST");
+
+  SquashFilter filter(config, cm_);
+  filter.setDecoderFilterCallbacks(filter_callbacks_);
+
+  Envoy::Http::TestHeaderMapImpl headers{{":method", "GET"},
+                                         {":authority", "www.solo.io"},
+                                         {"x-squash-debug", "true"},
+                                         {"x-squash-debug-chain", "ratings"},
+                                         {":path", "/getsomething"}};
+  EXPECT_EQ(Envoy::Http::FilterHeadersStatus::StopIteration,
+            filter.decodeHeaders(headers, true));
+
+  // only the session's create is cancelled; the server may have made the
+  // chain attachment already.
+  EXPECT_CALL(squash_request_, cancel());
+  filter.onDestroy();
+
+  expectSquashResponse(factory_context_.cluster_manager_.async_client_,
+                       "DELETE", "200");
+  squash_callbacks_[0]->onSuccess(
+      squashResponse("201", "{\"metadata\":{\"name\":\"ra1\"}}"));
+  ASSERT_EQ(3U, squash_messages_.size());
+  EXPECT_STREQ("/api/v2/debugattachment/ra1",
+               squash_messages_[2]->headers().Path()->value().c_str());
+}
+
+TEST_F(SquashFilterTest, SchedulesChainCreates) {
+  solo::squash::pb::SquashConfig p;
+  p.set_squash_cluster("squash");
+  p.set_max_concurrent_requests(1);
+  SquashFilterConfigOwner owner(p, factory_context_);
+  SquashFilterConfigSharedPtr config = owner.config();
+
+  EXPECT_CALL(cm_, httpAsyncClientForCluster("squash"))
+      .WillRepeatedly(ReturnRef(cm_.async_client_));
+  expectSquashRequest("POST");
+
+  SquashFilter filter(config, cm_);
+  filter.setDecoderFilterCallbacks(filter_callbacks_);
+
+  Envoy::Http::TestHeaderMapImpl headers{{":method", "GET"},
+                                         {":authority", "www.solo.io"},
+                                         {"x-squash-debug", "true"},
+                                         {"x-squash-debug-chain", "reviews, ratings"},
+                                         {":path", "/getsomething"}};
+  EXPECT_EQ(Envoy::Http::FilterHeadersStatus::StopIteration,
+            filter.decodeHeaders(headers, true));
+  // the rest wait for the create in flight.
+  ASSERT_EQ(1U, squash_messages_.size());
+  EXPECT_NE(std::string::npos,
+            squash_messages_[0]->bodyAsString().find("\"reviews\""));
+
+  expectSquashRequest("POST");
+  squash_callbacks_[0]->onSuccess(
+      squashResponse("201", "{\"metadata\":{\"name\":\"r1\"}}"));
+  ASSERT_EQ(2U, squash_messages_.size());
+  EXPECT_NE(std::string::npos,
+            squash_messages_[1]->bodyAsString().find("\"ratings\""));
+
+  // the session's create never left the queue; the ratings create still
+  // holds its slot until answered.
+  filter.onDestroy();
+  EXPECT_EQ(0U, config->worker().scheduler().queued());
+  EXPECT_EQ(1U, config->worker().scheduler().inFlight());
+}
+
+TEST_F(SquashFilterTest, ConfirmsAttachmentFromSessionToken) {
+  solo::squash::pb::SquashConfig p;
+  p.set_squash_cluster("squash");
+  p.set_service_name("ratings");
+  SquashFilterConfigOwner owner(p, factory_context_);
+  SquashFilterConfigSharedPtr config = owner.config();
+
+  EXPECT_CALL(cm_, httpAsyncClientForCluster("squash"))
+      .WillOnce(ReturnRef(cm_.async_client_));
+  // no create; the ingress made the attachment.
+  expectSquashRequest("GET");
+
+  SquashFilter filter(config, cm_);
+  filter.setDecoderFilterCallbacks(filter_callbacks_);
+
+  Envoy::Http::TestHeaderMapImpl headers{{":method", "GET"},
+                                         {":authority", "www.solo.io"},
+                                         {"x-squash-debug", "true"},
+                                         {"x-squash-session", "reviews=r1,ratings=ra1"},
+                                         {":path", "/getsomething"}};
+  EXPECT_EQ(Envoy::Http::FilterHeadersStatus::StopIteration,
+            filter.decodeHeaders(headers, true));
+  ASSERT_EQ(1U, squash_messages_.size());
+  EXPECT_STREQ("/api/v2/debugattachment/ra1",
+               squash_messages_[0]->headers().Path()->value().c_str());
+
+  EXPECT_CALL(squash_request_, cancel());
+  filter.onDestroy();
+}
+
+TEST_F(SquashFilterTest, IgnoresSessionTokenNamingAnotherPath) {
+  solo::squash::pb::SquashConfig p;
+  p.set_squash_cluster("squash");
+  p.set_service_name("ratings");
+  SquashFilterConfigOwner owner(p, factory_context_);
+  SquashFilterConfigSharedPtr config = owner.config();
+
+  EXPECT_CALL(cm_, httpAsyncClientForCluster("squash"))
+      .WillOnce(ReturnRef(cm_.async_client_));
+  // not a name the squash server makes; the sidecar creates its own.
+  expectSquashRequest("POST");
+
+  SquashFilter filter(config, cm_);
+  filter.setDecoderFilterCallbacks(filter_callbacks_);
+
+  Envoy::Http::TestHeaderMapImpl headers{
+      {":method", "GET"},
+      {":authority", "www.solo.io"},
+      {"x-squash-debug", "true"},
+      {"x-squash-session", "ratings=../../debugattachment?names=a1"},
+      {":path", "/getsomething"}};
+  EXPECT_EQ(Envoy::Http::FilterHeadersStatus::StopIteration,
+            filter.decodeHeaders(headers, true));
+  ASSERT_EQ(1U, squash_messages_.size());
+  EXPECT_STREQ("/api/v2/debugattachment",
+               squash_messages_[0]->headers().Path()->value().c_str());
+
+  EXPECT_CALL(squash_request_, cancel());
+  filter.onDestroy();
+}
+
+TEST_F(SquashFilterTest, IngressDropsInboundSessionToken) {
+  solo::squash::pb::SquashConfig p;
+  p.set_squash_cluster("squash");
+  SquashFilterConfigOwner owner(p, factory_context_);
+  SquashFilterConfigSharedPtr config = owner.config();
+
+  EXPECT_CALL(cm_, httpAsyncClientForCluster("squash"))
+      .WillRepeatedly(ReturnRef(cm_.async_client_));
+  expectSquashResponse("POST", "500");
+  expectSquashRequest("POST");
+
+  SquashFilter filter(config, cm_);
+  filter.setDecoderFilterCallbacks(filter_callbacks_);
+
+  Envoy::Http::TestHeaderMapImpl headers{{":method", "GET"},
+                                         {":authority", "www.solo.io"},
+                                         {"x-squash-debug", "true"},
+                                         {"x-squash-debug-chain", "ratings"},
+                                         {"x-squash-session", "ratings=r0"},
+                                         {":path", "/getsomething"}};
+  EXPECT_EQ(Envoy::Http::FilterHeadersStatus::StopIteration,
+            filter.decodeHeaders(headers, true));
+  // the create for ratings failed; nothing goes downstream for it.
+  EXPECT_FALSE(headers.has("x-squash-session"));
+
+  EXPECT_CALL(squash_request_, cancel());
+  filter.onDestroy();
+}
+
+TEST_F(SquashFilterTest, SidecarPollsChainAttachmentWhereIngressCreatedIt) {
+  // the ingress and the sidecar run in different pods.
+  solo::squash::pb::SquashConfig ingress;
+  ingress.set_squash_cluster("squash0");
+  ingress.add_squash_cluster_shards("squash1");
+  ingress.add_squash_cluster_shards("squash2");
+  ingress.set_attachment_template(
+      "{\"spec\":{\"attachment\":{\"pod\":\"productpage-1\"}}}");
+  solo::squash::pb::SquashConfig sidecar(ingress);
+  sidecar.set_attachment_template(
+      "{\"spec\":{\"attachment\":{\"pod\":\"ratings-1\"}}}");
+  sidecar.set_service_name("ratings");
+  SquashFilterConfigOwner ingress_owner(ingress, factory_context_);
+  SquashFilterConfigOwner sidecar_owner(sidecar, factory_context_);
+
+  std::vector<std::string> clusters;
+  EXPECT_CALL(cm_, httpAsyncClientForCluster(_))
+      .WillRepeatedly(Invoke([this, &clusters](const std::string &cluster)
+                                 -> Envoy::Http::AsyncClient & {
+        clusters.push_back(cluster);
+        return cm_.async_client_;
+      }));
+  expectSquashRequest("POST");
+  expectSquashRequest("POST");
+  expectSquashRequest("GET");
+
+  SquashFilter ingress_filter(ingress_owner.config(), cm_);
+  ingress_filter.setDecoderFilterCallbacks(filter_callbacks_);
+  Envoy::Http::TestHeaderMapImpl ingress_headers{
+      {":method", "GET"},
+      {":authority", "www.solo.io"},
+      {"x-squash-debug", "true"},
+      {"x-squash-debug-chain", "ratings"},
+      {":path", "/getsomething"}};
+  EXPECT_EQ(Envoy::Http::FilterHeadersStatus::StopIteration,
+            ingress_filter.decodeHeaders(ingress_headers, true));
+
+  SquashFilter sidecar_filter(sidecar_owner.config(), cm_);
+  sidecar_filter.setDecoderFilterCallbacks(filter_callbacks_);
+  Envoy::Http::TestHeaderMapImpl sidecar_headers{
+      {":method", "GET"},
+      {":authority", "www.solo.io"},
+      {"x-squash-debug", "true"},
+      {"x-squash-session", "ratings=ra1"},
+      {":path", "/getsomething"}};
+  EXPECT_EQ(Envoy::Http::FilterHeadersStatus::StopIteration,
+            sidecar_filter.decodeHeaders(sidecar_headers, true));
+
+  // the create for ratings, the ingress' own create, the sidecar's poll.
+  ASSERT_EQ(3U, clusters.size());
+  EXPECT_NE(std::string::npos,
+            squash_messages_[0]->bodyAsString().find("\"ratings\""));
+  EXPECT_EQ(clusters[0], clusters[2]);
+
+  ingress_filter.onDestroy();
+  sidecar_filter.onDestroy();
+}
+
 } // namespace Squash
-} // namespace Solo
\ No newline at end of file
+} // namespace Solo
@@ -0,0 +1,104 @@
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "squash_handoff.h"
+
+#include "test/test_common/environment.h"
+
+#include "gtest/gtest.h"
+
+namespace Solo {
+namespace Squash {
+
+class SessionHandoffTest : public testing::Test {
+protected:
+  SessionHandoffTest()
+      : directory_(Envoy::TestEnvironment::temporaryDirectory() + "/" +
+                   testing::UnitTest::GetInstance()->current_test_info()->name()) {
+    Envoy::TestEnvironment::createPath(directory_);
+  }
+
+  std::string path() {
+    return directory_ + "/squash-handoff-squash." + std::to_string(::getpid());
+  }
+
+  const std::string directory_;
+  const std::chrono::milliseconds ttl_{60000};
+};
+
+TEST_F(SessionHandoffTest, NextProcessResumesActiveAttachments) {
+  {
+    SessionHandoff parent(directory_, "squash", ttl_);
+    EXPECT_EQ("", parent.take());
+    parent.add("a1");
+    parent.add("a2");
+    parent.add("a3");
+    EXPECT_TRUE(parent.remove("a2"));
+  }
+
+  SessionHandoff child(directory_, "squash", ttl_);
+  EXPECT_EQ("a1", child.take());
+  EXPECT_EQ("a3", child.take());
+  EXPECT_EQ("", child.take());
+}
+
+TEST_F(SessionHandoffTest, KeepsReleasedAttachments) {
+  {
+    SessionHandoff parent(directory_, "squash", ttl_);
+    parent.add("a1");
+    parent.add("a2");
+    // released while draining; a later session of this process may resume it.
+    parent.keep("a1");
+    EXPECT_EQ("a1", parent.take());
+    parent.add("a1");
+    parent.keep("a1");
+    parent.keep("a2");
+  }
+
+  SessionHandoff child(directory_, "squash", ttl_);
+  EXPECT_EQ("a1", child.take());
+  EXPECT_EQ("a2", child.take());
+  EXPECT_EQ("", child.take());
+}
+
+TEST_F(SessionHandoffTest, ExpiresAttachmentsNobodyTakes) {
+  SessionHandoff handoff(directory_, "squash", std::chrono::milliseconds(0));
+  handoff.add("a1");
+  handoff.add("a2");
+  handoff.keep("a1");
+  EXPECT_EQ(std::vector<std::string>{"a1"}, handoff.expire());
+  EXPECT_EQ("", handoff.take());
+  EXPECT_TRUE(handoff.expire().empty());
+}
+
+TEST_F(SessionHandoffTest, ClaimedAttachmentsBelongToTheNextProcess) {
+  SessionHandoff parent(directory_, "squash", ttl_);
+  parent.add("a1");
+  parent.add("a2");
+  parent.flush();
+
+  // what a newer process does after reading the file.
+  std::string claimed = path() + ".claimed";
+  ::close(::creat(claimed.c_str(), 0600));
+
+  parent.add("a3");
+  parent.keep("a2");
+  // handed over: neither taken nor deleted here anymore.
+  EXPECT_FALSE(parent.remove("a1"));
+  EXPECT_EQ("", parent.take());
+  EXPECT_TRUE(parent.remove("a3"));
+  EXPECT_NE(0, ::access(claimed.c_str(), F_OK));
+}
+
+TEST_F(SessionHandoffTest, SharedPerSquashCluster) {
+  SessionHandoffSharedPtr handoff = SessionHandoff::get(directory_, "squash", ttl_);
+  EXPECT_EQ(handoff, SessionHandoff::get(directory_, "squash", ttl_));
+  EXPECT_NE(handoff, SessionHandoff::get(directory_, "other", ttl_));
+}
+
+} // namespace Squash
+} // namespace Solo
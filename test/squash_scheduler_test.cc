@@ -0,0 +1,67 @@
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "squash_scheduler.h"
+
+#include "gtest/gtest.h"
+
+namespace Solo {
+namespace Squash {
+
+class TestRequest : public ScheduledRequest {
+public:
+  TestRequest(const std::string &name, std::vector<std::string> &sent)
+      : name_(name), sent_(sent) {}
+
+  void onScheduled() override { sent_.push_back(name_); }
+
+  RequestScheduler::Queue::iterator position_;
+
+private:
+  const std::string name_;
+  std::vector<std::string> &sent_;
+};
+
+TEST(RequestSchedulerTest, ServesEarliestDeadlineFirst) {
+  RequestScheduler scheduler(1);
+  std::vector<std::string> sent;
+  RequestScheduler::Deadline now = std::chrono::steady_clock::now();
+
+  TestRequest first("first", sent);
+  TestRequest late("late", sent);
+  TestRequest early("early", sent);
+  TestRequest cancelled("cancelled", sent);
+  EXPECT_TRUE(scheduler.acquire(first, now, first.position_));
+  EXPECT_FALSE(scheduler.acquire(late, now + std::chrono::seconds(30),
+                                 late.position_));
+  EXPECT_FALSE(scheduler.acquire(early, now + std::chrono::seconds(10),
+                                 early.position_));
+  EXPECT_FALSE(scheduler.acquire(cancelled, now + std::chrono::seconds(1),
+                                 cancelled.position_));
+  EXPECT_EQ(1U, scheduler.inFlight());
+  EXPECT_EQ(3U, scheduler.queued());
+
+  scheduler.dequeue(cancelled.position_);
+  scheduler.release();
+  EXPECT_EQ(std::vector<std::string>({"early"}), sent);
+  scheduler.release();
+  EXPECT_EQ(std::vector<std::string>({"early", "late"}), sent);
+  scheduler.release();
+  EXPECT_EQ(0U, scheduler.inFlight());
+  EXPECT_EQ(0U, scheduler.queued());
+}
+
+TEST(RequestSchedulerTest, NoCap) {
+  RequestScheduler scheduler(0);
+  std::vector<std::string> sent;
+  TestRequest request("request", sent);
+  for (int i = 0; i < 100; i++) {
+    EXPECT_TRUE(scheduler.acquire(request, std::chrono::steady_clock::now(),
+                                  request.position_));
+  }
+  EXPECT_EQ(100U, scheduler.inFlight());
+}
+
+} // namespace Squash
+} // namespace Solo
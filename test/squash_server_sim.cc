@@ -0,0 +1,266 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <string>
+
+#include "test/squash_server_sim.h"
+
+#include "squash_api.h"
+
+#include "common/buffer/buffer_impl.h"
+#include "common/http/message_impl.h"
+#include "common/http/utility.h"
+
+#include "test/test_common/utility.h"
+
+namespace Solo {
+namespace Squash {
+
+void SimClock::schedule(std::chrono::milliseconds delay, Event event) {
+  events_.emplace(std::make_pair(now_ + delay, next_seq_++), event);
+}
+
+uint64_t SimClock::advanceTo(std::chrono::milliseconds until) {
+  uint64_t ran = 0;
+  while (!events_.empty() && events_.begin()->first.first <= until) {
+    auto it = events_.begin();
+    now_ = it->first.first;
+    Event event = it->second;
+    events_.erase(it);
+    event();
+    ran++;
+  }
+  now_ = until;
+  return ran;
+}
+
+SimTimer::SimTimer(SimClock &clock, Envoy::Event::TimerCb cb)
+    : clock_(clock), state_(std::make_shared<State>()) {
+  state_->cb_ = cb;
+}
+
+SimTimer::~SimTimer() { disableTimer(); }
+
+void SimTimer::disableTimer() { state_->generation_++; }
+
+void SimTimer::enableTimer(const std::chrono::milliseconds &delay) {
+  uint64_t generation = ++state_->generation_;
+  std::weak_ptr<State> weak_state = state_;
+  clock_.schedule(delay, [weak_state, generation]() -> void {
+    std::shared_ptr<State> state = weak_state.lock();
+    if (state && state->generation_ == generation) {
+      state->generation_++;
+      state->cb_();
+    }
+  });
+}
+
+SimDistribution SimDistribution::fixed(std::chrono::milliseconds value) {
+  return SimDistribution(
+      [value](std::mt19937_64 &) -> std::chrono::milliseconds { return value; });
+}
+
+SimDistribution SimDistribution::uniform(std::chrono::milliseconds min,
+                                         std::chrono::milliseconds max) {
+  return SimDistribution(
+      [min, max](std::mt19937_64 &random) -> std::chrono::milliseconds {
+        std::uniform_int_distribution<int64_t> distribution(min.count(),
+                                                            max.count());
+        return std::chrono::milliseconds(distribution(random));
+      });
+}
+
+SimDistribution SimDistribution::exponential(std::chrono::milliseconds mean) {
+  return SimDistribution(
+      [mean](std::mt19937_64 &random) -> std::chrono::milliseconds {
+        std::exponential_distribution<double> distribution(
+            1.0 / std::max<int64_t>(mean.count(), 1));
+        return std::chrono::milliseconds(
+            static_cast<int64_t>(distribution(random)));
+      });
+}
+
+SimDistribution SimDistribution::logNormal(std::chrono::milliseconds median,
+                                           double sigma) {
+  return SimDistribution(
+      [median, sigma](std::mt19937_64 &random) -> std::chrono::milliseconds {
+        std::lognormal_distribution<double> distribution(
+            std::log(std::max<int64_t>(median.count(), 1)), sigma);
+        return std::chrono::milliseconds(
+            static_cast<int64_t>(distribution(random)));
+      });
+}
+
+SimSquashServer::SimSquashServer(SimClock &clock, const Options &options)
+    : clock_(clock), options_(options), random_(options.seed) {}
+
+Envoy::Http::AsyncClient::Request *
+SimSquashServer::send(Envoy::Http::MessagePtr &message,
+                      Envoy::Http::AsyncClient::Callbacks &callbacks) {
+  Response response = handle(*message);
+  if (!response.polled.empty() && polls_in_flight_[response.polled]++ > 0) {
+    counts_.hedged_polls++;
+  }
+
+  uint64_t id = next_request_++;
+  SimRequestPtr request(new SimRequest(*this, response.polled));
+  Envoy::Http::AsyncClient::Request *in_flight = request.get();
+  in_flight_.emplace(id, std::move(request));
+  Envoy::Http::AsyncClient::Callbacks *cb = &callbacks;
+  clock_.schedule(response.delay, [this, id, cb, response]() -> void {
+    answer(id, *cb, response);
+  });
+  return in_flight;
+}
+
+void SimSquashServer::answer(uint64_t id,
+                             Envoy::Http::AsyncClient::Callbacks &callbacks,
+                             const Response &response) {
+  auto it = in_flight_.find(id);
+  SimRequestPtr request = std::move(it->second);
+  in_flight_.erase(it);
+  if (request->cancelled_) {
+    return;
+  }
+  donePolling(request->polled_);
+
+  Envoy::Http::MessagePtr message(new Envoy::Http::ResponseMessageImpl(
+      Envoy::Http::HeaderMapPtr{
+          new Envoy::Http::TestHeaderMapImpl{{":status", response.status}}}));
+  if (!response.body.empty()) {
+    message->body().reset(new Envoy::Buffer::OwnedImpl(response.body));
+  }
+  callbacks.onSuccess(std::move(message));
+}
+
+void SimSquashServer::donePolling(const std::string &name) {
+  if (!name.empty() && --polls_in_flight_[name] == 0) {
+    polls_in_flight_.erase(name);
+  }
+}
+
+void SimSquashServer::SimRequest::cancel() {
+  if (cancelled_) {
+    return;
+  }
+  cancelled_ = true;
+  server_.counts_.cancels++;
+  server_.donePolling(polled_);
+}
+
+SimSquashServer::Response
+SimSquashServer::handle(Envoy::Http::Message &request) {
+  std::string method = request.headers().Method()->value().c_str();
+  std::string path = request.headers().Path()->value().c_str();
+  Envoy::Http::Utility::QueryParams params =
+      Envoy::Http::Utility::parseQueryString(path);
+  path = path.substr(0, path.find('?'));
+
+  bool slow = next_replica_++ % std::max(options_.replicas, 1U) <
+              options_.slow_replicas;
+  std::chrono::milliseconds latency = options_.latency.sample(random_);
+  if (slow) {
+    latency += options_.slow_latency;
+  }
+
+  Response response{"", "", std::chrono::milliseconds(0), ""};
+  const std::string &collection = SquashApi::postAttachmentPath();
+  if (chance(options_.request_error_rate)) {
+    counts_.errors++;
+    response.status = "503";
+  } else if (method == "POST" && path == collection) {
+    response = create();
+  } else if (method == "GET" && path.size() > collection.size() + 1 &&
+             path.compare(0, collection.size() + 1, collection + "/") == 0) {
+    bool long_poll = params.find("wait") != params.end();
+    std::chrono::milliseconds wait(
+        long_poll ? std::strtoull(params["wait"].c_str(), nullptr, 10) : 0);
+    response = status(path.substr(collection.size() + 1), long_poll, wait,
+                      latency);
+  } else if (method == "DELETE" && path.size() > collection.size() + 1 &&
+             path.compare(0, collection.size() + 1, collection + "/") == 0) {
+    response = remove(path.substr(collection.size() + 1));
+  } else {
+    response.status = "404";
+  }
+
+  response.delay += latency;
+  return response;
+}
+
+SimSquashServer::Response SimSquashServer::create() {
+  counts_.creates++;
+  std::string name = std::to_string(next_attachment_++);
+  Attachment &attachment = attachments_[name];
+  attachment.created = clock_.now();
+  if (chance(options_.never_attach_rate)) {
+    counts_.never_attaching++;
+    attachment.final_at = std::chrono::milliseconds::max();
+  } else {
+    attachment.final_at = clock_.now() + options_.attach_time.sample(random_);
+  }
+  attachment.final_state =
+      chance(options_.attach_error_rate) ? "error" : "attached";
+
+  return Response{"201", "{\"metadata\":{\"name\":\"" + name + "\"}}",
+                  std::chrono::milliseconds(0), ""};
+}
+
+SimSquashServer::Response
+SimSquashServer::status(const std::string &name, bool long_poll,
+                        std::chrono::milliseconds wait,
+                        std::chrono::milliseconds latency) {
+  auto it = attachments_.find(name);
+  if (it == attachments_.end()) {
+    counts_.not_found++;
+    return Response{"404", "", std::chrono::milliseconds(0), ""};
+  }
+
+  std::chrono::milliseconds held(0);
+  if (long_poll) {
+    counts_.long_polls++;
+    // held until the state changes or the wait is over.
+    held = wait;
+    if (it->second.final_at > clock_.now() &&
+        it->second.final_at - clock_.now() < wait) {
+      held = it->second.final_at - clock_.now();
+    } else if (it->second.final_at <= clock_.now()) {
+      held = std::chrono::milliseconds(0);
+    }
+  } else {
+    counts_.polls++;
+  }
+
+  // the state as of when the answer is sent.
+  std::string current = state(it->second, clock_.now() + held + latency);
+  if (current == "attached") {
+    counts_.attached++;
+  }
+  return Response{"200", "{\"metadata\":{\"name\":\"" + name +
+                             "\"},\"status\":{\"state\":\"" + current + "\"}}",
+                  held, name};
+}
+
+SimSquashServer::Response SimSquashServer::remove(const std::string &name) {
+  if (attachments_.erase(name) == 0) {
+    counts_.not_found++;
+    return Response{"404", "", std::chrono::milliseconds(0), ""};
+  }
+  counts_.deletes++;
+  return Response{"200", "", std::chrono::milliseconds(0), ""};
+}
+
+std::string SimSquashServer::state(const Attachment &attachment,
+                                   std::chrono::milliseconds at) const {
+  return at >= attachment.final_at ? attachment.final_state : "none";
+}
+
+bool SimSquashServer::chance(double rate) {
+  if (rate <= 0) {
+    return false;
+  }
+  return std::uniform_real_distribution<double>(0, 1)(random_) < rate;
+}
+
+} // namespace Squash
+} // namespace Solo
@@ -0,0 +1,231 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <random>
+#include <string>
+
+#include "envoy/common/time.h"
+#include "envoy/event/timer.h"
+#include "envoy/http/async_client.h"
+#include "envoy/http/message.h"
+
+namespace Solo {
+namespace Squash {
+
+/**
+ * Simulated clock. Timers and scripted server answers run in deadline order
+ * when the clock is advanced; nothing depends on wall time. Pass it to the
+ * config as its time source so that deadlines and poll latencies use it too.
+ */
+class SimClock : public Envoy::MonotonicTimeSource {
+public:
+  typedef std::function<void()> Event;
+
+  std::chrono::milliseconds now() const { return now_; }
+
+  // MonotonicTimeSource
+  Envoy::MonotonicTime currentTime() override {
+    return Envoy::MonotonicTime(now_);
+  }
+
+  void schedule(std::chrono::milliseconds delay, Event event);
+
+  /**
+   * Runs everything due up to and including until.
+   * @return the number of events that ran.
+   */
+  uint64_t advanceTo(std::chrono::milliseconds until);
+
+private:
+  std::chrono::milliseconds now_{0};
+  uint64_t next_seq_{0};
+  std::map<std::pair<std::chrono::milliseconds, uint64_t>, Event> events_;
+};
+
+/**
+ * Event::Timer on a SimClock.
+ */
+class SimTimer : public Envoy::Event::Timer {
+public:
+  SimTimer(SimClock &clock, Envoy::Event::TimerCb cb);
+  ~SimTimer();
+
+  // Event::Timer
+  void disableTimer() override;
+  void enableTimer(const std::chrono::milliseconds &delay) override;
+
+private:
+  struct State {
+    Envoy::Event::TimerCb cb_;
+    uint64_t generation_{0};
+  };
+
+  SimClock &clock_;
+  std::shared_ptr<State> state_;
+};
+
+/**
+ * A random duration, e.g. the time until a debugger attaches.
+ */
+class SimDistribution {
+public:
+  typedef std::function<std::chrono::milliseconds(std::mt19937_64 &)> Sampler;
+
+  static SimDistribution fixed(std::chrono::milliseconds value);
+  static SimDistribution uniform(std::chrono::milliseconds min,
+                                 std::chrono::milliseconds max);
+  static SimDistribution exponential(std::chrono::milliseconds mean);
+  /**
+   * Long tailed, like most attach times: half the samples are below median.
+   */
+  static SimDistribution logNormal(std::chrono::milliseconds median,
+                                   double sigma);
+
+  std::chrono::milliseconds sample(std::mt19937_64 &random) const {
+    return sampler_(random);
+  }
+
+private:
+  explicit SimDistribution(Sampler sampler) : sampler_(sampler) {}
+
+  Sampler sampler_;
+};
+
+/**
+ * In-process stand-in for the squash server REST api, answering on a
+ * SimClock. Serves:
+ *   POST   /api/v2/debugattachment             create
+ *   GET    /api/v2/debugattachment/<name>      status
+ *   GET    /api/v2/debugattachment/<name>?wait=<ms>
+ *                                              long poll: answers once the
+ *                                              attachment reached a final
+ *                                              state or after wait
+ *   DELETE /api/v2/debugattachment/<name>      delete
+ * Unknown or deleted attachments are answered with a 404. Requests go to the
+ * replicas round robin, the way the squash cluster load balances them.
+ */
+class SimSquashServer {
+public:
+  struct Options {
+    // time from create until the debugger attaches.
+    SimDistribution attach_time{
+        SimDistribution::fixed(std::chrono::milliseconds(3000))};
+    // share of the attachments no debugger ever attaches to.
+    double never_attach_rate{0};
+    // share of the attachments that end in the "error" state.
+    double attach_error_rate{0};
+    // share of the requests answered with a 503.
+    double request_error_rate{0};
+    // time to answer a request.
+    SimDistribution latency{SimDistribution::fixed(std::chrono::milliseconds(5))};
+    uint32_t replicas{1};
+    // the first slow_replicas replicas add slow_latency to every answer.
+    uint32_t slow_replicas{0};
+    std::chrono::milliseconds slow_latency{1000};
+    uint64_t seed{1};
+  };
+
+  struct Counts {
+    uint64_t creates{0};
+    uint64_t polls{0};
+    uint64_t long_polls{0};
+    uint64_t deletes{0};
+    uint64_t not_found{0};
+    uint64_t errors{0};
+    uint64_t cancels{0};
+    // status polls sent while another one for the same attachment was in
+    // flight, i.e. hedges.
+    uint64_t hedged_polls{0};
+    // status answers reporting attached.
+    uint64_t attached{0};
+    // created attachments that never attach.
+    uint64_t never_attaching{0};
+  };
+
+  /**
+   * An answer and when it is sent, relative to the request.
+   */
+  struct Response {
+    std::string status;
+    std::string body;
+    std::chrono::milliseconds delay;
+    // the attachment a status answer is about, empty for other answers.
+    std::string polled;
+  };
+
+  SimSquashServer(SimClock &clock) : SimSquashServer(clock, Options()) {}
+  SimSquashServer(SimClock &clock, const Options &options);
+
+  /**
+   * Answers a request at clock time now() plus the response delay. Fits
+   * MockAsyncClient::send_.
+   * @return the in-flight request, owned by the server. It is valid until
+   *         answered or, if cancelled, until its answer would have been sent.
+   */
+  Envoy::Http::AsyncClient::Request *
+  send(Envoy::Http::MessagePtr &message,
+       Envoy::Http::AsyncClient::Callbacks &callbacks);
+
+  /**
+   * @return the answer to request at the current clock time, without sending
+   *         it. The transport-independent part of send().
+   */
+  Response handle(Envoy::Http::Message &request);
+
+  const Counts &counts() const { return counts_; }
+
+private:
+  struct Attachment {
+    std::chrono::milliseconds created;
+    // when the attachment reaches final_state; max() if never.
+    std::chrono::milliseconds final_at;
+    std::string final_state;
+  };
+
+  class SimRequest : public Envoy::Http::AsyncClient::Request {
+  public:
+    SimRequest(SimSquashServer &server, const std::string &polled)
+        : server_(server), polled_(polled) {}
+
+    // AsyncClient::Request
+    void cancel() override;
+
+    SimSquashServer &server_;
+    const std::string polled_;
+    bool cancelled_{false};
+  };
+
+  typedef std::unique_ptr<SimRequest> SimRequestPtr;
+
+  void answer(uint64_t id, Envoy::Http::AsyncClient::Callbacks &callbacks,
+              const Response &response);
+  void donePolling(const std::string &name);
+  Response create();
+  Response status(const std::string &name, bool long_poll,
+                  std::chrono::milliseconds wait,
+                  std::chrono::milliseconds latency);
+  Response remove(const std::string &name);
+  std::string state(const Attachment &attachment,
+                    std::chrono::milliseconds at) const;
+  bool chance(double rate);
+
+  SimClock &clock_;
+  const Options options_;
+  std::mt19937_64 random_;
+  Counts counts_;
+  uint64_t next_attachment_{0};
+  uint64_t next_replica_{0};
+  uint64_t next_request_{0};
+  std::map<std::string, Attachment> attachments_;
+  // by send() order; erased once answered.
+  std::map<uint64_t, SimRequestPtr> in_flight_;
+  // status polls in flight per attachment.
+  std::map<std::string, uint32_t> polls_in_flight_;
+};
+
+} // namespace Squash
+} // namespace Solo
@@ -0,0 +1,172 @@
+#include <chrono>
+#include <string>
+
+#include "squash_api.h"
+
+#include "test/mocks/http/mocks.h"
+#include "test/squash_server_sim.h"
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+using testing::NiceMock;
+using testing::_;
+
+namespace Solo {
+namespace Squash {
+
+class SimSquashServerTest : public testing::Test {
+protected:
+  std::string create(SimSquashServer &server) {
+    Envoy::Http::MessagePtr request = SquashApi::createAttachmentRequest("{}");
+    SimSquashServer::Response response = server.handle(*request);
+    EXPECT_EQ("201", response.status);
+    return response.body;
+  }
+
+  SimSquashServer::Response get(SimSquashServer &server,
+                                const std::string &path) {
+    return server.handle(*SquashApi::getAttachmentRequest(path));
+  }
+
+  SimClock clock_;
+};
+
+TEST_F(SimSquashServerTest, AttachesAfterAttachTime) {
+  SimSquashServer server(clock_);
+  EXPECT_EQ("{\"metadata\":{\"name\":\"0\"}}", create(server));
+
+  SimSquashServer::Response response =
+      get(server, SquashApi::attachmentPath("0"));
+  EXPECT_EQ("200", response.status);
+  EXPECT_NE(std::string::npos, response.body.find("\"none\""));
+  EXPECT_EQ(std::chrono::milliseconds(5), response.delay);
+
+  clock_.advanceTo(std::chrono::milliseconds(3000));
+  response = get(server, SquashApi::attachmentPath("0"));
+  EXPECT_NE(std::string::npos, response.body.find("\"attached\""));
+  EXPECT_EQ(1U, server.counts().attached);
+}
+
+TEST_F(SimSquashServerTest, LongPollAnswersOnceAttached) {
+  SimSquashServer server(clock_);
+  create(server);
+
+  // held until the attach, not for the whole wait.
+  SimSquashServer::Response response =
+      get(server, SquashApi::attachmentPath("0") + "?wait=10000");
+  EXPECT_NE(std::string::npos, response.body.find("\"attached\""));
+  EXPECT_EQ(std::chrono::milliseconds(3000 + 5), response.delay);
+
+  response = get(server, SquashApi::attachmentPath("1") + "?wait=10000");
+  EXPECT_EQ("404", response.status);
+  EXPECT_EQ(1U, server.counts().long_polls);
+}
+
+TEST_F(SimSquashServerTest, LongPollTimesOut) {
+  SimSquashServer::Options options;
+  options.never_attach_rate = 1;
+  SimSquashServer server(clock_, options);
+  create(server);
+
+  SimSquashServer::Response response =
+      get(server, SquashApi::attachmentPath("0") + "?wait=1000");
+  EXPECT_NE(std::string::npos, response.body.find("\"none\""));
+  EXPECT_EQ(std::chrono::milliseconds(1000 + 5), response.delay);
+  EXPECT_EQ(1U, server.counts().never_attaching);
+}
+
+TEST_F(SimSquashServerTest, Deletes) {
+  SimSquashServer server(clock_);
+  create(server);
+  create(server);
+
+  SimSquashServer::Response response = server.handle(
+      *SquashApi::deleteAttachmentRequest(SquashApi::attachmentPath("1")));
+  EXPECT_EQ("200", response.status);
+  response = server.handle(
+      *SquashApi::deleteAttachmentRequest(SquashApi::attachmentPath("1")));
+  EXPECT_EQ("404", response.status);
+  EXPECT_EQ(1U, server.counts().deletes);
+  EXPECT_EQ(1U, server.counts().not_found);
+
+  EXPECT_EQ("404", get(server, SquashApi::attachmentPath("1")).status);
+  EXPECT_EQ("200", get(server, SquashApi::attachmentPath("0")).status);
+}
+
+TEST_F(SimSquashServerTest, SendsAnswersOnTheClock) {
+  SimSquashServer server(clock_);
+  create(server);
+
+  NiceMock<Envoy::Http::MockAsyncClientCallbacks> callbacks;
+  Envoy::Http::MessagePtr poll =
+      SquashApi::getAttachmentRequest(SquashApi::attachmentPath("0"));
+  server.send(poll, callbacks);
+  // a second poll of the same attachment while the first is in flight.
+  Envoy::Http::MessagePtr hedge =
+      SquashApi::getAttachmentRequest(SquashApi::attachmentPath("0"));
+  Envoy::Http::AsyncClient::Request *request = server.send(hedge, callbacks);
+  EXPECT_EQ(1U, server.counts().hedged_polls);
+
+  // the server keeps the cancelled request until its answer is due.
+  request->cancel();
+  request->cancel();
+  EXPECT_EQ(1U, server.counts().cancels);
+
+  EXPECT_CALL(callbacks, onSuccess_(_)).Times(1);
+  clock_.advanceTo(std::chrono::milliseconds(5));
+
+  // answered; a new poll is not a hedge.
+  Envoy::Http::MessagePtr next =
+      SquashApi::getAttachmentRequest(SquashApi::attachmentPath("0"));
+  EXPECT_CALL(callbacks, onSuccess_(_));
+  server.send(next, callbacks);
+  clock_.advanceTo(std::chrono::milliseconds(10));
+  EXPECT_EQ(1U, server.counts().hedged_polls);
+}
+
+TEST_F(SimSquashServerTest, SlowReplicaAndErrors) {
+  SimSquashServer::Options options;
+  options.replicas = 2;
+  options.slow_replicas = 1;
+  options.slow_latency = std::chrono::milliseconds(2000);
+  SimSquashServer server(clock_, options);
+  create(server);
+
+  // round robin: the second request goes to the fast replica.
+  EXPECT_EQ(std::chrono::milliseconds(5),
+            get(server, SquashApi::attachmentPath("0")).delay);
+  EXPECT_EQ(std::chrono::milliseconds(2005),
+            get(server, SquashApi::attachmentPath("0")).delay);
+
+  SimSquashServer::Options failing;
+  failing.request_error_rate = 1;
+  SimSquashServer failing_server(clock_, failing);
+  EXPECT_EQ("503", failing_server
+                       .handle(*SquashApi::createAttachmentRequest("{}"))
+                       .status);
+  EXPECT_EQ(1U, failing_server.counts().errors);
+  EXPECT_EQ(0U, failing_server.counts().creates);
+}
+
+TEST_F(SimSquashServerTest, AttachTimeDistributions) {
+  std::mt19937_64 random(1);
+  SimDistribution uniform = SimDistribution::uniform(
+      std::chrono::milliseconds(100), std::chrono::milliseconds(200));
+  SimDistribution log_normal =
+      SimDistribution::logNormal(std::chrono::milliseconds(2000), 0.5);
+  uint64_t below_median = 0;
+  for (int i = 0; i < 1000; i++) {
+    std::chrono::milliseconds sample = uniform.sample(random);
+    EXPECT_LE(std::chrono::milliseconds(100), sample);
+    EXPECT_GE(std::chrono::milliseconds(200), sample);
+    if (log_normal.sample(random) < std::chrono::milliseconds(2000)) {
+      below_median++;
+    }
+  }
+  EXPECT_LT(400U, below_median);
+  EXPECT_GT(600U, below_median);
+}
+
+} // namespace Squash
+} // namespace Solo